@@ -7,6 +7,7 @@
 #include "io/StateDump.hpp"
 #include "base/Random.hpp"
 #include "gui/Image.hpp"
+#include "base/Timer.hpp"
 
 #include "extra.h"
 #include "surf.h"
@@ -40,7 +41,7 @@ App::App(void)
 	wireframe_			(false),
     normal_length_		(0.1f),
 	current_subdivision_level_(0),
-	errorbound_			(.9f),
+	errorbound_			(.02f),
 	adaptivetessellation_(false),
 	minstep_(.01f)
 {
@@ -62,13 +63,19 @@ App::App(void)
     common_ctrl_.addToggle(&surfacemode_,									FW_KEY_S,		"Draw surface (S)");
     common_ctrl_.addSeparator();
     common_ctrl_.addToggle(&wireframe_,										FW_KEY_W,		"Draw wireframe (W)");
+	common_ctrl_.addToggle(&animate_control_mesh_,							FW_KEY_NONE,	"Animate control mesh (subdivision stencils)");
+	common_ctrl_.addToggle(&adaptive_subdivision_,							FW_KEY_NONE,	"Adaptive subdivision (up to current level)");
+	common_ctrl_.addToggle(&level_cache_.compact,							FW_KEY_NONE,	"Store subdivision levels compactly");
+	common_ctrl_.addToggle(&level_cache_.background,						FW_KEY_NONE,	"Compute subdivision levels in the background");
     common_ctrl_.addSeparator();
     common_ctrl_.addToggle(&pointmode_,										FW_KEY_P,		"Draw control points (P)");
     common_ctrl_.addSeparator();
 
 	common_ctrl_.beginSliderStack();
-	common_ctrl_.addSlider(&errorbound_, .0f, 4.0f, false, FW_KEY_NONE, FW_KEY_NONE,		"Adaptive tessellation error bound: %.2f", .0f, &errorboundchanged_);
+	common_ctrl_.addSlider(&errorbound_, .001f, 1.0f, true, FW_KEY_NONE, FW_KEY_NONE,		"Adaptive tessellation error bound: %.3f", .0f, &errorboundchanged_);
 	common_ctrl_.addSlider(&minstep_   , .01f, .5f, false, FW_KEY_NONE, FW_KEY_NONE,		"Adaptive tessellation minimum step: %.2f", .0f, &errorboundchanged_);
+	common_ctrl_.addSlider(&level_cache_budget_mb_, 16.0f, 8192.0f, true, FW_KEY_NONE, FW_KEY_NONE,	"Subdivision level cache budget: %.0f MB");
+	common_ctrl_.addSlider(&adaptive_edge_pixels_, 2.0f, 200.0f, true, FW_KEY_NONE, FW_KEY_NONE,	"Adaptive subdivision max edge length: %.1f pixels");
 	common_ctrl_.endSliderStack();
 
     window_.setTitle("Assignment 2");
@@ -168,23 +175,8 @@ bool App::handleEvent(const Window::Event& ev) {
 	// change subdiv level
 	case Action_IncreaseSubdivisionLevel:
 		++current_subdivision_level_;
-		// compute new mesh if we haven't done that already
-		// (also, we need to have the initial model loaded)
-		if (!subdivided_meshes_.empty()
-			&& current_subdivision_level_ >= (int)subdivided_meshes_.size()) {
-			MeshWithConnectivity MWC;
-
-			MWC.fromMesh(*subdivided_meshes_.back());
-
-			// this is where magic happens
-			MWC.LoopSubdivision();
-
-			auto meshPNC = new Mesh<VertexPNC>();
-			MWC.toMesh(*meshPNC);
-
-			subdivided_meshes_.push_back(unique_ptr<MeshBase>(meshPNC));
-			show_debug_highlight_ = false;
-		}
+		// the level cache computes the new mesh when it is first drawn
+		show_debug_highlight_ = false;
 		break;
 
 	case Action_DecreaseSubdivisionLevel:
@@ -230,7 +222,7 @@ void App::keyDownFunc(const Window::Event& ev) {
 		glGetFloatv(GL_MODELVIEW_MATRIX, objectToCamera.getPtr());
 		glGetFloatv(GL_PROJECTION_MATRIX, projection.getPtr());
 
-		MWC.fromMesh(*subdivided_meshes_.back());
+		MWC.fromMesh(*level_cache_.get(current_subdivision_level_));
 		debug_highlight_vertices_ = MWC.debugHighlight(mouse_pos_, projection * objectToCamera);
 
 		show_debug_highlight_ = true;
@@ -315,7 +307,17 @@ void App::drawScene(void) {
     // Call the relevant display lists.
 	if (surfacemode_) {
 		common_ctrl_.message(sprintf("Triangle count: %d", tricount_), "tricount_disp");
-		glCallList(surface_lists_[wireframe_ ? 2 : 1]);
+		if (surface_mesh_ && surface_mesh_->numTriangles() > 0) {
+			Mat4f objectToCamera, projection;
+			glGetFloatv(GL_MODELVIEW_MATRIX, objectToCamera.getPtr());
+			glGetFloatv(GL_PROJECTION_MATRIX, projection.getPtr());
+			glPolygonMode(GL_FRONT_AND_BACK, wireframe_ ? GL_LINE : GL_FILL);
+			surface_mesh_->draw(window_.getGL(), objectToCamera, projection);
+			glUseProgram(0);
+			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		}
+		if (wireframe_)
+			glCallList(surface_lists_[2]);
 	}
 
 	if (curvemode_) {
@@ -342,7 +344,17 @@ void App::drawScene(void) {
 		glGetFloatv (GL_MODELVIEW_MATRIX, objectToCamera.getPtr());
 		glGetFloatv (GL_PROJECTION_MATRIX, projection.getPtr());
 
-		subdivided_meshes_[current_subdivision_level_]->draw( window_.getGL(), objectToCamera, projection );
+		if (animate_control_mesh_) {
+			updateAnimatedMesh();
+			animated_mesh_->draw( window_.getGL(), objectToCamera, projection );
+		} else if (adaptive_subdivision_) {
+			updateAdaptiveMesh(projection * objectToCamera);
+			adaptive_mesh_->draw( window_.getGL(), objectToCamera, projection );
+		} else {
+			level_cache_.budgetBytes = (size_t)level_cache_budget_mb_ << 20;
+			level_cache_.get(current_subdivision_level_)->draw( window_.getGL(), objectToCamera, projection );
+			common_ctrl_.message(level_cache_.describe(), "level_cache_disp");
+		}
 		glUseProgram(0);
 		// clean up, we only want to draw the meshes in wireframe
 		glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
@@ -455,7 +467,7 @@ void App::loadSWP(string filename) {
 	int pathEnd = filename.find_last_of("/\\");
 	string path = filename.substr(0, pathEnd + 1);
 
-    if (!parseFile(in, control_points_, curves_, curve_names_, surfaces_, surface_names_, camerapath_, adaptivetessellation_, .5f+.5f*(1.0f-exp(-errorbound_)), minstep_, path)) {
+    if (!parseFile(in, control_points_, curves_, curve_names_, surfaces_, surface_names_, camerapath_, adaptivetessellation_, errorbound_, minstep_, path)) {
         cerr << "\aerror in file format\a" << endl;
         in.close();
         exit(-1);              
@@ -482,7 +494,8 @@ void App::loadOBJ(string filename) {
     }
 
 	// get rid of the old meshes if necessary
-	subdivided_meshes_.clear();
+	stencils_.clear();
+	adaptive_ = AdaptiveSubdivision();
 
 	// first, weld vertices
 	Mesh<VertexP> meshP(*mesh);
@@ -504,12 +517,68 @@ void App::loadOBJ(string filename) {
 		meshPNC->mutableVertex(i).c = Vec4f(1.0f, 1.0f, 1.0f, 1.0f);
 	delete mesh;
 
-	subdivided_meshes_.push_back(std::unique_ptr<MeshBase>(meshPNC));
+	level_cache_.reset(std::unique_ptr<Mesh<VertexPNC>>(meshPNC));
 
 	common_ctrl_.message(sprintf("Loaded mesh from '%s'", filename.c_str()));
 }
 
 
+//------------------------------------------------------------------------
+
+// Deforms the loaded mesh with a slow twist about the y axis and refines it to the
+// current subdivision level. The stencils depend only on the topology and the level,
+// so they are built once and every frame after that is a sparse matrix-vector product.
+void App::updateAnimatedMesh() {
+	if (stencils_.levels != current_subdivision_level_) {
+		Timer timer(true);
+		control_mesh_ = MeshWithConnectivity();
+		control_mesh_.fromMesh(level_cache_.controlMesh());
+		rest_positions_ = control_mesh_.positions;
+		rest_normals_ = control_mesh_.normals;
+		stencils_.build(control_mesh_, current_subdivision_level_);
+		animated_mesh_.reset(new Mesh<VertexPNC>());
+		common_ctrl_.message(sprintf("Built level %d stencils in %.2f s (%.1f MB)",
+			current_subdivision_level_, timer.end(), stencils_.memoryBytes() / (1024.0f * 1024.0f)));
+	}
+
+	float phase = (GetTickCount() % 4000) / 4000.0f;
+	float amount = 0.1f * FW::sin(2.0f * FW_PI * phase);
+	for (size_t i = 0; i < rest_positions_.size(); ++i) {
+		Mat3f R = Mat3f::rotation(Vec3f(0, 1, 0), amount * rest_positions_[i].y);
+		control_mesh_.positions[i] = R * rest_positions_[i];
+		control_mesh_.normals[i] = R * rest_normals_[i];
+	}
+
+	Timer timer(true);
+	stencils_.evaluate(control_mesh_, animated_refined_);
+	animated_refined_.toMesh(*animated_mesh_);
+	common_ctrl_.message(sprintf("Stencil evaluation: %.2f ms for %d vertices", timer.end() * 1000.0f, stencils_.numRefinedVertices()), "stencil_disp");
+}
+
+//------------------------------------------------------------------------
+
+// Refines the loaded mesh where it matters for the current view. Only the levels whose
+// split edges changed since the last frame are recomputed.
+void App::updateAdaptiveMesh(const Mat4f& worldToClip) {
+	bool changed = false;
+	if (adaptive_.empty()) {
+		adaptive_.setControlMesh(level_cache_.controlMesh());
+		adaptive_mesh_.reset(new Mesh<VertexPNC>());
+		changed = true;
+	}
+
+	adaptive_.maxLevel = current_subdivision_level_;
+	adaptive_.maxEdgePixels = adaptive_edge_pixels_;
+	changed |= adaptive_.update(worldToClip, Vec2f(window_.getSize()));
+	if (changed)
+		adaptive_.result().toMesh(*adaptive_mesh_);
+
+	const MeshWithConnectivity& control = adaptive_.levels[0];
+	common_ctrl_.message(sprintf("Adaptive subdivision: %d triangles, %d levels (uniform level %d: %d triangles)",
+		(int)adaptive_.result().indices.size(), (int)adaptive_.levels.size() - 1,
+		current_subdivision_level_, (int)control.indices.size() << (2 * current_subdivision_level_)), "adaptive_disp");
+}
+
 //------------------------------------------------------------------------
 
 void App::writeObjects(string prefix) {
@@ -551,21 +620,35 @@ void App::makeDisplayLists()
     }
     glEndList();
 
-    glNewList(surface_lists_[1], GL_COMPILE);
-    {
-        for (auto i = 0u; i < surfaces_.size(); ++i)
-            drawSurface(surfaces_[i], true);
-    }
-    glEndList();
+	// All the surfaces go into one indexed mesh. Its vertex and index buffers are uploaded
+	// on the first draw and reused until the surfaces change.
+	size_t num_vertices = 0, num_triangles = 0;
+	for (const Surface& s : surfaces_) {
+		num_vertices += s.VV.size();
+		num_triangles += s.VF.size();
+	}
+	surface_mesh_.reset(new Mesh<VertexPNC>());
+	surface_mesh_->resetVertices((int)num_vertices);
+	surface_mesh_->addSubmesh();
+	Array<Vec3i>& surface_indices = surface_mesh_->mutableIndices(0);
+	surface_indices.resize((int)num_triangles);
+	int vertex_base = 0, triangle_base = 0;
+	for (const Surface& s : surfaces_) {
+		VertexPNC* vertices = surface_mesh_->getMutableVertexPtr(vertex_base);
+		for (size_t i = 0; i < s.VV.size(); ++i)
+			vertices[i] = VertexPNC(s.VV[i], s.VN[i], Vec4f(1.0f));
+		for (size_t i = 0; i < s.VF.size(); ++i)
+			surface_indices[triangle_base + (int)i] = s.VF[i] + vertex_base;
+		vertex_base += (int)s.VV.size();
+		triangle_base += (int)s.VF.size();
+	}
+	tricount_ = (int)num_triangles;
 
+	// normals for the wireframe mode
     glNewList(surface_lists_[2], GL_COMPILE);
     {
-		tricount_ = 0;
-        for (auto i = 0u; i < surfaces_.size(); ++i) {
-			tricount_ += surfaces_[i].VF.size();
-            drawSurface(surfaces_[i], false);
+        for (auto i = 0u; i < surfaces_.size(); ++i)
             drawNormals(surfaces_[i], normal_length_);
-        }
     }
     glEndList();
 
@@ -647,7 +730,35 @@ void App::screenshot (const String& name) {
 
 //------------------------------------------------------------------------
 
+// Command line mode, writes a subdivided mesh without opening the viewer:
+//   -subdivide <input mesh> <levels> <output .bin> [triangles per patch]
+static bool subdivideToFile(const char* input, int levels, const char* output, int patch_faces)
+{
+	MeshBase* mesh = importMesh(input);
+	if (!mesh || hasError()) {
+		FW::printf("Error while loading '%s': %s\n", input, clearError().getPtr());
+		delete mesh;
+		return false;
+	}
+
+	// weld vertices and make smooth normals, as when loading into the viewer
+	Mesh<VertexP> meshP(*mesh);
+	delete mesh;
+	meshP.collapseVertices();
+	Mesh<VertexPNC> meshPNC(meshP);
+	meshPNC.recomputeNormals();
+	for (int i = 0; i < meshPNC.numVertices(); ++i)
+		meshPNC.mutableVertex(i).c = Vec4f(1.0f, 1.0f, 1.0f, 1.0f);
+
+	FW::printf("Subdividing %d triangles to level %d into '%s'\n", meshPNC.numTriangles(), levels, output);
+	return subdivideToBinaryFile(meshPNC, levels, output, patch_faces);
+}
+
 void FW::init(void) {
+	if (argc >= 5 && String(argv[1]) == "-subdivide") {
+		exitCode = subdivideToFile(argv[2], atoi(argv[3]), argv[4], (argc >= 6) ? atoi(argv[5]) : 4096) ? 0 : 1;
+		return;
+	}
     new App;
 }
 
@@ -8,6 +8,7 @@
 #include "camera.h"
 #include "curve.h"
 #include "surf.h"
+#include "Subdiv.hpp"
 
 #include <string>
 #include <vector>
@@ -60,6 +61,8 @@ private:
 	void loadOBJ        (std::string filename);
     void makeDisplayLists(void);
     void screenshot     (const String& name);
+	void updateAnimatedMesh(void);
+	void updateAdaptiveMesh(const Mat4f& worldToClip);
 
     Window              window_;
     CommonControls      common_ctrl_;
@@ -115,12 +118,31 @@ private:
     std::vector<std::string>        curve_names_;
     std::vector<Surface>            surfaces_;
     std::vector<std::string>        surface_names_;
+	std::unique_ptr<Mesh<VertexPNC>> surface_mesh_;	// all the surfaces, drawn from GPU buffers
 
 	std::vector<Vec3f>	debug_highlight_vertices_;
 	bool show_debug_highlight_;
 
-	std::vector<std::unique_ptr<MeshBase>> subdivided_meshes_;
+	// subdivision levels of the loaded mesh, made on demand within a memory budget
+	SubdivisionLevelCache			level_cache_;
+	float							level_cache_budget_mb_ = 512.0f;
 	int								current_subdivision_level_;
+
+	// Animated control mesh, refined to the current level through precomputed stencils
+	// instead of subdividing it again every frame.
+	bool							animate_control_mesh_ = false;
+	SubdivisionStencils				stencils_;
+	MeshWithConnectivity			control_mesh_;
+	std::vector<Vec3f>				rest_positions_;
+	std::vector<Vec3f>				rest_normals_;
+	MeshWithConnectivity			animated_refined_;
+	std::unique_ptr<Mesh<VertexPNC>> animated_mesh_;
+
+	// View-dependent refinement of the loaded mesh, up to the current subdivision level.
+	bool							adaptive_subdivision_ = false;
+	float							adaptive_edge_pixels_ = 24.0f;
+	AdaptiveSubdivision				adaptive_;
+	std::unique_ptr<Mesh<VertexPNC>> adaptive_mesh_;
 };
 
 //------------------------------------------------------------------------
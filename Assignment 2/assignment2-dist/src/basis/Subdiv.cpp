@@ -3,21 +3,256 @@
 #include "gpu/GLContext.hpp"
 #include "3d/Mesh.hpp"
 #include "io/File.hpp"
+#include "io/Stream.hpp"
 #include "io/StateDump.hpp"
 #include "base/Random.hpp"
 
 #include "Subdiv.hpp"
+#include "parallel.h"
 
 #include <stdio.h>
 #include <conio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <thread>
 #include <vector>
-#include <map>
 
 using namespace FW;
 
 namespace FW {
 
+namespace {
+
+// Half-edge record for the connectivity builder: the undirected edge as (min, max) packed
+// into a key, and the half-edge index 3 * triangle + edge.
+struct EdgeRecord
+{
+	U64	key;
+	S32	half_edge;
+};
+
+// Stable parallel LSD radix sort of the records by their low key_bits bits of key.
+void radixSortEdges(std::vector<EdgeRecord>& records, int key_bits)
+{
+	const int digit_bits = 11;
+	const int buckets = 1 << digit_bits;
+
+	int n = (int)records.size();
+	int chunks = numChunks(n);
+	std::vector<EdgeRecord> tmp(n);
+	std::vector<int> offsets(chunks * buckets);
+
+	for (int shift = 0; shift < key_bits; shift += digit_bits) {
+		// Count digits per chunk.
+		parallelChunks(n, chunks, [&](int c, int begin, int end) {
+			int* count = &offsets[c * buckets];
+			std::fill(count, count + buckets, 0);
+			for (int i = begin; i < end; ++i)
+				++count[(records[i].key >> shift) & (buckets - 1)];
+		});
+
+		// Exclusive prefix sum in digit-major, chunk-minor order keeps the sort stable.
+		int sum = 0;
+		for (int d = 0; d < buckets; ++d)
+			for (int c = 0; c < chunks; ++c) {
+				int count = offsets[c * buckets + d];
+				offsets[c * buckets + d] = sum;
+				sum += count;
+			}
+
+		parallelChunks(n, chunks, [&](int c, int begin, int end) {
+			int* offset = &offsets[c * buckets];
+			for (int i = begin; i < end; ++i)
+				tmp[offset[(records[i].key >> shift) & (buckets - 1)]++] = records[i];
+		});
+		records.swap(tmp);
+	}
+}
+
+// Replaces values with their exclusive prefix sum and returns the total.
+int exclusiveScan(std::vector<int>& values)
+{
+	int n = (int)values.size();
+	int chunks = numChunks(n);
+	std::vector<int> chunk_sum(chunks, 0);
+	parallelChunks(n, chunks, [&](int c, int begin, int end) {
+		for (int i = begin; i < end; ++i)
+			chunk_sum[c] += values[i];
+	});
+
+	int total = 0;
+	for (int c = 0; c < chunks; ++c) {
+		int sum = chunk_sum[c];
+		chunk_sum[c] = total;
+		total += sum;
+	}
+
+	parallelChunks(n, chunks, [&](int c, int begin, int end) {
+		int sum = chunk_sum[c];
+		for (int i = begin; i < end; ++i) {
+			int v = values[i];
+			values[i] = sum;
+			sum += v;
+		}
+	});
+	return total;
+}
+
+// Walks the one-ring around the vertex at corner j of triangle i, the same way the
+// subdivision has always done it. For an interior vertex, calls visit(v) for each ring
+// vertex in order and returns false. When the walk runs into a boundary, returns true
+// with the vertex's two boundary neighbors in b1 and b2; visit() may have been called
+// for some ring vertices before that.
+template <class F>
+bool walkRing(const MeshWithConnectivity& m, int i, int j, int& b1, int& b2, const F& visit)
+{
+	int preTri = i;
+	int preEdge = j;
+	int curTri = -1;
+	while (curTri != i) {
+		curTri = m.neighborTris[preTri][preEdge];
+		int curEdge = m.neighborEdges[preTri][preEdge];
+		if (curTri == -1) {
+			b1 = m.indices[preTri][(preEdge + 1) % 3];
+
+			// look for the other boundary in the opposite direction
+			preTri = i;
+			preEdge = (j + 2) % 3;
+			for (;;) {
+				curTri = m.neighborTris[preTri][preEdge];
+				curEdge = m.neighborEdges[preTri][preEdge];
+				if (curTri == -1) {
+					b2 = m.indices[preTri][preEdge];
+					return true;
+				}
+				preTri = curTri;
+				preEdge = (curEdge + 2) % 3;
+			}
+		}
+		visit(m.indices[curTri][(curEdge + 2) % 3]);
+		preTri = curTri;
+		preEdge = (curEdge + 1) % 3;
+	}
+	return false;
+}
+
+// Splits every triangle into four, given the edge numbering: the inner triangle made of
+// the odd vertices first, then one per corner. Odd vertex of edge e is num_vertices + e.
+void splitTriangles(const MeshWithConnectivity& m, int num_vertices, std::vector<Vec3i>& new_indices)
+{
+	int num_tris = (int)m.indices.size();
+	new_indices.resize(num_tris * 4);
+	parallelChunks(num_tris, numChunks(num_tris), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			Vec3i even = m.indices[i];
+			Vec3i odd = Vec3i(num_vertices) + m.edgeIds[i];
+			new_indices[i * 4 + 0] = odd;
+			new_indices[i * 4 + 1] = Vec3i(even[0], odd[0], odd[2]);
+			new_indices[i * 4 + 2] = Vec3i(even[1], odd[1], odd[0]);
+			new_indices[i * 4 + 3] = Vec3i(even[2], odd[2], odd[1]);
+		}
+	});
+}
+
+// Calls emit(v, w) for the vertices and weights that make up vertex r of the next level,
+// with the same rules as LoopSubdivision(). Needs the connectivity and the one-rings.
+template <class F>
+void loopStencil(const MeshWithConnectivity& m, int num_vertices, int r, const F& emit)
+{
+	if (r >= num_vertices) {
+		int h = m.edgeHalfEdges[r - num_vertices];
+		int i = h / 3;
+		int j = h % 3;
+		int i2 = m.neighborTris[i][j];
+		if (i2 == -1) {
+			emit(m.indices[i][j], 0.5f);
+			emit(m.indices[i][(j + 1) % 3], 0.5f);
+		} else {
+			emit(m.indices[i][j], 3.0f / 8.0f);
+			emit(m.indices[i][(j + 1) % 3], 3.0f / 8.0f);
+			emit(m.indices[i][(j + 2) % 3], 1.0f / 8.0f);
+			emit(m.indices[i2][(m.neighborEdges[i][j] + 2) % 3], 1.0f / 8.0f);
+		}
+		return;
+	}
+
+	const int* ring = &m.ringVertices[m.ringOffsets[r]];
+	int n = m.ringOffsets[r + 1] - m.ringOffsets[r];
+	if (n == 0)
+		return;
+	if (m.boundaryVertices[r]) {
+		emit(r, 3.0f / 4.0f);
+		emit(ring[0], 1.0f / 8.0f);
+		emit(ring[1], 1.0f / 8.0f);
+	} else {
+		float B = (n == 3) ? 3.0f / 16.0f : 3.0f / 8.0f / n;
+		emit(r, 1 - n * B);
+		for (int k = 0; k != n; k++)
+			emit(ring[k], B);
+	}
+}
+
+// Unit vector to octahedral coordinates, two 16-bit snorms in one U32.
+U32 encodeOctahedral(const Vec3f& n)
+{
+	float l1 = FW::abs(n.x) + FW::abs(n.y) + FW::abs(n.z);
+	Vec2f p = (l1 > 0.0f) ? n.getXY() / l1 : Vec2f(0.0f);
+	if (n.z < 0.0f)
+		p = Vec2f((1.0f - FW::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f), (1.0f - FW::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+	S32 x = (S32)(clamp(p.x, -1.0f, 1.0f) * 32767.0f + (p.x >= 0.0f ? 0.5f : -0.5f));
+	S32 y = (S32)(clamp(p.y, -1.0f, 1.0f) * 32767.0f + (p.y >= 0.0f ? 0.5f : -0.5f));
+	return (U32)(U16)x | ((U32)(U16)y << 16);
+}
+
+Vec3f decodeOctahedral(U32 v)
+{
+	Vec2f p((S16)(v & 0xFFFF) / 32767.0f, (S16)(v >> 16) / 32767.0f);
+	Vec3f n(p.x, p.y, 1.0f - FW::abs(p.x) - FW::abs(p.y));
+	if (n.z < 0.0f) {
+		n.x = (1.0f - FW::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - FW::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return n.normalized();
+}
+
+// Spreads the low 10 bits of x apart so that two zero bits separate each of them.
+U32 spreadBits(U32 x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// Locates the corners of a refined triangle on its control triangle as integer barycentrics
+// that sum to 2^levels. path holds the child numbers of splitTriangles(), two bits per
+// level with the first split in the highest bits.
+void latticeCorners(int path, int levels, Vec3i c[3])
+{
+	int side = 1 << levels;
+	c[0] = Vec3i(side, 0, 0);
+	c[1] = Vec3i(0, side, 0);
+	c[2] = Vec3i(0, 0, side);
+	for (int l = levels - 1; l >= 0; --l) {
+		int child = (path >> (2 * l)) & 3;
+		Vec3i m[3] = { (c[0] + c[1]) / 2, (c[1] + c[2]) / 2, (c[2] + c[0]) / 2 };
+		if (child == 0) {
+			c[0] = m[0]; c[1] = m[1]; c[2] = m[2];
+		} else {
+			int k = child - 1;
+			Vec3i corner = c[k];
+			c[0] = corner; c[1] = m[k]; c[2] = m[(k + 2) % 3];
+		}
+	}
+}
+
+} // namespace
+
 void MeshWithConnectivity::fromMesh( const Mesh<VertexPNC>& m )
 {
 	positions.resize(m.numVertices());
@@ -41,33 +276,87 @@ void MeshWithConnectivity::fromMesh( const Mesh<VertexPNC>& m )
 }
 
 // assumes vertices and indices are already filled in.
+//
+// Every half-edge is emitted as a record keyed by its undirected edge (min, max). The
+// records are radix sorted, which brings the half-edges of each edge next to each other
+// while keeping them in triangle order. Each run of equal keys is then resolved on its
+// own, replaying the matching rules of the old map-based builder (first come, first
+// matched; a third half-edge reports a non-manifold edge), so the result is identical.
+// The runs also number the undirected edges, in key order.
 void MeshWithConnectivity::computeConnectivity()
 {
 	// assign default values. boundary edges (no neighbor on other side) are denoted by -1.
 	neighborTris.assign(indices.size(), Vec3i(-1,-1,-1));
 	neighborEdges.assign(indices.size(), Vec3i(-1,-1,-1));
+	edgeIds.clear();
+	edgeHalfEdges.clear();
 
-	// bookkeeping: map edges (vert0, vert1) to (triangle, edge_number) pairs
-	typedef std::map<std::pair<int, int>, std::pair<int, int>> edgemap_t;
-	edgemap_t M;
+	int num_half_edges = (int)indices.size() * 3;
+	if (num_half_edges == 0)
+		return;
 
-	for (int i = 0; i < (int)indices.size(); ++i) {
-		// vertex index is also an index for the corresponding edge starting at that vertex
-		for (int j = 0; j < 3; ++j) {
-			int v0 = indices[i][j];
-			int v1 = indices[i][(j+1)%3];
-			auto it = M.find(std::make_pair(v1, v0));
-			if (it == M.end()) {
-				// edge not found, add myself to mapping
-				// (opposite direction than when finding because we look for neighbor edges)
-				M[std::make_pair(v0, v1)] = std::make_pair(i, j);
-			} else {
-				if (it->second.first == -1)	{
-					FW::printf( "Non-manifold edge detected\n" );
+	int vertex_bits = 1;
+	while (vertex_bits < 31 && ((S64)1 << vertex_bits) < (S64)positions.size())
+		++vertex_bits;
+
+	std::vector<EdgeRecord> records(num_half_edges);
+	parallelChunks((int)indices.size(), numChunks((int)indices.size()), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i)
+			for (int j = 0; j < 3; ++j) {
+				int v0 = indices[i][j];
+				int v1 = indices[i][(j+1)%3];
+				EdgeRecord& r = records[i * 3 + j];
+				r.key = ((U64)min(v0, v1) << vertex_bits) | (U64)max(v0, v1);
+				r.half_edge = i * 3 + j;
+			}
+	});
+	radixSortEdges(records, 2 * vertex_bits);
+
+	// Each run of equal keys is one undirected edge. A chunk handles the runs that begin inside it.
+	int chunks = numChunks(num_half_edges);
+	std::vector<int> edge_base(chunks, 0);
+	parallelChunks(num_half_edges, chunks, [&](int c, int begin, int end) {
+		for (int k = begin; k < end; ++k)
+			if (k == 0 || records[k].key != records[k - 1].key)
+				++edge_base[c];
+	});
+	int num_edges = exclusiveScan(edge_base);
+
+	edgeIds.resize(indices.size());
+	edgeHalfEdges.resize(num_edges);
+
+	std::vector<int> non_manifold(chunks, 0);
+	parallelChunks(num_half_edges, chunks, [&](int c, int begin, int end) {
+		while (begin > 0 && begin < end && records[begin].key == records[begin - 1].key)
+			++begin;
+
+		int edge = edge_base[c];
+		for (int run = begin; run < end; ++edge) {
+			int run_end = run + 1;
+			while (run_end < num_half_edges && records[run_end].key == records[run].key)
+				++run_end;
+
+			edgeHalfEdges[edge] = records[run].half_edge;
+			for (int k = run; k < run_end; ++k)
+				edgeIds[records[k].half_edge / 3][records[k].half_edge % 3] = edge;
+
+			// State of the two directed map entries (v0 < v1 and v0 > v1): -2 = absent, -1 = used.
+			Vec2i entry[2] = { Vec2i(-2, -1), Vec2i(-2, -1) };
+			for (int k = run; k < run_end; ++k) {
+				int i = records[k].half_edge / 3;
+				int j = records[k].half_edge % 3;
+				int v0 = indices[i][j];
+				int v1 = indices[i][(j+1)%3];
+				int own = (v0 < v1) ? 0 : 1;
+				int other = (v0 == v1) ? own : 1 - own;
+
+				if (entry[other].x == -2) {
+					entry[own] = Vec2i(i, j);
+				} else if (entry[other].x == -1) {
+					++non_manifold[c];
 				} else {
-					// other site found, let's fill in the data
-					int other_t = it->second.first;
-					int other_e = it->second.second;
+					int other_t = entry[other].x;
+					int other_e = entry[other].y;
 
 					neighborTris[i][j] = other_t;
 					neighborEdges[i][j] = other_e;
@@ -75,12 +364,16 @@ void MeshWithConnectivity::computeConnectivity()
 					neighborTris[other_t][other_e] = i;
 					neighborEdges[other_t][other_e] = j;
 
-					it->second.first = -1;
+					entry[other].x = -1;
 				}
 			}
+			run = run_end;
 		}
-	}
-	
+	});
+
+	for (int c = 0; c < chunks; ++c)
+		for (int k = 0; k < non_manifold[c]; ++k)
+			FW::printf( "Non-manifold edge detected\n" );
 }
 
 // Run a debug version of the subdivision pass where we only subdivide the one triangle
@@ -143,7 +436,7 @@ std::vector<Vec3f> MeshWithConnectivity::debugHighlight(Vec2f mousePos, Mat4f wo
 	return debugPoints;
 }
 
-void MeshWithConnectivity::toMesh(Mesh<VertexPNC>& dest) {
+void MeshWithConnectivity::toMesh(Mesh<VertexPNC>& dest) const {
 	dest.resetVertices((int)positions.size());
 	for (size_t i = 0; i < positions.size(); ++i) {
 		dest.mutableVertex((int)i).p = positions[i];
@@ -154,308 +447,978 @@ void MeshWithConnectivity::toMesh(Mesh<VertexPNC>& dest) {
 	dest.mutableIndices(0).replace(0, dest.indices(0).getSize(), &indices[0], (int)indices.size());
 }
 
-void MeshWithConnectivity::LoopSubdivision() {
-	// generate new (odd) vertices
-
-	// visited edge -> vertex position information
-	// Note that this is different from the one in computeConnectivity()
-	typedef std::map<std::pair<int, int>, int> edgemap_t;
-	edgemap_t new_vertices;
-
-	// The new data must be doublebuffered or otherwise some of the calculations below would
-	// not read the original positions but the newly changed ones, which is slightly wrong.
-	std::vector<Vec3f> new_positions(positions.size());
-	std::vector<Vec3f> new_normals(normals.size());
-	std::vector<Vec3f> new_colors(colors.size());
+void MeshWithConnectivity::computeVertexRings()
+{
+	int num_vertices = (int)positions.size();
+	int num_tris = (int)indices.size();
 
-	// If we're debugging, skip this part since we're only interested in the 1-ring portion. Feel free to change this if you need to.
-	if (!debugPass)
-	{
-		for (size_t i = 0; i < indices.size(); ++i)
+	// The walk around each vertex starts from its first corner in triangle order.
+	std::vector<std::atomic<int>> first_corner(num_vertices);
+	parallelChunks(num_vertices, numChunks(num_vertices), [&](int, int begin, int end) {
+		for (int v = begin; v < end; ++v)
+			first_corner[v].store(INT_MAX, std::memory_order_relaxed);
+	});
+	parallelChunks(num_tris, numChunks(num_tris), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i)
 			for (int j = 0; j < 3; ++j) {
-				int v0 = indices[i][j];
-				int v1 = indices[i][(j + 1) % 3];
-
-				// Map the edge endpoint indices to new vertex index.
-				// We use min and max because the edge direction does not matter when we finally
-				// rebuild the new faces (R3); this is how we always get unique indices for the map.
-				auto edge = std::make_pair(min(v0, v1), max(v0, v1));
-
-				// With naive iteration, we would find each edge twice, because each is part of two triangles
-				// (if the mesh does not have any holes/empty borders). Thus, we keep track of the already
-				// visited edges in the new_vertices map. That requires the small R3 task below in the 'if' block.
-				if (new_vertices.find(edge) == new_vertices.end()) {
-					// YOUR CODE HERE (R4): compute the position for odd (= new) vertex.
-					// You will need to use the neighbor information to find the correct vertices and then combine the four corner vertices with the correct weights.
-					// Be sure to see section 3.2 in the handout for an in depth explanation of the neighbor index tables; the scheme is somewhat involved.
-					Vec3f pos, col, norm;
-					// This default implementation just puts the new vertex at the edge midpoint.
-					//pos = 0.5f * (positions[v0] + positions[v1]);
-					//col = 0.5f * (colors[v0] + colors[v1]);
-					//norm = 0.5f * (normals[v0] + normals[v1]);
-
-					// Two points on the opposite side
-					// In the current triangle
-					int v2 = indices[i][(j + 2) % 3];
-					// In the neighbor triangle
-					int i2 = neighborTris[i][j];
-					int e2 = neighborEdges[i][j];
-					// The index of edge is the same as the index of the first endpoint
-					int j2 = e2;
-					int v3;
-					
-					// R4: If encounter a boundary
-					// weights are 3/83/81/81/8
-					//pos = 3.0f / 8.0f * (positions[v0] + positions[v1]) + 1.0f / 8.0f * positions[v2];
-					//col = 3.0f / 8.0f * (colors[v0] + colors[v1]) + 1.0f / 8.0f * colors[v2];
-					//norm = 3.0f / 8.0f * (normals[v0] + normals[v1]) + 1.0f / 8.0f * normals[v2];
-
-					// Set vertex v3 as a zero vector, (0, 0, 0) has no effect on the new vertex
-					//if (i2 != -1) {
-					//	v3 = indices[i2][(j2 + 2) % 3];
-					//	pos += 1.0f / 8.0f * positions[v3];
-					//	col += 1.0f / 8.0f * colors[v3];
-					//	norm += 1.0f / 8.0f * normals[v3];
-					//}
-					
-
-					// R4+Extra: Position for odd (new) vertices with proper handling of boundaries
-					// If encounter a boundary, v=1/2*(v0+v1)
-					if (i2 == -1) {
-						pos = 0.5f * (positions[v0] + positions[v1]);
-						col = 0.5f * (colors[v0] + colors[v1]);
-						norm = 0.5f * (normals[v0] + normals[v1]);
-					}
-					// 3/83/81/81/8
-					else {
-						v3 = indices[i2][(j2 + 2) % 3];
-						pos = 3.0f / 8.0f * (positions[v0] + positions[v1]) + 1.0f / 8.0f * (positions[v2] + positions[v3]);
-						col = 3.0f / 8.0f * (colors[v0] + colors[v1]) + 1.0f / 8.0f * (colors[v2] + colors[v3]);
-						norm = 3.0f / 8.0f * (normals[v0] + normals[v1]) + 1.0f / 8.0f * (normals[v2] + normals[v3]);
-					}
-					// new color 
-					//col[0] += 0.1;
+				std::atomic<int>& slot = first_corner[indices[i][j]];
+				int corner = i * 3 + j;
+				int cur = slot.load(std::memory_order_relaxed);
+				while (corner < cur && !slot.compare_exchange_weak(cur, corner, std::memory_order_relaxed))
+					;
+			}
+	});
 
-				new_positions.push_back(pos);
-				new_colors.push_back(col);
-				new_normals.push_back(norm);
+	// Valences first, then the rings themselves.
+	std::vector<int> valence(num_vertices);
+	boundaryVertices.assign(num_vertices, 0);
+	parallelChunks(num_vertices, numChunks(num_vertices, 1024), [&](int, int begin, int end) {
+		for (int v = begin; v < end; ++v) {
+			int corner = first_corner[v].load(std::memory_order_relaxed);
+			if (corner == INT_MAX) {
+				valence[v] = 0;
+				continue;
+			}
+			int n = 0, b1, b2;
+			bool boundary = walkRing(*this, corner / 3, corner % 3, b1, b2, [&](int) { ++n; });
+			valence[v] = boundary ? 2 : n;
+			boundaryVertices[v] = boundary ? 1 : 0;
+		}
+	});
 
-				// YOUR CODE HERE (R3):
-				// Map the edge to the correct vertex index.
-				// This is just one line! Use new_vertices and the index of the position that was just pushed back to the vector.
-				new_vertices[edge] = new_positions.size() - 1;
-				}
+	ringOffsets.resize(num_vertices + 1);
+	std::copy(valence.begin(), valence.end(), ringOffsets.begin());
+	ringOffsets[num_vertices] = 0;
+	ringVertices.resize(exclusiveScan(ringOffsets));
+
+	parallelChunks(num_vertices, numChunks(num_vertices, 1024), [&](int, int begin, int end) {
+		for (int v = begin; v < end; ++v) {
+			if (valence[v] == 0)
+				continue;
+			int corner = first_corner[v].load(std::memory_order_relaxed);
+			int* ring = &ringVertices[ringOffsets[v]];
+			int n = 0, b1, b2;
+			bool boundary = walkRing(*this, corner / 3, corner % 3, b1, b2, [&](int u) {
+				if (n < valence[v])
+					ring[n] = u;
+				++n;
+			});
+			if (boundary) {
+				ring[0] = b1;
+				ring[1] = b2;
 			}
+		}
+	});
+}
+
+void MeshWithConnectivity::LoopSubdivision() {
+	// In the debug pass, just collect the one-ring of the vertex under the mouse for App to draw.
+	if (debugPass) {
+		int b1, b2;
+		bool boundary = walkRing(*this, debugVertexIdx.x, debugVertexIdx.y, b1, b2, [&](int v) { highlightIndices.push_back(v); });
+		if (boundary) {
+			highlightIndices.clear();
+			highlightIndices.push_back(b1);
+			highlightIndices.push_back(b2);
+		}
+		return;
 	}
-	// compute positions for even (old) vertices
-	std::vector<bool> vertexComputed(new_positions.size(), false);
 
-	for (int i = 0; i < (int)indices.size(); ++i) {
-		for (int j = 0; j < 3; ++j) {
+	computeVertexRings();
+
+	int num_vertices = (int)positions.size();
+	int num_edges = (int)edgeHalfEdges.size();
+
+	// The new data must be doublebuffered or otherwise some of the calculations below would
+	// not read the original positions but the newly changed ones, which is slightly wrong.
+	// Even (old) vertices keep their indices, the odd (new) vertex of edge e goes to num_vertices + e.
+	std::vector<Vec3f> new_positions(num_vertices + num_edges);
+	std::vector<Vec3f> new_normals(num_vertices + num_edges);
+	std::vector<Vec3f> new_colors(num_vertices + num_edges);
+
+	// odd vertices, one per edge
+	parallelChunks(num_edges, numChunks(num_edges), [&](int, int begin, int end) {
+		for (int e = begin; e < end; ++e) {
+			// the first half-edge on the edge, as found by the old triangle-order scan
+			int i = edgeHalfEdges[e] / 3;
+			int j = edgeHalfEdges[e] % 3;
 			int v0 = indices[i][j];
+			int v1 = indices[i][(j + 1) % 3];
+			int i2 = neighborTris[i][j];
 
-			// If we're doing the debug pass, set vertex index to the one under mouse position
-			if (debugPass)
-			{
-				i = debugVertexIdx.x;
-				j = debugVertexIdx.y;
-				v0 = indices[i][j];
+			Vec3f pos, col, norm;
+			if (i2 == -1) {
+				// boundary edge: midpoint
+				pos = 0.5f * (positions[v0] + positions[v1]);
+				col = 0.5f * (colors[v0] + colors[v1]);
+				norm = 0.5f * (normals[v0] + normals[v1]);
+			} else {
+				// interior edge: 3/8 of the endpoints, 1/8 of the opposite vertices
+				int v2 = indices[i][(j + 2) % 3];
+				int v3 = indices[i2][(neighborEdges[i][j] + 2) % 3];
+				pos = 3.0f / 8.0f * (positions[v0] + positions[v1]) + 1.0f / 8.0f * (positions[v2] + positions[v3]);
+				col = 3.0f / 8.0f * (colors[v0] + colors[v1]) + 1.0f / 8.0f * (colors[v2] + colors[v3]);
+				norm = 3.0f / 8.0f * (normals[v0] + normals[v1]) + 1.0f / 8.0f * (normals[v2] + normals[v3]);
 			}
+			new_positions[num_vertices + e] = pos;
+			new_colors[num_vertices + e] = col;
+			new_normals[num_vertices + e] = norm;
+		}
+	});
 
-			// don't redo if this one is already done
-			if (vertexComputed[v0] && !debugPass)
+	// even vertices, repositioned from their one-rings
+	parallelChunks(num_vertices, numChunks(num_vertices), [&](int, int begin, int end) {
+		for (int v0 = begin; v0 < end; ++v0) {
+			const int* ring = &ringVertices[ringOffsets[v0]];
+			int n = ringOffsets[v0 + 1] - ringOffsets[v0];
+			if (n == 0)
 				continue;
 
-			vertexComputed[v0] = true;
-
 			Vec3f pos, col, norm;
-			// YOUR CODE HERE (R5): reposition the old vertices
-
-			// This default implementation just passes the data through unchanged.
-			// You need to replace these three lines with the loop over the 1-ring
-			// around vertex v0, and compute the new position as a weighted average
-			// of the other vertices as described in the handout.
-
-			// If you're having a difficult time, you can try debugging your implementation
-			// with the debug highlight mode. If you press alt, LoopSubdivision will be called
-			// for only the vertex under your mouse cursor, which should help with debugging.
-			// You can also push vertex indices into the highLightIndices vector to draw the
-			// vertices with a visible color, so you can ensure that the 1-ring generated is correct.
-			// The solution exe implements this so you can see an example of what you can do with the
-			// highlight mode there.
-			
-			// All the vertices connected with v0 through edges
-			std::vector<int> ringVerts;
-			int preTri = i;
-			int preEdge = j;
-			int curTri = -1;
-			// for debug
-			//std::cout << "i: " << i << ", j: " << j << ", v0: " << v0 << std::endl;
-			
-			// R5 answer
-			// int flag = 0;
-			//while (curTri != i) {
-			//	curTri = neighborTris[preTri][preEdge];
-			//	int curEdge = neighborEdges[preTri][preEdge];
-			//	int newVert;
-			//	if (curTri == -1) {
-			//		//newVert = v0;
-			//		flag = 1;
-			//		break;
-			//	}
-			//	else newVert = indices[curTri][(curEdge + 2) % 3];
-			//	ringVerts.push_back(newVert);
-			//	preTri = curTri;
-			//	preEdge = (curEdge + 1) % 3;
-			//	// for debug
-			//	//std::cout << "1-rings: " << newVert << std::endl;
-			//}
-
-			//pos = positions[v0];
-			//col = colors[v0];
-			//norm = normals[v0];
-
-			// If encounter a boundary
-			//if (flag == 1) {
-			//	pos = positions[v0];
-			//	col = colors[v0];
-			//	norm = normals[v0];
-			//}
-
-			
-			// R5+Extra: Reposition the even (old) vertices, after handling boundaries properly
-			int flag1 = -1;
-			int flag2 = 0;
-			while (curTri != i) {
-				curTri = neighborTris[preTri][preEdge];
-				int curEdge = neighborEdges[preTri][preEdge];
-				int newVert;
-				if (curTri == -1) {
-					// Set flag1 as one of the neighbor boundary vetex of v0
-					// Inialized as -1 because vertex index can be 0
-					flag1 = indices[preTri][(preEdge + 1) % 3];
-					ringVerts.push_back(flag1);
-					// Look for another boundary in an opposite direction, similar to the outer loop
-					flag2 = indices[i][(j + 2) % 3];
-					preTri = i;
-					preEdge = (j + 2) % 3;
-					curTri = 0;
-					while (curTri != -1) {
-						curTri = neighborTris[preTri][preEdge];
-						curEdge = neighborEdges[preTri][preEdge];
-						// Set flag2 as the other neighbor boundary vetex
-						if (curTri == -1) {
-							flag2 = indices[preTri][preEdge];
-							ringVerts.push_back(flag2);
-							break;
-						}
-						else {
-							newVert = indices[curTri][(curEdge + 2) % 3];
-							ringVerts.push_back(newVert);
-							preTri = curTri;
-							preEdge = (curEdge + 2) % 3;
-						}
-					}
-					break;
-				}
-				else newVert = indices[curTri][(curEdge + 2) % 3];
-				ringVerts.push_back(newVert);
-				preTri = curTri;
-				preEdge = (curEdge + 1) % 3;
-			}
-			// for debug
-			//for (int m = 0; m != ringVerts.size(); m++) {
-			//	std::cout << m << std::endl;
-			//}
-			//std::cout << std::endl;
-			
-			// If ever break, v0 is a boundary vertex, v1 and v2 are two neighbors
-			// Weights are 3/4, 1/8, 1/8
-			if (flag1 != -1) {
-				int v1 = flag1;
-				int v2 = flag2;
+			if (boundaryVertices[v0]) {
+				// boundary vertex: weights are 3/4, 1/8, 1/8
+				int v1 = ring[0];
+				int v2 = ring[1];
 				pos = 3.0f / 4.0f * positions[v0] + 1.0f / 8.0f * (positions[v1] + positions[v2]);
 				col = 3.0f / 4.0f * colors[v0] + 1.0f / 8.0f * (colors[v1] + colors[v2]);
 				norm = 3.0f / 4.0f * normals[v0] + 1.0f / 8.0f * (normals[v1] + normals[v2]);
-			}
-			else {
-				int n = ringVerts.size();
-				float B;
-				if (n == 3)
-					B = 3.0f / 16.0f;
-				//else if (n > 3)
-				else
-					B = 3.0f / 8.0f / n;
+			} else {
+				float B = (n == 3) ? 3.0f / 16.0f : 3.0f / 8.0f / n;
 				pos = (1 - n * B) * positions[v0];
 				col = (1 - n * B) * colors[v0];
 				norm = (1 - n * B) * normals[v0];
 				for (int k = 0; k != n; k++) {
-					pos += B * positions[ringVerts[k]];
-					col += B * colors[ringVerts[k]];
-					norm += B * normals[ringVerts[k]];
+					pos += B * positions[ring[k]];
+					col += B * colors[ring[k]];
+					norm += B * normals[ring[k]];
 				}
-			}			
-
-			// Stop here if we're doing the debug pass since we don't actually need to modify the mesh
-			if (debugPass)
-				return;
-
+			}
 			new_positions[v0] = pos;
 			new_colors[v0] = col;
 			new_normals[v0] = norm;
 		}
-	}
-
-	// Again, if we're doing the debug pass, we only care about our 1-ring so we can stop now
-	if (debugPass)
-		return;
+	});
 
 	// and then, finally, regenerate topology
-	// every triangle turns into four new ones
+	// every triangle turns into four new ones: the inner one made of the odd vertices, then one per corner
 	std::vector<Vec3i> new_indices;
-	new_indices.reserve(indices.size()*4);
-	for (size_t i = 0; i < indices.size(); ++i) {
-		Vec3i even = indices[i]; // start vertices of e_0, e_1, e_2
-
-		// YOUR CODE HERE (R3):
-		// fill in X and Y (it's the same for both)
-		//auto edge_a = std::make_pair(min(X, Y), max(X, Y));
-		//auto edge_b = ...
-		//auto edge_c = ...
-		int v0 = even[0];
-		int v1 = even[1];
-		int v2 = even[2];
-		auto edge_a = std::make_pair(min(v0, v1), max(v0, v1));
-		auto edge_b = std::make_pair(min(v1, v2), max(v1, v2));
-		auto edge_c = std::make_pair(min(v2, v0), max(v2, v0));
-
-		// The edges edge_a, edge_b and edge_c now define the vertex indices via new_vertices.
-		// (The mapping is done in the loop above.)
-		// The indices define the smaller triangle inside the indices defined by "even", in order.
-		// Read the vertex indices out of new_vertices to build the small triangle "odd"
-
-		Vec3i odd = Vec3i(new_vertices[edge_a], new_vertices[edge_b], new_vertices[edge_c]);
-
-		// Then, construct the four smaller triangles from the surrounding big triangle  "even"
-		// and the inner one, "odd". Push them to "new_indices".
-		Vec3i odd1 = Vec3i(v0, odd[0], odd[2]);
-		Vec3i odd2 = Vec3i(v1, odd[1], odd[0]);
-		Vec3i odd3 = Vec3i(v2, odd[2], odd[1]);
-		new_indices.push_back(odd);
-		new_indices.push_back(odd1);
-		new_indices.push_back(odd2);
-		new_indices.push_back(odd3);
-
-		// NOTE: REMOVE the following line after you're done with the new triangles.
-		// This just keeps the mesh intact and serves as an example on how to add new triangles.
-		//new_indices.push_back( Vec3i( even[0], even[1], even[2] ) );
-	}
-
-	// ADD THESE LINES when R3 is finished. Replace the originals with the repositioned data.
+	splitTriangles(*this, num_vertices, new_indices);
+
 	indices = std::move(new_indices);
 	positions = std::move(new_positions);
 	normals = std::move(new_normals);
 	colors = std::move(new_colors);
 }
 
+// Odd vertices are made only for the split edges and numbered in edge order after the
+// old vertices. Triangles are split according to how many of their edges are split:
+// into four like LoopSubdivision(), into three, or into two.
+void MeshWithConnectivity::adaptiveLoopSubdivision(const std::vector<U8>& splitEdges)
+{
+	int num_vertices = (int)positions.size();
+	int num_edges = (int)edgeHalfEdges.size();
+	int num_tris = (int)indices.size();
+	FW_ASSERT((int)splitEdges.size() == num_edges);
+
+	std::vector<int> odd_index(num_edges);
+	for (int e = 0; e < num_edges; ++e)
+		odd_index[e] = splitEdges[e] ? 1 : 0;
+	int num_odd = exclusiveScan(odd_index);
+
+	// only vertices whose edges are all split are in a uniformly refined neighborhood
+	std::vector<U8> smooth(num_vertices, 1);
+	for (int e = 0; e < num_edges; ++e)
+		if (!splitEdges[e]) {
+			int h = edgeHalfEdges[e];
+			smooth[indices[h / 3][h % 3]] = 0;
+			smooth[indices[h / 3][(h % 3 + 1) % 3]] = 0;
+		}
+
+	std::vector<Vec3f> new_positions(num_vertices + num_odd);
+	std::vector<Vec3f> new_normals(num_vertices + num_odd);
+	std::vector<Vec3f> new_colors(num_vertices + num_odd);
+
+	auto applyStencil = [&](int r, int out) {
+		Vec3f pos, col, norm;
+		loopStencil(*this, num_vertices, r, [&](int v, float w) {
+			pos += w * positions[v];
+			col += w * colors[v];
+			norm += w * normals[v];
+		});
+		new_positions[out] = pos;
+		new_colors[out] = col;
+		new_normals[out] = norm;
+	};
+
+	parallelChunks(num_vertices, numChunks(num_vertices), [&](int, int begin, int end) {
+		for (int v = begin; v < end; ++v) {
+			if (smooth[v] && ringOffsets[v + 1] > ringOffsets[v])
+				applyStencil(v, v);
+			else {
+				new_positions[v] = positions[v];
+				new_colors[v] = colors[v];
+				new_normals[v] = normals[v];
+			}
+		}
+	});
+	parallelChunks(num_edges, numChunks(num_edges), [&](int, int begin, int end) {
+		for (int e = begin; e < end; ++e)
+			if (splitEdges[e])
+				applyStencil(num_vertices + e, num_vertices + odd_index[e]);
+	});
+
+	// a triangle with k split edges becomes k + 1 triangles
+	std::vector<int> first_child(num_tris);
+	parallelChunks(num_tris, numChunks(num_tris), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i)
+			first_child[i] = 1 + splitEdges[edgeIds[i][0]] + splitEdges[edgeIds[i][1]] + splitEdges[edgeIds[i][2]];
+	});
+	std::vector<Vec3i> new_indices(exclusiveScan(first_child));
+
+	parallelChunks(num_tris, numChunks(num_tris), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			Vec3i v = indices[i];
+			Vec3i odd;
+			int num_split = 0;
+			for (int j = 0; j < 3; ++j) {
+				int e = edgeIds[i][j];
+				odd[j] = splitEdges[e] ? num_vertices + odd_index[e] : -1;
+				num_split += splitEdges[e];
+			}
+
+			Vec3i* out = &new_indices[first_child[i]];
+			if (num_split == 0)
+				out[0] = v;
+			else if (num_split == 3) {
+				out[0] = odd;
+				out[1] = Vec3i(v[0], odd[0], odd[2]);
+				out[2] = Vec3i(v[1], odd[1], odd[0]);
+				out[3] = Vec3i(v[2], odd[2], odd[1]);
+			} else if (num_split == 1) {
+				// bisect the split edge j towards the opposite corner
+				int j = (odd[0] != -1) ? 0 : (odd[1] != -1) ? 1 : 2;
+				out[0] = Vec3i(v[j], odd[j], v[(j + 2) % 3]);
+				out[1] = Vec3i(odd[j], v[(j + 1) % 3], v[(j + 2) % 3]);
+			} else {
+				// edge u is not split: cut off the opposite corner, then halve the quad that is left
+				int u = (odd[0] == -1) ? 0 : (odd[1] == -1) ? 1 : 2;
+				int a = v[u], b = v[(u + 1) % 3], c = v[(u + 2) % 3];
+				int m1 = odd[(u + 1) % 3], m2 = odd[(u + 2) % 3];
+				out[0] = Vec3i(c, m2, m1);
+				out[1] = Vec3i(a, b, m1);
+				out[2] = Vec3i(a, m1, m2);
+			}
+		}
+	});
+
+	indices = std::move(new_indices);
+	positions = std::move(new_positions);
+	normals = std::move(new_normals);
+	colors = std::move(new_colors);
+}
+
+void AdaptiveSubdivision::setControlMesh(const Mesh<VertexPNC>& mesh)
+{
+	levels.assign(1, MeshWithConnectivity());
+	levels[0].fromMesh(mesh);
+	levels[0].computeVertexRings();
+	splitEdges.clear();
+}
+
+// An edge is split if it is on screen and either longer than maxEdgePixels, or longer
+// than minCurvedEdgePixels with normals bending more than maxNormalAngle across it.
+// Triangles that would end up with two split edges get the third one too, which keeps
+// the transitions between levels from filling up with slivers.
+void AdaptiveSubdivision::markEdges(int level, const Mat4f& worldToClip, const Vec2f& viewportSize, std::vector<U8>& split) const
+{
+	const MeshWithConnectivity& m = levels[level];
+	int num_vertices = (int)m.positions.size();
+	int num_edges = (int)m.edgeHalfEdges.size();
+
+	std::vector<Vec4f> clip(num_vertices);
+	parallelChunks(num_vertices, numChunks(num_vertices), [&](int, int begin, int end) {
+		for (int v = begin; v < end; ++v)
+			clip[v] = worldToClip * Vec4f(m.positions[v], 1.0f);
+	});
+
+	float cos_max_angle = FW::cos(maxNormalAngle);
+	split.assign(num_edges, 0);
+	parallelChunks(num_edges, numChunks(num_edges), [&](int, int begin, int end) {
+		for (int e = begin; e < end; ++e) {
+			int h = m.edgeHalfEdges[e];
+			int v0 = m.indices[h / 3][h % 3];
+			int v1 = m.indices[h / 3][(h % 3 + 1) % 3];
+			const Vec4f& c0 = clip[v0];
+			const Vec4f& c1 = clip[v1];
+
+			// off screen if both ends are outside the same clip plane
+			bool culled = (c0.w <= 0.0f && c1.w <= 0.0f);
+			for (int k = 0; k < 3 && !culled; ++k)
+				culled = (c0[k] < -c0.w && c1[k] < -c1.w) || (c0[k] > c0.w && c1[k] > c1.w);
+			if (culled)
+				continue;
+
+			// an edge that crosses the camera plane is as good as infinitely long
+			float pixels = FLT_MAX;
+			if (c0.w > 0.0f && c1.w > 0.0f)
+				pixels = ((c0.getXY() / c0.w - c1.getXY() / c1.w) * 0.5f * viewportSize).length();
+
+			bool curved = dot(m.normals[v0].normalized(), m.normals[v1].normalized()) < cos_max_angle;
+			split[e] = (pixels > maxEdgePixels || (curved && pixels > minCurvedEdgePixels)) ? 1 : 0;
+		}
+	});
+
+	// closure: promote triangles with exactly two split edges
+	auto numSplit = [&](int i) { return split[m.edgeIds[i][0]] + split[m.edgeIds[i][1]] + split[m.edgeIds[i][2]]; };
+	std::vector<int> stack;
+	for (int i = 0; i < (int)m.indices.size(); ++i)
+		if (numSplit(i) == 2)
+			stack.push_back(i);
+	while (!stack.empty()) {
+		int i = stack.back();
+		stack.pop_back();
+		if (numSplit(i) != 2)
+			continue;
+		for (int j = 0; j < 3; ++j)
+			if (!split[m.edgeIds[i][j]]) {
+				split[m.edgeIds[i][j]] = 1;
+				int i2 = m.neighborTris[i][j];
+				if (i2 != -1 && numSplit(i2) == 2)
+					stack.push_back(i2);
+			}
+	}
+}
+
+bool AdaptiveSubdivision::update(const Mat4f& worldToClip, const Vec2f& viewportSize)
+{
+	if (levels.empty())
+		return false;
+
+	bool changed = false;
+	for (int level = 0; level < maxLevel; ++level) {
+		std::vector<U8> split;
+		markEdges(level, worldToClip, viewportSize, split);
+
+		// the level above is still good if the same edges are split
+		if (level + 1 < (int)levels.size() && split == splitEdges[level])
+			continue;
+
+		bool any_split = std::find(split.begin(), split.end(), 1) != split.end();
+		if (!any_split && level + 1 == (int)levels.size())
+			break;
+
+		levels.resize(level + 1);
+		splitEdges.resize(level);
+		changed = true;
+		if (!any_split)
+			break;
+
+		MeshWithConnectivity next = levels[level];
+		next.adaptiveLoopSubdivision(split);
+		next.computeConnectivity();
+		next.computeVertexRings();
+		splitEdges.push_back(std::move(split));
+		levels.push_back(std::move(next));
+	}
+
+	// the level limit went down
+	if ((int)levels.size() > maxLevel + 1) {
+		levels.resize(maxLevel + 1);
+		splitEdges.resize(maxLevel);
+		changed = true;
+	}
+	return changed;
+}
+
+void SubdivisionStencils::clear()
+{
+	levels = -1;
+	numControlVertices = 0;
+	rowOffsets.clear();
+	columns.clear();
+	weights.clear();
+	indices.clear();
+}
+
+size_t SubdivisionStencils::memoryBytes() const
+{
+	return rowOffsets.size() * sizeof(int) + columns.size() * sizeof(int) + weights.size() * sizeof(float) + indices.size() * sizeof(Vec3i);
+}
+
+// The stencils of each level are composed with those of the levels below, one sparse
+// matrix product per level: a row of the next level combines the rows of the vertices in
+// its Loop stencil, accumulated in a dense scratch row (one per thread) over the control
+// vertices. Rows are sized in a first pass and filled in a second one.
+void SubdivisionStencils::build(const MeshWithConnectivity& control, int num_levels)
+{
+	clear();
+	levels = num_levels;
+	numControlVertices = (int)control.positions.size();
+
+	// level 0 is the identity
+	rowOffsets.resize(numControlVertices + 1);
+	columns.resize(numControlVertices);
+	weights.assign(numControlVertices, 1.0f);
+	for (int v = 0; v < numControlVertices; ++v) {
+		rowOffsets[v] = v;
+		columns[v] = v;
+	}
+	rowOffsets[numControlVertices] = numControlVertices;
+
+	// topology of the current level; the positions only carry the vertex count
+	MeshWithConnectivity m;
+	m.indices = control.indices;
+	m.positions.resize(numControlVertices);
+
+	for (int level = 0; level < num_levels; ++level) {
+		m.computeConnectivity();
+		m.computeVertexRings();
+
+		int num_vertices = (int)m.positions.size();
+		int num_rows = num_vertices + (int)m.edgeHalfEdges.size();
+		int chunks = numChunks(num_rows, 1024);
+
+		std::vector<int> new_offsets(num_rows + 1, 0);
+		std::vector<int> new_columns;
+		std::vector<float> new_weights;
+
+		for (int pass = 0; pass < 2; ++pass) {
+			if (pass == 1) {
+				new_columns.resize(exclusiveScan(new_offsets));
+				new_weights.resize(new_columns.size());
+			}
+			parallelChunks(num_rows, chunks, [&](int, int begin, int end) {
+				// last row that touched each control vertex, and where its weight went
+				std::vector<int> marker(numControlVertices, -1);
+				std::vector<int> slot(pass == 1 ? numControlVertices : 0);
+				for (int r = begin; r < end; ++r) {
+					int count = 0;
+					int out = (pass == 1) ? new_offsets[r] : 0;
+					loopStencil(m, num_vertices, r, [&](int v, float w) {
+						for (int k = rowOffsets[v]; k < rowOffsets[v + 1]; ++k) {
+							int c = columns[k];
+							if (marker[c] != r) {
+								marker[c] = r;
+								++count;
+								if (pass == 1) {
+									slot[c] = out;
+									new_columns[out] = c;
+									new_weights[out++] = w * weights[k];
+								}
+							} else if (pass == 1)
+								new_weights[slot[c]] += w * weights[k];
+						}
+					});
+					if (pass == 0)
+						new_offsets[r] = count;
+				}
+			});
+		}
+
+		rowOffsets = std::move(new_offsets);
+		columns = std::move(new_columns);
+		weights = std::move(new_weights);
+
+		std::vector<Vec3i> new_indices;
+		splitTriangles(m, num_vertices, new_indices);
+		m.indices = std::move(new_indices);
+		m.positions.resize(num_rows);
+	}
+
+	indices = std::move(m.indices);
+}
+
+void SubdivisionStencils::evaluate(const MeshWithConnectivity& control, MeshWithConnectivity& refined) const
+{
+	FW_ASSERT((int)control.positions.size() == numControlVertices);
+
+	int num_rows = numRefinedVertices();
+	refined.positions.resize(num_rows);
+	refined.normals.resize(num_rows);
+	refined.colors.resize(num_rows);
+	refined.indices = indices;
+
+	// one pass over the stencils for all three attributes
+	parallelChunks(num_rows, numChunks(num_rows), [&](int, int begin, int end) {
+		for (int r = begin; r < end; ++r) {
+			// spelled out per component, this is several times faster than going through the Vec3f operators
+			Vec3f pos, col, norm;
+			for (int k = rowOffsets[r]; k < rowOffsets[r + 1]; ++k) {
+				int c = columns[k];
+				float w = weights[k];
+				const Vec3f& p = control.positions[c];
+				const Vec3f& q = control.colors[c];
+				const Vec3f& n = control.normals[c];
+				pos.x += w * p.x;	pos.y += w * p.y;	pos.z += w * p.z;
+				col.x += w * q.x;	col.y += w * q.y;	col.z += w * q.z;
+				norm.x += w * n.x;	norm.y += w * n.y;	norm.z += w * n.z;
+			}
+			refined.positions[r] = pos;
+			refined.colors[r] = col;
+			refined.normals[r] = norm;
+		}
+	});
+}
+
+// Normals come back unit length; the subdivision itself leaves them unnormalized.
+void CompactLevel::pack(const MeshWithConnectivity& m)
+{
+	int n = (int)m.positions.size();
+	positions = m.positions;
+	normals.resize(n);
+	colors.resize(n);
+	indices = m.indices;
+	parallelChunks(n, numChunks(n), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			normals[i] = encodeOctahedral(m.normals[i]);
+			colors[i] = Vec4f(m.colors[i], 1.0f).toABGR();
+		}
+	});
+}
+
+void CompactLevel::unpack(MeshWithConnectivity& m) const
+{
+	int n = (int)positions.size();
+	m.positions = positions;
+	m.normals.resize(n);
+	m.colors.resize(n);
+	m.indices = indices;
+	parallelChunks(n, numChunks(n), [&](int, int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			m.normals[i] = decodeOctahedral(normals[i]);
+			m.colors[i] = Vec4f::fromABGR(colors[i]).getXYZ();
+		}
+	});
+}
+
+void CompactLevel::toMesh(Mesh<VertexPNC>& dest) const
+{
+	dest.resetVertices((int)positions.size());
+	for (size_t i = 0; i < positions.size(); ++i) {
+		VertexPNC& v = dest.mutableVertex((int)i);
+		v.p = positions[i];
+		v.n = decodeOctahedral(normals[i]);
+		v.c = Vec4f::fromABGR(colors[i]);
+	}
+	dest.resizeSubmeshes(1);
+	dest.mutableIndices(0).replace(0, dest.indices(0).getSize(), &indices[0], (int)indices.size());
+}
+
+size_t SubdivisionLevelCache::Level::memoryBytes() const
+{
+	if (mesh)
+		return mesh->numVertices() * sizeof(VertexPNC) + mesh->numTriangles() * sizeof(Vec3i);
+	return packed ? packed->memoryBytes() : 0;
+}
+
+SubdivisionLevelCache::~SubdivisionLevelCache()
+{
+	if (pending_.valid())
+		pending_.wait();
+}
+
+void SubdivisionLevelCache::reset(std::unique_ptr<Mesh<VertexPNC>> control)
+{
+	if (pending_.valid())
+		pending_.wait();
+	pending_ = std::future<std::vector<MeshWithConnectivity>>();
+
+	levels_.clear();
+	levels_.resize(1);
+	levels_[0].mesh = std::move(control);
+	displayed_level_ = -1;
+	display_.reset();
+}
+
+size_t SubdivisionLevelCache::memoryBytes() const
+{
+	size_t bytes = 0;
+	for (auto& l : levels_)
+		bytes += l.memoryBytes();
+	if (display_)
+		bytes += display_->numVertices() * sizeof(VertexPNC) + display_->numTriangles() * sizeof(Vec3i);
+	return bytes;
+}
+
+String SubdivisionLevelCache::describe() const
+{
+	String s = sprintf("Level cache: %.1f of %.0f MB, levels", memoryBytes() / (1024.0 * 1024.0), budgetBytes / (1024.0 * 1024.0));
+	for (size_t i = 0; i < levels_.size(); ++i)
+		if (levels_[i].resident())
+			s += sprintf(" %d%s", (int)i, levels_[i].packed ? "c" : "");
+	if (pending_.valid())
+		s += sprintf(" (computing level %d+)", pending_base_ + 1);
+	return s;
+}
+
+void SubdivisionLevelCache::store(int level, const MeshWithConnectivity& m)
+{
+	if (level >= (int)levels_.size())
+		levels_.resize(level + 1);
+	Level& l = levels_[level];
+	if (compact) {
+		l.packed.reset(new CompactLevel());
+		l.packed->pack(m);
+	} else {
+		l.mesh.reset(new Mesh<VertexPNC>());
+		m.toMesh(*l.mesh);
+	}
+	l.lastUse = ++clock_;
+}
+
+void SubdivisionLevelCache::load(int level, MeshWithConnectivity& m) const
+{
+	const Level& l = levels_[level];
+	if (l.mesh)
+		m.fromMesh(*l.mesh);
+	else {
+		l.packed->unpack(m);
+		m.computeConnectivity();
+	}
+}
+
+// Drops the least recently used levels until the budget is met. The control mesh, the
+// level `keep` and the level being drawn stay.
+void SubdivisionLevelCache::evict(int keep)
+{
+	while (memoryBytes() > budgetBytes) {
+		int victim = -1;
+		for (int i = 1; i < (int)levels_.size(); ++i)
+			if (levels_[i].resident() && i != keep && i != displayed_level_ &&
+				(victim == -1 || levels_[i].lastUse < levels_[victim].lastUse))
+				victim = i;
+		if (victim == -1)
+			break;
+		levels_[victim].mesh.reset();
+		levels_[victim].packed.reset();
+	}
+}
+
+void SubdivisionLevelCache::finishPending()
+{
+	if (!pending_.valid() || pending_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return;
+
+	std::vector<MeshWithConnectivity> result = pending_.get();
+	for (size_t i = 0; i < result.size(); ++i)
+		store(pending_base_ + 1 + (int)i, result[i]);
+	evict(pending_base_ + (int)result.size());
+}
+
+MeshBase* SubdivisionLevelCache::show(int level)
+{
+	Level& l = levels_[level];
+	l.lastUse = ++clock_;
+	if (l.mesh) {
+		display_.reset();
+		displayed_level_ = level;
+		return l.mesh.get();
+	}
+	if (displayed_level_ != level || !display_) {
+		display_.reset(new Mesh<VertexPNC>());
+		l.packed->toMesh(*display_);
+		displayed_level_ = level;
+	}
+	return display_.get();
+}
+
+MeshBase* SubdivisionLevelCache::get(int level)
+{
+	finishPending();
+	if (level >= (int)levels_.size())
+		levels_.resize(level + 1);
+
+	if (!levels_[level].resident()) {
+		// the control mesh is always there
+		int base = level;
+		while (!levels_[base].resident())
+			--base;
+
+		if (background) {
+			// start on the missing levels, and show the closest one we have meanwhile
+			if (!pending_.valid()) {
+				std::shared_ptr<MeshWithConnectivity> m = std::make_shared<MeshWithConnectivity>();
+				load(base, *m);
+				int count = level - base;
+				pending_base_ = base;
+				pending_ = std::async(std::launch::async, [m, count]() {
+					std::vector<MeshWithConnectivity> out;
+					for (int i = 0; i < count; ++i) {
+						if (i > 0)
+							m->computeConnectivity();
+						m->LoopSubdivision();
+						MeshWithConnectivity l;
+						l.positions = m->positions;
+						l.normals = m->normals;
+						l.colors = m->colors;
+						l.indices = m->indices;
+						out.push_back(std::move(l));
+					}
+					return out;
+				});
+			}
+			MeshBase* mesh = show(base);
+			evict(base);
+			return mesh;
+		}
+
+		MeshWithConnectivity m;
+		load(base, m);
+		for (int l = base + 1; l <= level; ++l) {
+			if (l > base + 1)
+				m.computeConnectivity();
+			m.LoopSubdivision();
+			store(l, m);
+			evict(level);
+		}
+	}
+
+	MeshBase* mesh = show(level);
+	evict(level);
+	return mesh;
+}
+
+//------------------------------------------------------------------------
+
+bool subdivideToBinaryFile(const Mesh<VertexPNC>& mesh, int levels, const String& filename, int patchFaces)
+{
+	if (levels < 0 || levels > 15) {
+		FW::printf("Cannot subdivide to level %d\n", levels);
+		return false;
+	}
+
+	MeshWithConnectivity control;
+	control.fromMesh(mesh);
+	int num_vertices = (int)control.positions.size();
+	int num_tris = (int)control.indices.size();
+	int num_edges = (int)control.edgeHalfEdges.size();
+	patchFaces = max(patchFaces, 1);
+	int num_patches = (num_tris + patchFaces - 1) / patchFaces;
+
+	// refined vertices on the lattice of each control edge and inside each control triangle
+	int side = 1 << levels;
+	int per_edge = side - 1;
+	int per_face = (side - 1) * (side - 2) / 2;
+
+	// order the triangles along a Morton curve through their centroids, so that the
+	// consecutive runs that make up the patches are compact
+	Vec3f lo(FLT_MAX), hi(-FLT_MAX);
+	for (const Vec3f& p : control.positions) {
+		lo = lo.min(p);
+		hi = hi.max(p);
+	}
+	Vec3f scale = Vec3f(1023.0f) / (hi - lo).max(Vec3f(1e-30f));
+	std::vector<std::pair<U32, int>> keys(num_tris);
+	for (int i = 0; i < num_tris; ++i) {
+		const Vec3i& t = control.indices[i];
+		Vec3f c = (control.positions[t[0]] + control.positions[t[1]] + control.positions[t[2]]) / 3.0f;
+		Vec3i q = Vec3i(((c - lo) * scale).max(Vec3f(0.0f)).min(Vec3f(1023.0f)));
+		keys[i] = std::make_pair(spreadBits(q.x) | (spreadBits(q.y) << 1) | (spreadBits(q.z) << 2), i);
+	}
+	std::sort(keys.begin(), keys.end());
+	std::vector<int> order(num_tris);
+	for (int i = 0; i < num_tris; ++i)
+		order[i] = keys[i].second;
+	keys = std::vector<std::pair<U32, int>>();
+
+	// Every control vertex and edge belongs to the first patch that touches it. That patch
+	// writes the refined vertices on it; the others refer to them by their output index.
+	std::vector<int> vertex_owner(num_vertices, INT_MAX), edge_owner(num_edges, INT_MAX);
+	for (int k = 0; k < num_tris; ++k) {
+		int p = k / patchFaces;
+		for (int j = 0; j < 3; ++j) {
+			int& v = vertex_owner[control.indices[order[k]][j]];
+			int& e = edge_owner[control.edgeIds[order[k]][j]];
+			v = min(v, p);
+			e = min(e, p);
+		}
+	}
+
+	// Output layout, patch by patch: its control vertices, the vertices on its edges, and
+	// the vertices inside its triangles. Unused control vertices are dropped.
+	std::vector<S64> patch_start(num_patches + 1, 0), edges_start(num_patches, 0);
+	for (int v = 0; v < num_vertices; ++v)
+		if (vertex_owner[v] != INT_MAX)
+			++patch_start[vertex_owner[v] + 1];
+	for (int p = 0; p < num_patches; ++p)
+		edges_start[p] = patch_start[p + 1];
+	for (int e = 0; e < num_edges; ++e)
+		patch_start[edge_owner[e] + 1] += per_edge;
+	for (int p = 0; p < num_patches; ++p)
+		patch_start[p + 1] += (S64)(min(num_tris, (p + 1) * patchFaces) - p * patchFaces) * per_face;
+	for (int p = 0; p < num_patches; ++p) {
+		patch_start[p + 1] += patch_start[p];
+		edges_start[p] += patch_start[p];
+	}
+
+	S64 num_out_vertices = patch_start[num_patches];
+	S64 num_out_tris = (S64)num_tris << (2 * levels);
+	if (num_out_vertices > INT_MAX || num_out_tris > INT_MAX) {
+		FW::printf("Level %d has too many triangles for a binary mesh file\n", levels);
+		return false;
+	}
+
+	std::vector<int> vertex_index(num_vertices, -1), edge_index(num_edges, -1);
+	{
+		std::vector<S64> next(patch_start.begin(), patch_start.end() - 1);
+		for (int v = 0; v < num_vertices; ++v)
+			if (vertex_owner[v] != INT_MAX)
+				vertex_index[v] = (int)next[vertex_owner[v]]++;
+		next.assign(edges_start.begin(), edges_start.end());
+		for (int e = 0; e < num_edges; ++e) {
+			edge_index[e] = (int)next[edge_owner[e]];
+			next[edge_owner[e]] += per_edge;
+		}
+	}
+	vertex_owner = std::vector<int>();
+	edge_owner = std::vector<int>();
+
+	// output index of the refined vertex at lattice point b of the k'th triangle in order
+	auto latticeIndex = [&](int k, const Vec3i& b) -> int {
+		int f = order[k];
+		const Vec3i& t = control.indices[f];
+		for (int j = 0; j < 3; ++j)
+			if (b[j] == side)
+				return vertex_index[t[j]];
+		for (int j = 0; j < 3; ++j)
+			if (b[(j + 2) % 3] == 0) {
+				// on the edge from t[j] to t[j+1], counted from its lower vertex
+				int from_lower = (t[j] < t[(j + 1) % 3]) ? b[(j + 1) % 3] : b[j];
+				return edge_index[control.edgeIds[f][j]] + from_lower - 1;
+			}
+		// the patch's triangles are at the end of its range
+		int p = k / patchFaces;
+		S64 face_start = patch_start[p + 1] - (S64)(min(num_tris, (p + 1) * patchFaces) - k) * per_face;
+		int row = (b[0] - 1) * (side - 1) - (b[0] - 1) * b[0] / 2;
+		return (int)(face_start + row + b[1] - 1);
+	};
+
+	// triangles touching each control vertex, to find the halos
+	std::vector<int> vertex_tri_start(num_vertices + 1, 0), vertex_tris(num_tris * 3);
+	for (const Vec3i& t : control.indices)
+		for (int j = 0; j < 3; ++j)
+			++vertex_tri_start[t[j] + 1];
+	for (int v = 0; v < num_vertices; ++v)
+		vertex_tri_start[v + 1] += vertex_tri_start[v];
+	{
+		std::vector<int> next(vertex_tri_start.begin(), vertex_tri_start.end() - 1);
+		for (int i = 0; i < num_tris; ++i)
+			for (int j = 0; j < 3; ++j)
+				vertex_tris[next[control.indices[i][j]]++] = i;
+	}
+
+	// The triangles come after all the vertices in the file, so they are spooled to a
+	// temporary file meanwhile.
+	File file(filename, File::Create);
+	String index_filename = filename + ".indices";
+	std::unique_ptr<File> index_file(new File(index_filename, File::Create));
+	if (hasError()) {
+		FW::printf("Cannot write %s: %s\n", filename.getPtr(), clearError().getPtr());
+		return false;
+	}
+	BufferedOutputStream out(file);
+	std::unique_ptr<BufferedOutputStream> index_out(new BufferedOutputStream(*index_file));
+
+	Mesh<VertexPNC> format;
+	out.write("BinMesh ", 8);
+	out << (S32)4 << (S32)format.numAttribs() << (S32)num_out_vertices << (S32)1 << (S32)0;
+	for (int i = 0; i < format.numAttribs(); ++i) {
+		const MeshBase::AttribSpec& spec = format.attribSpec(i);
+		out << (S32)spec.type << (S32)spec.format << spec.length;
+	}
+
+	std::vector<U8> in_patch(num_tris, 0);
+	std::vector<int> local_vertex(num_vertices, -1);
+	std::vector<int> patch_tris, patch_vertices;
+	std::vector<VertexPNC> buffer;
+	std::vector<Vec3i> tri_buffer;
+	for (int p = 0; p < num_patches; ++p) {
+		int first = p * patchFaces, last = min(num_tris, first + patchFaces);
+
+		// the patch's own triangles, then every other triangle that shares a vertex with
+		// them: the one-ring halo is all the refinement of the patch's triangles depends on
+		patch_tris.assign(order.begin() + first, order.begin() + last);
+		for (int f : patch_tris)
+			in_patch[f] = 1;
+		for (int k = first; k < last; ++k)
+			for (int j = 0; j < 3; ++j) {
+				int v = control.indices[order[k]][j];
+				for (int i = vertex_tri_start[v]; i < vertex_tri_start[v + 1]; ++i)
+					if (!in_patch[vertex_tris[i]]) {
+						in_patch[vertex_tris[i]] = 1;
+						patch_tris.push_back(vertex_tris[i]);
+					}
+			}
+
+		MeshWithConnectivity m;
+		m.indices.resize(patch_tris.size());
+		patch_vertices.clear();
+		for (size_t i = 0; i < patch_tris.size(); ++i) {
+			in_patch[patch_tris[i]] = 0;
+			for (int j = 0; j < 3; ++j) {
+				int v = control.indices[patch_tris[i]][j];
+				if (local_vertex[v] < 0) {
+					local_vertex[v] = (int)patch_vertices.size();
+					patch_vertices.push_back(v);
+					m.positions.push_back(control.positions[v]);
+					m.normals.push_back(control.normals[v]);
+					m.colors.push_back(control.colors[v]);
+				}
+				m.indices[i][j] = local_vertex[v];
+			}
+		}
+		for (int v : patch_vertices)
+			local_vertex[v] = -1;
+
+		for (int l = 0; l < levels; ++l) {
+			m.computeConnectivity();
+			m.LoopSubdivision();
+		}
+
+		// the children of triangle i are at [i << 2 * levels, (i + 1) << 2 * levels)
+		buffer.resize((size_t)(patch_start[p + 1] - patch_start[p]));
+		tri_buffer.resize((size_t)(last - first) << (2 * levels));
+		for (int i = 0; i < (int)tri_buffer.size(); ++i) {
+			int k = first + (i >> (2 * levels));
+			Vec3i corners[3];
+			latticeCorners(i & ((1 << (2 * levels)) - 1), levels, corners);
+			for (int j = 0; j < 3; ++j) {
+				int index = latticeIndex(k, corners[j]);
+				tri_buffer[i][j] = index;
+				if (index >= patch_start[p] && index < patch_start[p + 1]) {
+					int v = m.indices[i][j];
+					buffer[(size_t)(index - patch_start[p])] = VertexPNC(m.positions[v], m.normals[v], Vec4f(m.colors[v], 1.0f));
+				}
+			}
+		}
+		if (!buffer.empty())
+			out.write(buffer.data(), (int)(buffer.size() * sizeof(VertexPNC)));
+		if (!tri_buffer.empty())
+			index_out->write(tri_buffer.data(), (int)(tri_buffer.size() * sizeof(Vec3i)));
+	}
+	index_out->flush();
+	index_out.reset();
+
+	// one submesh with the default material, then the triangles
+	MeshBase::Material material;
+	out << Vec3f(0.0f) << material.diffuse << material.specular << material.glossiness;
+	out << material.displacementCoef << material.displacementBias;
+	for (int j = 0; j <= MeshBase::TextureType_Environment; ++j)
+		out << (S32)-1;
+	out << (S32)num_out_tris;
+	index_file->seek(0);
+	std::vector<U8> chunk(1 << 20);
+	for (int n; (n = index_file->read(chunk.data(), (int)chunk.size())) > 0; )
+		out.write(chunk.data(), n);
+	out.flush();
+	index_file.reset();
+	remove(index_filename.getPtr());
+
+	if (hasError()) {
+		FW::printf("Error writing %s: %s\n", filename.getPtr(), clearError().getPtr());
+		return false;
+	}
+	return true;
+}
+
 } // namespace FW
@@ -4,8 +4,12 @@
 #include "gui/CommonControls.hpp"
 #include "3d/CameraControls.hpp"
 #include "gpu/Buffer.hpp"
+#include "3d/Mesh.hpp"
 
+#include <future>
 #include <map>
+#include <memory>
+#include <vector>
 
 namespace FW {
 
@@ -15,12 +19,20 @@ namespace FW {
 struct MeshWithConnectivity
 {
 	void fromMesh			(const Mesh<VertexPNC>& mesh);
-	void toMesh				(Mesh<VertexPNC>& dest);
+	void toMesh				(Mesh<VertexPNC>& dest) const;
 
 	void LoopSubdivision	();
 
+	// Splits only the edges flagged in splitEdges (one flag per edge, see edgeIds), and
+	// the triangles around them so that no cracks open. Needs the connectivity and the
+	// one-rings. Vertices with an unsplit edge keep their position.
+	void adaptiveLoopSubdivision(const std::vector<U8>& splitEdges);
+
 	void computeConnectivity();
 
+	// Fills in the one-ring tables below. Needs the connectivity.
+	void computeVertexRings();
+
 	// Runs a debug version of the subdivision pass
 	std::vector<Vec3f> debugHighlight(Vec2f mousePos, Mat4f worldToClip);
 
@@ -42,6 +54,156 @@ struct MeshWithConnectivity
 	std::vector<Vec3i>	neighborTris;
 	std::vector<Vec3i>	neighborEdges;
 
+	// undirected edges, numbered along with the connectivity:
+	// for each triangle, the edge starting at each of its vertices,
+	// and for each edge, the first half-edge (3 * triangle + edge) that lies on it.
+	std::vector<Vec3i>	edgeIds;
+	std::vector<int>	edgeHalfEdges;
+
+	// one-ring of every vertex, as offsets into ringVertices (one more entry than there are vertices).
+	// Interior vertices list their neighbors in walk order, boundary vertices only their two boundary
+	// neighbors. Vertices that are not used by any triangle have an empty ring.
+	std::vector<int>	ringOffsets;
+	std::vector<int>	ringVertices;
+	std::vector<U8>		boundaryVertices;
+
+};
+
+// Loop subdivision of a fixed control mesh topology to a fixed level, precomputed as a
+// sparse matrix: every refined vertex is a weighted sum of control vertices. Once built,
+// a deformed control mesh with the same triangles is refined with one sparse
+// matrix-vector product per attribute instead of a rebuild of every level.
+struct SubdivisionStencils
+{
+	// Computes the stencils for `levels` rounds of LoopSubdivision(). Only the control
+	// mesh's vertex count and triangles are used.
+	void build				(const MeshWithConnectivity& control, int levels);
+	void clear				();
+
+	// Fills in refined positions, normals and colors from the control mesh's, plus the
+	// refined triangles. Matches LoopSubdivision() up to float rounding.
+	void evaluate			(const MeshWithConnectivity& control, MeshWithConnectivity& refined) const;
+
+	int		numRefinedVertices() const { return (int)rowOffsets.size() - 1; }
+	size_t	memoryBytes() const;
+
+	int		levels = -1;
+	int		numControlVertices = 0;
+
+	// weights of refined vertex i are in [rowOffsets[i], rowOffsets[i+1]) (CSR)
+	std::vector<int>	rowOffsets;
+	std::vector<int>	columns;
+	std::vector<float>	weights;
+
+	// triangles of the refined mesh
+	std::vector<Vec3i>	indices;
+};
+
+// View-dependent Loop subdivision. Each level splits only the edges that are long on
+// screen, or that bend more than a given angle while still being visible, then the
+// next level looks at the result again. Levels are kept between updates: when the
+// camera moves, only the levels above the first one whose split edges changed are
+// recomputed.
+struct AdaptiveSubdivision
+{
+	void setControlMesh		(const Mesh<VertexPNC>& mesh);
+
+	// Re-evaluates the refinement for the camera. Returns true if the result changed.
+	bool update				(const Mat4f& worldToClip, const Vec2f& viewportSize);
+
+	const MeshWithConnectivity& result() const { return levels.back(); }
+	bool empty() const { return levels.empty(); }
+
+	int		maxLevel = 4;
+	float	maxEdgePixels = 24.0f;		// split edges longer than this on screen
+	float	maxNormalAngle = 0.35f;		// or whose end normals differ by more (radians)...
+	float	minCurvedEdgePixels = 4.0f;	// ...if they are at least this long on screen
+
+	// levels[0] is the control mesh; every level has its connectivity and one-rings
+	std::vector<MeshWithConnectivity>	levels;
+	// edges of each level that were split to make the next one
+	std::vector<std::vector<U8>>		splitEdges;
+
+private:
+	void markEdges			(int level, const Mat4f& worldToClip, const Vec2f& viewportSize, std::vector<U8>& split) const;
 };
 
+// A subdivision level in about half the memory of Mesh<VertexPNC>: normals are
+// octahedral-encoded into two 16-bit components and colors quantized to 8 bits.
+struct CompactLevel
+{
+	void	pack				(const MeshWithConnectivity& m);
+	void	unpack				(MeshWithConnectivity& m) const;
+	void	toMesh				(Mesh<VertexPNC>& dest) const;
+	size_t	memoryBytes			() const { return positions.size() * (sizeof(Vec3f) + 2 * sizeof(U32)) + indices.size() * sizeof(Vec3i); }
+
+	std::vector<Vec3f>	positions;
+	std::vector<U32>	normals;
+	std::vector<U32>	colors;
+	std::vector<Vec3i>	indices;
+};
+
+// The subdivision levels of one mesh, kept within a memory budget. A missing level is
+// made on request from the nearest coarser level that is still around, and the least
+// recently used levels are evicted when the budget runs out.
+// The control mesh (level 0) is always kept. Levels can be stored as full meshes or as
+// CompactLevels, and computed on a background thread while a coarser level is shown.
+class SubdivisionLevelCache
+{
+public:
+							~SubdivisionLevelCache();
+
+	void					reset				(std::unique_ptr<Mesh<VertexPNC>> control);
+	bool					empty				() const { return levels_.empty(); }
+	const Mesh<VertexPNC>&	controlMesh			() const { return *levels_[0].mesh; }
+
+	// Returns the mesh to draw for the level. With background computation, this is the
+	// closest coarser level until the requested one is ready; see displayedLevel().
+	MeshBase*				get					(int level);
+	int						displayedLevel		() const { return displayed_level_; }
+	bool					isComputing			() const { return pending_.valid(); }
+
+	size_t					memoryBytes			() const;	// retained levels plus the mesh being drawn
+	String					describe			() const;	// usage report for the UI
+
+	size_t					budgetBytes = (size_t)512 << 20;
+	bool					compact = true;		// store new levels as CompactLevels
+	bool					background = false;	// compute missing levels on a worker thread
+
+private:
+	struct Level
+	{
+		std::unique_ptr<Mesh<VertexPNC>>	mesh;		// full storage
+		std::unique_ptr<CompactLevel>		packed;		// compact storage
+		U64									lastUse = 0;
+
+		bool	resident	() const { return mesh || packed; }
+		size_t	memoryBytes	() const;
+	};
+
+	void					store				(int level, const MeshWithConnectivity& m);
+	void					load				(int level, MeshWithConnectivity& m) const;
+	void					evict				(int keep);
+	void					finishPending		();
+	MeshBase*				show				(int level);
+
+	std::vector<Level>		levels_;
+	U64						clock_ = 0;
+
+	// what is being drawn; a compact level is expanded into display_ for that
+	int						displayed_level_ = -1;
+	std::unique_ptr<Mesh<VertexPNC>> display_;
+
+	// background computation of the levels after pending_base_
+	std::future<std::vector<MeshWithConnectivity>> pending_;
+	int						pending_base_ = -1;
+};
+
+// Writes `levels` rounds of Loop subdivision of the mesh to a binary mesh file (see
+// importBinaryMesh) without holding the result in memory. The triangles are processed in
+// spatially compact patches of about patchFaces control triangles, each subdivided together
+// with its one-ring halo, so memory use is bounded by the size of a subdivided patch.
+// Refined vertices where patches meet are written once and shared, so the result is watertight.
+bool subdivideToBinaryFile(const Mesh<VertexPNC>& mesh, int levels, const String& filename, int patchFaces = 4096);
+
 } // namespace FW
@@ -11,20 +11,42 @@
 namespace FW
 {
 
+	// Spherical linear interpolation of unit quaternions (x, y, z, w), along the shorter arc.
+	Vec4f slerp(float t, Vec4f a, Vec4f b);
+
+	// A camera moving along positionPath, oriented by the quaternion curve in orientationPoints
+	// or by the path's own frames. Build() precomputes the arc length along the path and
+	// orientation keyframes, so that the camera moves at constant speed and each evaluation
+	// is a binary search and a slerp.
 	class cameraPath
 	{
 	private:
-		Mat4f GetOrientation(float t);
-		Mat4f GetTranslation(float t);
+		Mat4f GetOrientation(int sample, float frac) const;
 
 	public:
-		Mat4f GetWorldToCam(float t);
+		// Call once positionPath and orientationPoints are set.
+		void  Build(int keys = 32);
+
+		// t in [0, 1] is the fraction of the path's length travelled.
+		Mat4f GetWorldToCam(float t) const;
+		Vec3f GetPosition(float t) const;
 		void  Draw(float t, GLContext* gl, Mat4f projection);
 
+		// Finds the sample of positionPath at or before the fraction t of the path's length,
+		// and how far (0..1) the point at t is towards the next sample.
+		int   FindSample(float t, float& frac) const;
+		float Length() const { return arcLength.empty() ? 0.0f : arcLength.back(); }
+
 		Curve positionPath;
 		std::vector<std::array<Vec4f,4>> orientationPoints;
 		std::unique_ptr<Mesh<VertexPNTC>> mesh;
 
+		// Precomputed by Build(): the path length up to each sample of positionPath, and
+		// the orientation curve at keysPerSegment uniform steps in each of its segments.
+		std::vector<float> arcLength;
+		std::vector<Vec4f> orientationKeys;
+		int keysPerSegment = 0;
+
 		bool loaded = false;
 		bool orientationMode = true;
 	};
@@ -17,42 +17,179 @@ inline bool approx(const Vec3f& lhs, const Vec3f& rhs) {
 }
 
 
-// This is the core routine of the curve evaluation code. Unlike
-// evalBezier, this is only designed to work on 4 control points.
-// Furthermore, it requires you to specify an initial binormal
-// Binit, which is iteratively propagated throughout the curve as
-// the curvepoints are generated. Any other function that creates
-// cubic splines can use this function by a corresponding change
-// of basis.
-Curve coreBezier(const Vec3f& p0,
-				 const Vec3f& p1,
-				 const Vec3f& p2,
-				 const Vec3f& p3,
-				 const Vec3f& Binit,
-				 unsigned steps) {
-
-	Curve R(steps + 1);
-
-	// YOUR CODE HERE (R1): build the basis matrix and loop the given number of steps,
-	// computing points on the spline
-    // Add a row
-    Mat4f G = makeMat4f(Vec4f(p0, 0), Vec4f(p1, 0), Vec4f(p2, 0), Vec4f(p3, 0));
-    // Set spline basis
-    Mat4f B = makeMat4f(1, -3, 3, -1,
-        0, 3, -6, 3,
-        0, 0, 3, -3,
-        0, 0, 0, 1);
-	// Loop the given steps
+// A cubic curve piece in power form, q(t) = a + b t + c t^2 + d t^3 for t in [0, 1].
+// This is G * B for the piece's geometry matrix G and spline basis B, multiplied out
+// once so that sampling doesn't need any matrix products.
+struct CubicPiece
+{
+	Vec3f a, b, c, d;
+};
+
+CubicPiece bezierPiece(const Vec3f& p0, const Vec3f& p1, const Vec3f& p2, const Vec3f& p3) {
+	CubicPiece q;
+	q.a = p0;
+	q.b = 3.0f * (p1 - p0);
+	q.c = 3.0f * (p0 - 2.0f * p1 + p2);
+	q.d = p3 - p0 + 3.0f * (p1 - p2);
+	return q;
+}
+
+// The uniform cubic B-spline basis applied directly, no detour through Bezier points.
+CubicPiece bsplinePiece(const Vec3f& p0, const Vec3f& p1, const Vec3f& p2, const Vec3f& p3) {
+	CubicPiece q;
+	q.a = (p0 + 4.0f * p1 + p2) / 6.0f;
+	q.b = 0.5f * (p2 - p0);
+	q.c = 0.5f * (p0 - 2.0f * p1 + p2);
+	q.d = (p3 - p0 + 3.0f * (p1 - p2)) / 6.0f;
+	return q;
+}
+
+// Some unit vector that is not parallel to T, preferring Binit.
+Vec3f initialBinormal(const Vec3f& T, const Vec3f& Binit) {
+	if (cross(Binit, T).lenSqr() > 1e-6f)
+		return Binit.normalized();
+	Vec3f a = T.abs();
+	return (a.x <= a.y && a.x <= a.z) ? Vec3f(1, 0, 0) : (a.y <= a.z) ? Vec3f(0, 1, 0) : Vec3f(0, 0, 1);
+}
+
+// Unit tangent at q(t): the direction of the first derivative that doesn't vanish there.
+// That is where the curve heads even if q'(t) is zero, e.g. at the start of a Bezier
+// piece with p0 == p1.
+Vec3f initialTangent(const CubicPiece& q, float t) {
+	const Vec3f derivatives[3] = {
+		q.b + t * (2.0f * q.c + 3.0f * t * q.d),
+		2.0f * q.c + 6.0f * t * q.d,
+		6.0f * q.d
+	};
+	for (const Vec3f& v : derivatives)
+		if (v.lenSqr() > 0.0f)
+			return v.normalized();
+	return Vec3f(1, 0, 0);	// the piece is a single point
+}
+
+// Fills in the frame of a sample with derivative v, propagating the tangent T (kept where
+// the derivative vanishes) and the binormal B from the previous sample.
+inline void setFrame(CurvePoint& r, const Vec3f& v, bool first, Vec3f& T, Vec3f& B) {
+	if (v.lenSqr() > 0.0f)
+		T = v.normalized();
+	if (first)
+		B = initialBinormal(T, B);
+	r.T = T;
+	r.N = cross(B, T).normalized();
+	r.B = B = cross(T, r.N);	// unit already, T and N are
+}
+
+// Writes steps + 1 uniformly spaced samples of the piece to out. The point and the
+// tangent are stepped with forward differences (in double, so that thousands of steps
+// don't drift), and the frame is propagated from the binormal B, which is updated to
+// that of the last sample.
+void tessellatePiece(const CubicPiece& q, unsigned steps, Vec3f& B, CurvePoint* out) {
+	steps = FW::max(steps, 1u);
+	double h = 1.0 / steps, h2 = h * h, h3 = h2 * h;
+	Vec3d a(q.a), b(q.b), c(q.c), d(q.d);
+
+	// q(t) and its differences
+	Vec3d p = a;
+	Vec3d dp = b * h + c * h2 + d * h3;
+	Vec3d ddp = c * (2.0 * h2) + d * (6.0 * h3);
+	Vec3d dddp = d * (6.0 * h3);
+
+	// q'(t) = b + 2c t + 3d t^2 and its differences
+	Vec3d v = b;
+	Vec3d dv = c * (2.0 * h) + d * (3.0 * h2);
+	Vec3d ddv = d * (6.0 * h2);
+
+	Vec3f T = initialTangent(q, 0.0f);
 	for (unsigned i = 0; i <= steps; ++i) {
-		// Calculate t with setps
-        float t = 1.0f * float(i) / steps;
-        Vec4f powerBasisVector = Vec4f(1, t, t * t, t * t * t);
-        // Off the row
-        R[i].V = (G * B * powerBasisVector).getXYZ();
+		CurvePoint& r = out[i];
+		r.V = Vec3f(p);
+		setFrame(r, Vec3f(v), i == 0, T, B);
+		r.t = float(i * h);
+
+		p += dp;
+		dp += ddp;
+		ddp += dddp;
+		v += dv;
+		dv += ddv;
 	}
 
+	// land exactly on the piece's end point so that neighboring pieces meet
+	out[steps].V = q.a + q.b + q.c + q.d;
+}
+
+// Appends the parameters in (t0, t1] where the piece needs samples so that it deviates
+// from the chords between them by at most errorbound, splitting intervals in half, but
+// not below minstep. The deviation is bounded by the distance of the interval's inner
+// Bezier control points from its chord, which also catches S-bends that cross the chord
+// in the middle.
+void adaptiveParameters(const CubicPiece& q, float t0, float t1, float errorbound, float minstep, vector<float>& ts) {
+	float h = t1 - t0;
+	if (h > minstep) {
+		Vec3f b0 = q.a + t0 * (q.b + t0 * (q.c + t0 * q.d));
+		Vec3f b3 = q.a + t1 * (q.b + t1 * (q.c + t1 * q.d));
+		Vec3f b1 = b0 + (h / 3.0f) * (q.b + t0 * (2.0f * q.c + 3.0f * t0 * q.d));
+		Vec3f b2 = b3 - (h / 3.0f) * (q.b + t1 * (2.0f * q.c + 3.0f * t1 * q.d));
+
+		// squared distances of b1 and b2 from the chord segment b0-b3
+		Vec3f chord = b3 - b0;
+		float len2 = chord.lenSqr();
+		float s1 = (len2 > 0.0f) ? clamp(dot(b1 - b0, chord) / len2, 0.0f, 1.0f) : 0.0f;
+		float s2 = (len2 > 0.0f) ? clamp(dot(b2 - b0, chord) / len2, 0.0f, 1.0f) : 0.0f;
+		float d2 = FW::max((b0 + s1 * chord - b1).lenSqr(), (b0 + s2 * chord - b2).lenSqr());
+		if (d2 > errorbound * errorbound) {
+			float tm = 0.5f * (t0 + t1);
+			adaptiveParameters(q, t0, tm, errorbound, minstep, ts);
+			adaptiveParameters(q, tm, t1, errorbound, minstep, ts);
+			return;
+		}
+	}
+	ts.push_back(t1);
+}
+
+// Samples the piece at the given parameters with Horner's rule; see tessellatePiece().
+void samplePiece(const CubicPiece& q, const float* ts, size_t n, Vec3f& B, CurvePoint* out) {
+	Vec3f T = initialTangent(q, (n > 0) ? ts[0] : 0.0f);
+	for (size_t i = 0; i < n; ++i) {
+		float t = ts[i];
+		out[i].V = q.a + t * (q.b + t * (q.c + t * q.d));
+		setFrame(out[i], q.b + t * (2.0f * q.c + 3.0f * t * q.d), i == 0, T, B);
+		out[i].t = t;
+	}
+}
+
+// Tessellates consecutive pieces into one presized curve, steps + 1 samples per piece,
+// or with adaptive tessellation as many as each piece needs.
+template <class MakePiece>
+Curve tessellatePieces(const vector<Vec3f>& P, unsigned num_pieces, unsigned stride, unsigned steps,
+					   bool adaptive, float errorbound, float minstep, MakePiece makePiece) {
+	Vec3f B(0, 0, 1);	// keeps the frames of curves on the xy-plane in that plane
+
+	if (adaptive) {
+		// all the parameters first, so that the curve is allocated once
+		vector<CubicPiece> pieces(num_pieces);
+		vector<float> ts;
+		vector<size_t> first(num_pieces + 1, 0);
+		for (unsigned i = 0; i < num_pieces; ++i) {
+			const Vec3f* p = &P[i * stride];
+			pieces[i] = makePiece(p[0], p[1], p[2], p[3]);
+			ts.push_back(0.0f);
+			adaptiveParameters(pieces[i], 0.0f, 1.0f, errorbound, FW::max(minstep, 1e-6f), ts);
+			first[i + 1] = ts.size();
+		}
+		Curve R(ts.size());
+		for (unsigned i = 0; i < num_pieces; ++i)
+			samplePiece(pieces[i], &ts[first[i]], first[i + 1] - first[i], B, &R[first[i]]);
+		return R;
+	}
+
+	unsigned samples = FW::max(steps, 1u) + 1;
+	Curve R(num_pieces * samples);
+	for (unsigned i = 0; i < num_pieces; ++i) {
+		const Vec3f* p = &P[i * stride];
+		tessellatePiece(makePiece(p[0], p[1], p[2], p[3]), steps, B, &R[i * samples]);
+	}
 	return R;
-}    
+}
 
 } // namespace
 
@@ -64,8 +201,13 @@ Curve coreBezier(const Vec3f& p0,
 	const float begin, const float end, const float errorbound, const float minstep) {
 
 	// YOUR CODE HERE(EXTRA): Adaptive tessellation
-
-	return Curve();
+	CubicPiece q = bezierPiece(p0, p1, p2, p3);
+	vector<float> ts(1, begin);
+	adaptiveParameters(q, begin, end, errorbound, FW::max(minstep, 1e-6f), ts);
+	Curve R(ts.size());
+	Vec3f B = Binit;
+	samplePiece(q, &ts[0], ts.size(), B, &R[0]);
+	return R;
 }
     
 // the P argument holds the control points and steps gives the amount of uniform tessellation.
@@ -86,70 +228,8 @@ Curve evalBezier(const vector<Vec3f>& P, unsigned steps, bool adaptive, float er
     // the SWP files are written.  But you are free to interpret this
     // variable however you want, so long as you can control the
     // "resolution" of the discretized spline curve with it.
-    Curve R;
-    // Loop the given P vector
-    for (unsigned i = 0; i != P.size() - 1;) {
-        Vec3f binit = Vec3f(0, 0, 0);
-        Curve splinePiece = coreBezier(P[i], P[i + 1], P[i + 2], P[i + 3], binit, steps);
-        // Combine
-        R.insert(R.end(), splinePiece.begin(), splinePiece.end());
-        i += 3;
-    }
-
-
-	// EXTRA CREDIT NOTE:
-    // Also compute the other Vec3fs for each CurvePoint: T, N, B.
-    // A matrix [N, B, T] should be unit and orthogonal.
-    // Also note that you may assume that all Bezier curves that you
-    // receive have G1 continuity. The T, N and B vectors will not
-	// have to be defined at points where this does not hold.
-    /*
-    for (unsigned i = 0; i != R.size(); i++) {
-        Mat4f G = makeMat4f(Vec4f(R[i].V, 0), Vec4f(R[i + 1].V, 0), Vec4f(R[i + 2].V, 0), Vec4f(R[i + 3].V, 0));
-        Mat4f B2 = makeMat4f(
-            0, 3, -24, 21,
-            0, 0, 6, -9,
-            0, 0, 0, 3,
-            0, 0, 0, 0);
-         Vec3f Pdiff = R[i + 1].V - R[i].V;
-        float t = 1.0f * float(i) / R.size();
-        Vec4f powerBasisVector2 = Vec4f(0, 1, t, t * t);
-        // Ti = qd(ti).normalized()
-        R[i].T = Vec3f(G * B2 * (powerBasisVector2).getXYZ()).normalized();
-    }
-    R[0].B = (R[1].T.x, R[1].T.y + 1, R[1].T.z);
-    for (unsigned i = 1; i != R.size(); i++) {
-        Vec3f M= R[i - 1].B;
-        Vec3f N = R[i].T;
-        // Ni = (Bi?1  Ti).normalized()
-        R[i].N = Vec3f(M.y * N.z - N.y * M.z, N.x * M.z - M.x * N.z, M.x * N.y - N.x * M.y).normalized();
-        M = R[i].T;
-        N = R[i].N;
-        // Bi = (Ti  Ni).normalized()
-        R[i].B = Vec3f(M.y * N.z - N.y * M.z, N.x * M.z - M.x * N.z, M.x * N.y - N.x * M.y).normalized();
-    }
-    */
-
-    cerr << "\t>>> evalBezier has been called with the following input:" << endl;
-
-	// to append to a std::vector, use std::insert.
-	// for example, to add 'b' to the end of 'a', we'd call 'a.insert(a.end(), b.begin(), b.end());'
-
-    cerr << "\t>>> Control points (type vector<Vec3f>): "<< endl;
-    for (unsigned i = 0; i < P.size(); ++i) {
-        cerr << "\t>>> "; printTranspose(P[i]); cerr << endl;
-    }
-
-    cerr << "\t>>> Steps (type steps): " << steps << endl;
-    // cerr << "\t>>> Returning empty curve." << endl;
-    cerr << "\t>>> Curve points (type vector<Vec3f>): " << endl;
-    for (unsigned i = 0; i < R.size(); ++i) {
-        cerr << "\t>>> "; printTranspose(R[i].V); cerr << endl;
-    }
-
-    // Right now this will just return this empty curve.
-    // return Curve();
-    return R;
+	// Consecutive pieces share a control point.
+	return tessellatePieces(P, unsigned(P.size() - 1) / 3, 3, steps, adaptive, errorbound, minstep, bezierPiece);
 }
 
 // the P argument holds the control points and steps gives the amount of uniform tessellation.
@@ -162,53 +242,8 @@ Curve evalBspline(const vector<Vec3f>& P, unsigned steps, bool adaptive, float e
     }
 
     // YOUR CODE HERE (R2):
-    // We suggest you implement this function via a change of basis from
-	// B-spline to Bezier.  That way, you can just call your evalBezier function.
-    Curve R;
-    // Spline basis of B-spline
-    Mat4f B1 = makeMat4f(1, -3, 3, -1,
-        4, 0, -6, 3,
-        1, 3, 3, -3,
-        0, 0, 0, 1);
-    B1 = B1 / 6;
-    // Spline basis of Bezier
-    Mat4f B2 = makeMat4f(1, -3, 3, -1,
-        0, 3, -6, 3,
-        0, 0, 3, -3,
-        0, 0, 0, 1);
-    // Loop the given P vector
-    for (unsigned i = 0; i != P.size() - 3; i++) {
-        // Add a row
-        Mat4f G0 = makeMat4f(Vec4f(P[i], 0), Vec4f(P[i + 1], 0), Vec4f(P[i + 2], 0), Vec4f(P[i + 3], 0));
-        // Change the basis
-        Mat4f G = G0 * B1 * B2.inverted();
-        Vec4f P0 = G.getCol(0);
-        Vec4f P1 = G.getCol(1);
-        Vec4f P2 = G.getCol(2);
-        Vec4f P3 = G.getCol(3);
-        // Off the row
-        Curve splinePiece = coreBezier(P0.getXYZ(), P1.getXYZ(), P2.getXYZ(), P3.getXYZ(), Vec3f(0, 0, 0), steps);
-        R.insert(R.end(), splinePiece.begin(), splinePiece.end());
-    }
-
-
-    cerr << "\t>>> evalBSpline has been called with the following input:" << endl;
-
-    cerr << "\t>>> Control points (type vector< Vec3f >): "<< endl;
-    for (unsigned i = 0; i < P.size(); ++i) {
-        cerr << "\t>>> "; printTranspose(P[i]); cerr << endl;
-    }
-
-    cerr << "\t>>> Steps (type steps): " << steps << endl;
-    // cerr << "\t>>> Returning empty curve." << endl;
-    cerr << "\t>>> Curve points (type vector<Vec3f>): " << endl;
-    for (unsigned i = 0; i < R.size(); ++i) {
-        cerr << "\t>>> "; printTranspose(R[i].V); cerr << endl;
-    }
-
-    // Return an empty curve right now.
-    // return Curve();
-    return R;
+	// Every four consecutive control points make a piece.
+	return tessellatePieces(P, unsigned(P.size() - 3), 1, steps, adaptive, errorbound, minstep, bsplinePiece);
 }
 
 Curve evalCircle(float radius, unsigned steps) {
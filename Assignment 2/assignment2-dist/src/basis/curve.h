@@ -28,6 +28,9 @@ typedef std::vector<CurvePoint> Curve;
 // "step" indicates the number of samples PER PIECE.  E.g., a
 // 7-control-point Bezier curve will have two pieces (and the 4th
 // control point is shared).
+// With adaptive set, "steps" is ignored: each piece is instead split in
+// half until no part strays more than errorbound from its chord, or the
+// parameter step would drop below minstep.
 ////////////////////////////////////////////////////////////////////////////
 
 // Assume number of control points properly specifies a piecewise
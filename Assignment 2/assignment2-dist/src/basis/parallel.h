@@ -0,0 +1,29 @@
+#pragma once
+
+#include "base/Math.hpp"
+
+#include <thread>
+#include <vector>
+
+namespace FW {
+
+// Splits [0, n) into contiguous chunks, one per hardware thread (or fewer for small n),
+// and runs body(chunk, begin, end) for each chunk on its own thread.
+inline int numChunks(int n, int min_chunk_size = 4096)
+{
+	int threads = max(1, (int)std::thread::hardware_concurrency());
+	return clamp(n / FW::max(min_chunk_size, 1), 1, threads);
+}
+
+template <class F>
+void parallelChunks(int n, int chunks, const F& body)
+{
+	std::vector<std::thread> threads;
+	for (int c = 1; c < chunks; ++c)
+		threads.emplace_back([&body, c, n, chunks]() { body(c, (int)((S64)n * c / chunks), (int)((S64)n * (c + 1) / chunks)); });
+	body(0, 0, (int)((S64)n / chunks));
+	for (auto& t : threads)
+		t.join();
+}
+
+} // namespace FW
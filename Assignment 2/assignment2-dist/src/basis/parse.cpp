@@ -51,18 +51,6 @@ namespace {
         return cps;
     }
 
-	Vec4f slerp(float t, Vec4f a, Vec4f b)
-	{
-		float omega = FW::acos(clamp(FW::abs(dot(a, b)), -1.0f, 1.0f));
-		if (dot(a, b) < 0)
-			b = -b;
-		if (omega == 0)
-			return a;
-		return
-			FW::sin((1 - t) * omega) / FW::sin(omega) * a +
-			FW::sin(t * omega) / FW::sin(omega) * b;
-	}
-
 	Vec4f quatInverse(Vec4f q) {
 		q.x = -q.x;
 		q.y = -q.y;
@@ -217,6 +205,7 @@ bool parseFile(istream &in,
 			camPath.orientationPoints = quaternions;
 			camPath.positionPath = curves[curveIndex["pos"]];
 			curves[curveIndex["pos"]] = camPath.positionPath;
+			camPath.Build();
 			camPath.loaded = true;
 		}
         else if (objType == "srev")
@@ -1,5 +1,6 @@
 #include "surf.h"
 #include "extra.h"
+#include "parallel.h"
 
 using namespace std;
 using namespace FW;
@@ -21,15 +22,28 @@ namespace
     // generates faces in terms of vertex indices.  It is assumed that
     // the indices go as shown in the picture (the first dia vertices
     // correspond to the first repetition of the profile curve, and so
-    // on).  It will generate faces [0 5 1], [1 5 6], [1 6 2], ...
+    // on).  It will generate faces [0 1 5], [1 6 5], [1 2 6], ...
     // The boolean variable "closed" will determine whether the
     // function closes the curve (that is, connects the last profile
     // to the first profile).
     static vector< FW::Vec3i > triSweep( unsigned dia, unsigned len, bool closed )
     {
-        vector< FW::Vec3i > ret;
-
-		// YOUR CODE HERE: generate zigzagging triangle indices and push them to ret.
+		// Each pair of consecutive profile copies is joined by a band of 2 * (dia - 1)
+		// triangles. The bands don't depend on each other, so they are filled in parallel.
+		int bands = (dia < 2 || len < 2) ? 0 : int(closed ? len : len - 1);
+		size_t band_size = 2 * size_t(dia - 1);
+        vector< FW::Vec3i > ret(bands * band_size);
+
+		parallelChunks(bands, numChunks(bands, 4096 / FW::max(dia, 1u)), [&](int, int begin, int end) {
+			for (int j = begin; j < end; ++j) {
+				int a = j * dia, b = ((j + 1) % len) * dia;
+				Vec3i* out = &ret[j * band_size];
+				for (int i = 0; i + 1 < int(dia); ++i) {
+					*out++ = Vec3i(a + i, a + i + 1, b + i);
+					*out++ = Vec3i(a + i + 1, b + i + 1, b + i);
+				}
+			}
+		});
 
         return ret;
     }
@@ -63,9 +77,25 @@ Surface makeSurfRev(const Curve &profile, unsigned steps)
 	// point in the profile (that's two cascaded loops), and finally get the faces with triSweep.
 	// You'll need to rotate the curve at each step, similar to the cone in assignment 0 but
 	// now you should be using a real rotation matrix.
+	// Every step writes its own copy of the profile, so the steps run in parallel.
+	unsigned dia = unsigned(profile.size());
+	if (steps == 0 || dia == 0)
+		return surface;
+	surface.VV.resize(size_t(steps) * dia);
+	surface.VN.resize(size_t(steps) * dia);
+
+	parallelChunks(steps, numChunks(steps, 4096 / dia), [&](int, int begin, int end) {
+		for (int j = begin; j < end; ++j) {
+			Mat3f R = Mat3f::rotation(Vec3f(0, 1, 0), -2.0f * FW_PI * j / steps);
+			for (unsigned i = 0; i < dia; ++i) {
+				// the profile normal points towards the center of curvature, flip it outwards
+				surface.VV[j * dia + i] = R * profile[i].V;
+				surface.VN[j * dia + i] = -(R * profile[i].N);
+			}
+		}
+	});
+	surface.VF = triSweep(dia, steps, true);
 
-    cerr << "\t>>> makeSurfRev called (but not implemented).\n\t>>> Returning empty surface." << endl;
- 
     return surface;
 }
 
@@ -82,8 +112,27 @@ Surface makeGenCyl(const Curve &profile, const Curve &sweep )
     // YOUR CODE HERE: build the surface. 
 	// This is again two cascaded loops. Build the local coordinate systems and transform
 	// the points in a very similar way to the one with makeSurfRev.
-
-    cerr << "\t>>> makeGenCyl called (but not implemented).\n\t>>> Returning empty surface." <<endl;
+	// The profile's xy-plane is mapped to the sweep's normal-binormal plane at each sweep point.
+	unsigned dia = unsigned(profile.size()), len = unsigned(sweep.size());
+	if (len == 0 || dia == 0)
+		return surface;
+	surface.VV.resize(size_t(len) * dia);
+	surface.VN.resize(size_t(len) * dia);
+
+	parallelChunks(len, numChunks(len, 4096 / dia), [&](int, int begin, int end) {
+		for (int j = begin; j < end; ++j) {
+			Mat3f F;
+			F.setCol(0, sweep[j].N);
+			F.setCol(1, sweep[j].B);
+			F.setCol(2, sweep[j].T);
+			for (unsigned i = 0; i < dia; ++i) {
+				// F is orthonormal, so it also transforms the normals
+				surface.VV[j * dia + i] = F * profile[i].V + sweep[j].V;
+				surface.VN[j * dia + i] = -(F * profile[i].N);
+			}
+		}
+	});
+	surface.VF = triSweep(dia, len, false);
 
     return surface;
 }
@@ -4,6 +4,7 @@
 #include "base/Main.hpp"
 #include "gpu/GLContext.hpp"
 #include "gpu/Buffer.hpp"
+#include "parsing.hpp"
 #include "utility.hpp"
 
 #include <array>
@@ -27,12 +28,17 @@ enum VertexShaderAttributeLocations
 	ATTRIB_POSITION = 0,
 	ATTRIB_NORMAL = 1,
 	ATTRIB_COLOR = 2,
-	ATTRIB_JOINTS1 = 3,
-	ATTRIB_JOINTS2 = 4,
-	ATTRIB_WEIGHTS1 = 5,
-	ATTRIB_WEIGHTS2 = 6
+	ATTRIB_JOINTS = 3,
+	ATTRIB_WEIGHTS = 4
 };
 
+// The crowd stands on a grid around the point the camera orbits, and the camera
+// looks at it from farther away and from above.
+const int	CROWD_SIZE = 256;
+const float	CROWD_SPACING = 1.0f;
+const float	CROWD_CAMERA_DISTANCE = 14.0f;
+const float	CROWD_CAMERA_PITCH = -0.5f;
+
 } // namespace
 
 App::App(void)
@@ -45,12 +51,12 @@ App::App(void)
 	selected_joint_			(0)
 {
 	static_assert(is_standard_layout<Vertex>::value, "Vertex must be standard layout to use offsetof");
-	static_assert(is_standard_layout<WeightedVertex>::value, "WeightedVertex must be standard layout to use offsetof");
+	static_assert(is_standard_layout<PackedSkinVertex>::value, "PackedSkinVertex must be standard layout to use offsetof");
 
 	static const Vec3f distinct_colors[6] = {
 		Vec3f(0, 0, 1), Vec3f(0, 1, 0), Vec3f(0, 1, 1),
 		Vec3f(1, 0, 0), Vec3f(1, 0, 1), Vec3f(1, 1, 0)};
-	for (auto i = 0u; i < 100; ++i)
+	for (auto i = 0u; i < MAX_SKIN_JOINTS; ++i)
 		joint_colors_.push_back(distinct_colors[i % 6]);
 
 	String filename = window_.showFileLoadDialog("Load model");
@@ -68,6 +74,7 @@ App::App(void)
 	common_ctrl_.addToggle((S32*)&drawmode_, MODE_SKELETON,			FW_KEY_1, "Draw joints and bones (1)");
 	common_ctrl_.addToggle((S32*)&drawmode_, MODE_MESH_CPU,			FW_KEY_2, "Draw mesh, SSD on CPU (2)");
 	common_ctrl_.addToggle((S32*)&drawmode_, MODE_MESH_GPU,			FW_KEY_3, "EXTRA: Draw mesh, SSD on GPU (3)");
+	common_ctrl_.addToggle((S32*)&drawmode_, MODE_CROWD,			FW_KEY_4, "Draw crowd, SSD on GPU (4)");
 	common_ctrl_.addSeparator();
 	common_ctrl_.addToggle(&animationMode,							FW_KEY_A, "Animate mesh (A)");
 	common_ctrl_.addToggle(&shading_toggle_,						FW_KEY_T, "Toggle shading mode (T)",	&shading_mode_changed_);
@@ -138,17 +145,22 @@ void App::initRendering()
 	// As a side effect, this initializes the OpenGL context and lets us call GL functions.
 	auto ctx = window_.getGL();
 
-	animationStart = GetTickCount();
+	animation_timer_.start();
 	
 	// Create vertex attribute objects and buffers for vertex data.
 	glGenVertexArrays(1, &gl_.simple_vao);
 	glGenVertexArrays(1, &gl_.ssd_vao);
-	glGenBuffers(1, &gl_.simple_vertex_buffer);
 	glGenBuffers(1, &gl_.ssd_vertex_buffer);
+	glGenBuffers(1, &gl_.index_buffer);
+	glGenTextures(1, &gl_.ssd_palette_texture);
+	glGenTextures(1, &gl_.crowd_palette_texture);
 	
-	// Set up vertex attribute object for doing SSD on the CPU. The data will be loaded and re-loaded later, on each frame.
+	// Set up vertex attribute object for doing SSD on the CPU. The skinning writes each
+	// frame's vertices to the next region of the stream buffer, and the draw picks the
+	// region with its base vertex.
+	skinned_vertex_stream_.init(GL_ARRAY_BUFFER, skinned_lods_.empty() ? 0 : sizeof(Vertex) * skinned_lods_[0].numVertices());
 	glBindVertexArray(gl_.simple_vao);
-	glBindBuffer(GL_ARRAY_BUFFER, gl_.simple_vertex_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, skinned_vertex_stream_.getHandle());
 	glEnableVertexAttribArray(ATTRIB_POSITION);
 	glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) 0);
 	glEnableVertexAttribArray(ATTRIB_NORMAL);
@@ -156,31 +168,55 @@ void App::initRendering()
 	glEnableVertexAttribArray(ATTRIB_COLOR);
 	glVertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, color));
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// Both paths draw the same triangles, so they share one index buffer.
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl_.index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(U32) * indices_.size(), indices_.data(), GL_STATIC_DRAW);
 	glBindVertexArray(0);
 	
 	// Set up vertex attribute object for doing SSD on the GPU, and load all data to buffer.
 	glBindVertexArray(gl_.ssd_vao);
 	glBindBuffer(GL_ARRAY_BUFFER, gl_.ssd_vertex_buffer);
 	glEnableVertexAttribArray(ATTRIB_POSITION);
-	glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid*) 0);
+	glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(PackedSkinVertex), (GLvoid*) 0);
 	glEnableVertexAttribArray(ATTRIB_NORMAL);
-	glVertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid*) offsetof(WeightedVertex, normal));
+	glVertexAttribPointer(ATTRIB_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedSkinVertex), (GLvoid*) offsetof(PackedSkinVertex, normal));
 	glEnableVertexAttribArray(ATTRIB_COLOR);
-	glVertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid*) offsetof(WeightedVertex, color));
-	glEnableVertexAttribArray(ATTRIB_JOINTS1);
-	glVertexAttribIPointer(ATTRIB_JOINTS1, 4, GL_INT, sizeof(WeightedVertex), (GLvoid*) offsetof(WeightedVertex, joints[0]));
-	glEnableVertexAttribArray(ATTRIB_JOINTS2);
-	glVertexAttribIPointer(ATTRIB_JOINTS2, 4, GL_INT, sizeof(WeightedVertex), (GLvoid*) offsetof(WeightedVertex, joints[4]));
-	glEnableVertexAttribArray(ATTRIB_WEIGHTS1);
-	glVertexAttribPointer(ATTRIB_WEIGHTS1, 4, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid*) offsetof(WeightedVertex, weights[0]));
-	glEnableVertexAttribArray(ATTRIB_WEIGHTS2);
-	glVertexAttribPointer(ATTRIB_WEIGHTS2, 4, GL_FLOAT, GL_FALSE, sizeof(WeightedVertex), (GLvoid*) offsetof(WeightedVertex, weights[4]));
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(WeightedVertex) * weighted_vertices_.size(), weighted_vertices_.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedSkinVertex), (GLvoid*) offsetof(PackedSkinVertex, color));
+	glEnableVertexAttribArray(ATTRIB_JOINTS);
+	glVertexAttribIPointer(ATTRIB_JOINTS, SKIN_INFLUENCES, GL_UNSIGNED_SHORT, sizeof(PackedSkinVertex), (GLvoid*) offsetof(PackedSkinVertex, joints));
+	glEnableVertexAttribArray(ATTRIB_WEIGHTS);
+	glVertexAttribPointer(ATTRIB_WEIGHTS, SKIN_INFLUENCES, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedSkinVertex), (GLvoid*) offsetof(PackedSkinVertex, weights));
+
+	glBufferData(GL_ARRAY_BUFFER, sizeof(PackedSkinVertex) * packed_vertices_.size(), packed_vertices_.data(), GL_STATIC_DRAW);
 
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl_.index_buffer);
 	glBindVertexArray(0);
 
+	// The shader reads the joint matrices from a texture buffer, three RGBA32F texels
+	// (rows) per matrix, so the palette is as long as the skeleton needs. The crowd is
+	// drawn from the same vertex array with a palette of its own. Each texture spans all
+	// regions of its stream buffer; the shader adds the current one's offset. Where
+	// texture buffers cannot hold the whole crowd, fewer instances are drawn.
+	const size_t matrix_bytes = JOINT_MATRIX_FLOATS * sizeof(float);
+	GLint max_texels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+	const size_t instance_texels = StreamBuffer::REGIONS * matrix_bytes * crowd_.numJoints() / sizeof(Vec4f);
+	if (size_t(crowd_.numInstances()) * instance_texels > size_t(max_texels)) {
+		int count = int(size_t(max_texels) / instance_texels);
+		cout << "crowd:      " << count << " of " << crowd_.numInstances() << " instances fit in "
+			 << max_texels << " texels" << endl;
+		initCrowd(count);
+	}
+	joint_palette_stream_.init(GL_TEXTURE_BUFFER, matrix_bytes * skel_.getNumJoints());
+	glBindTexture(GL_TEXTURE_BUFFER, gl_.ssd_palette_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, joint_palette_stream_.getHandle());
+	crowd_palette_stream_.init(GL_TEXTURE_BUFFER, matrix_bytes * crowd_.palette().size());
+	glBindTexture(GL_TEXTURE_BUFFER, gl_.crowd_palette_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, crowd_palette_stream_.getHandle());
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+
 	// Compile and link the shader programs.
 
 	auto simple_prog = new GLContext::Program(
@@ -225,26 +261,45 @@ void App::initRendering()
 		layout(location = 0) in vec4 aPosition;
 		layout(location = 1) in vec3 aNormal;
 		layout(location = 2) in vec4 aColor;
-		layout(location = 3) in ivec4 aJoints1;
-		layout(location = 4) in ivec4 aJoints2;
-		layout(location = 5) in vec4 aWeights1;
-		layout(location = 6) in vec4 aWeights2;
+		layout(location = 3) in uvec4 aJoints;
+		layout(location = 4) in vec4 aWeights;
 
 		const vec3 directionToLight = normalize(vec3(0.5, 0.5, 0.6));
 		uniform mat4 uWorldToClip;
 		uniform float uShadingMix;
 
-		out vec4 vColor;		
+		// The rows of the 3x4 joint matrices, three texels per joint. In an instanced
+		// draw, the matrices of instance k follow those of instance k - 1.
+		uniform samplerBuffer uPalette;
+		uniform int uPaletteOffset;
+		uniform int uNumJoints;
+
+		out vec4 vColor;
+
+		void addJoint(uint joint, float weight, inout vec4 r0, inout vec4 r1, inout vec4 r2)
+		{
+			int base = uPaletteOffset + 3 * (gl_InstanceID * uNumJoints + int(joint));
+			r0 += weight * texelFetch(uPalette, base);
+			r1 += weight * texelFetch(uPalette, base + 1);
+			r2 += weight * texelFetch(uPalette, base + 2);
+		}
 
-		const int numJoints = 100;
-		uniform mat4 uJoints[numJoints];
-	
 		void main()
 		{
-			float clampedCosine = clamp(dot(aNormal, directionToLight), 0.0, 1.0);
+			// Up to four influences; the unused ones have zero weight.
+			vec4 r0 = vec4(0.0);
+			vec4 r1 = vec4(0.0);
+			vec4 r2 = vec4(0.0);
+			addJoint(aJoints.x, aWeights.x, r0, r1, r2);
+			addJoint(aJoints.y, aWeights.y, r0, r1, r2);
+			addJoint(aJoints.z, aWeights.z, r0, r1, r2);
+			addJoint(aJoints.w, aWeights.w, r0, r1, r2);
+			vec4 position = vec4(dot(r0, aPosition), dot(r1, aPosition), dot(r2, aPosition), 1.0);
+			vec3 normal = normalize(vec3(dot(r0.xyz, aNormal), dot(r1.xyz, aNormal), dot(r2.xyz, aNormal)));
+			float clampedCosine = clamp(dot(normal, directionToLight), 0.0, 1.0);
 			vec3 litColor = vec3(clampedCosine);
 			vColor = vec4(mix(aColor.xyz, litColor, uShadingMix), 1);
-			gl_Position = uWorldToClip * aPosition;
+			gl_Position = uWorldToClip * position;
 		}
 		),
 		"#version 330\n"
@@ -260,9 +315,11 @@ void App::initRendering()
 
 	// Get the IDs of the shader programs and their uniform input locations from OpenGL.
 	gl_.ssd_shader = ssd_prog->getHandle();
-	gl_.ssd_transforms_uniform = glGetUniformLocation(gl_.ssd_shader, "uJoints");
 	gl_.ssd_world_to_clip_uniform = glGetUniformLocation(gl_.ssd_shader, "uWorldToClip");
 	gl_.ssd_shading_mix_uniform = glGetUniformLocation(gl_.ssd_shader, "uShadingMix");
+	gl_.ssd_palette_uniform = glGetUniformLocation(gl_.ssd_shader, "uPalette");
+	gl_.ssd_palette_offset_uniform = glGetUniformLocation(gl_.ssd_shader, "uPaletteOffset");
+	gl_.ssd_num_joints_uniform = glGetUniformLocation(gl_.ssd_shader, "uNumJoints");
 	gl_.simple_shader = simple_prog->getHandle();
 	gl_.simple_world_to_clip_uniform = glGetUniformLocation(gl_.simple_shader, "uWorldToClip");
 	gl_.simple_shading_mix_uniform = glGetUniformLocation(gl_.simple_shader, "uShadingMix");
@@ -278,8 +335,7 @@ void App::render() {
 
 	if (animationMode)
 	{
-		int animFrame = int((GetTickCount() - animationStart) / 16.666668f);
-		skel_.setAnimationFrame(animFrame);
+		skel_.setAnimationTime(animation_timer_.getElapsed());
 	}
 
 	// Adjust viewport and aspect ratio to window
@@ -293,9 +349,12 @@ void App::render() {
 	// World space -> clip space transform: simple projection and camera.
 
 	// Our camera orbits around (0.5, 0.5, 0.5) at a fixed distance.
-	static const float camera_distance = 0.8f;	
+	const bool crowd_view = drawmode_ == MODE_CROWD;
+	const float camera_distance = crowd_view ? CROWD_CAMERA_DISTANCE : 0.8f;
 	Mat4f C;
-	const Mat3f rot = Mat3f::rotation(Vec3f(0, 1, 0), -camera_rotation_);
+	Mat3f rot = Mat3f::rotation(Vec3f(0, 1, 0), -camera_rotation_);
+	if (crowd_view)
+		rot = Mat3f::rotation(Vec3f(1, 0, 0), CROWD_CAMERA_PITCH) * rot;
 	C.setCol(0, Vec4f(rot.getCol(0), 0));
 	C.setCol(1, Vec4f(rot.getCol(1), 0));
 	C.setCol(2, Vec4f(rot.getCol(2), 0));
@@ -303,13 +362,17 @@ void App::render() {
 	C = C * Mat4f::translate(Vec3f(-0.5f));
 
 	Mat4f P;
-	static const float fNear = 0.1f, fFar = 4.0f;
+	const float fNear = 0.1f, fFar = crowd_view ? 2.0f * CROWD_CAMERA_DISTANCE : 4.0f;
 	P.setCol(0, Vec4f(1, 0, 0, 0));
 	P.setCol(1, Vec4f(0, fAspect, 0, 0));
 	P.setCol(2, Vec4f(0, 0, (fFar+fNear)/(fFar-fNear), 1));
 	P.setCol(3, Vec4f(0, 0, -2*fFar*fNear/(fFar-fNear), 0));
 	Mat4f world_to_clip = P * C;
 
+	// The level of detail is picked by how many pixels its error would cover.
+	Vec3f camera_position = (C.inverted() * Vec4f(0, 0, 0, 1)).getXYZ();
+	const float pixels_per_unit = 0.5f * P(0, 0) * sz.x;
+
 	if (drawmode_ == MODE_SKELETON) {
 		// Draw the skeleton as a set of joint positions, connecting lines,
 		// and local coordinate systems at each joint.
@@ -325,44 +388,140 @@ void App::render() {
 		glMatrixMode(GL_MODELVIEW);
 		glLoadMatrixf(&C(0,0));
 		renderSkeleton();
-	} else if (drawmode_ == MODE_MESH_CPU) {
-		auto vertices = computeSSD(weighted_vertices_);
-
-		glBindBuffer(GL_ARRAY_BUFFER, gl_.simple_vertex_buffer);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		glUseProgram(gl_.simple_shader);
-		glUniformMatrix4fv(gl_.simple_world_to_clip_uniform, 1, GL_FALSE, world_to_clip.getPtr());
-		glUniform1f(gl_.simple_shading_mix_uniform, shading_toggle_ ? 1.0f : 0.0f);
-		glBindVertexArray(gl_.simple_vao);
-		glDrawArrays(GL_TRIANGLES, 0, (int)vertices.size());
-		glBindVertexArray(0);
-		glUseProgram(0);
-	} else if (drawmode_ == MODE_MESH_GPU) {
-		auto ssd_transforms = skel_.getSSDTransforms();
-
-		glUseProgram(gl_.ssd_shader);
-		glUniformMatrix4fv(gl_.ssd_world_to_clip_uniform, 1, GL_FALSE, world_to_clip.getPtr());
-		glUniform1f(gl_.ssd_shading_mix_uniform, shading_toggle_ ? 1.0f : 0.0f);
-		glUniformMatrix4fv(gl_.ssd_transforms_uniform, GLsizei(ssd_transforms.size()), GL_FALSE, (GLfloat*)ssd_transforms.data());
-		
-		glBindVertexArray(gl_.ssd_vao);
-		glDrawArrays(GL_TRIANGLES, 0, (int)weighted_vertices_.size());
-		glBindVertexArray(0);
-		glUseProgram(0);
+	} else if (drawmode_ == MODE_MESH_CPU && !lods_.empty()) {
+		const int lod = selectLod(skel_.getJointWorldPosition(0), camera_position, pixels_per_unit);
+		if (Vertex* vertices = (Vertex*)skinned_vertex_stream_.map()) {
+			computeSSD(vertices, lod);
+			skinned_vertex_stream_.unmap();
+			drawn_lod_ = lod;
+			drawn_triangles_ = lods_[lod].num_indices / 3;
+
+			glUseProgram(gl_.simple_shader);
+			glUniformMatrix4fv(gl_.simple_world_to_clip_uniform, 1, GL_FALSE, world_to_clip.getPtr());
+			glUniform1f(gl_.simple_shading_mix_uniform, shading_toggle_ ? 1.0f : 0.0f);
+			glBindVertexArray(gl_.simple_vao);
+			glDrawElementsBaseVertex(GL_TRIANGLES, lods_[lod].num_indices, GL_UNSIGNED_INT, (GLvoid*)(sizeof(U32) * lods_[lod].first_index),
+				GLint(skinned_vertex_stream_.offset() / sizeof(Vertex)));
+			glBindVertexArray(0);
+			glUseProgram(0);
+			skinned_vertex_stream_.fence();
+		}
+	} else if (drawmode_ == MODE_MESH_GPU && !lods_.empty()) {
+		// One write of the palette per frame; any number of draws may then read it.
+		const auto& ssd_transforms = skel_.getSSDTransforms();
+		if (float* mapped = (float*)joint_palette_stream_.map()) {
+			packJointMatrices(ssd_transforms.data(), ssd_transforms.size(), mapped);
+			joint_palette_stream_.unmap();
+			const int lod = selectLod(skel_.getJointWorldPosition(0), camera_position, pixels_per_unit);
+			renderSkinned(world_to_clip, gl_.ssd_palette_texture, GLint(joint_palette_stream_.offset() / sizeof(Vec4f)),
+				int(ssd_transforms.size()), lod, 1);
+			joint_palette_stream_.fence();
+			drawn_lod_ = lod;
+			drawn_triangles_ = lods_[lod].num_indices / 3;
+		}
+	} else if (drawmode_ == MODE_CROWD && crowd_.numInstances() > 0) {
+		crowd_.update(animationMode ? animation_timer_.getElapsed() : 0.0f, camera_position, thread_pool_);
+
+		// Group the instances by level of detail, so that each level is one instanced
+		// draw of consecutive palette entries.
+		const int num_instances = crowd_.numInstances();
+		const int num_levels = int(lods_.size());
+		crowd_lod_.resize(num_instances);
+		crowd_lod_order_.resize(num_instances);
+		crowd_lod_first_.assign(num_levels + 1, 0);
+		for (int i = 0; i < num_instances; ++i) {
+			Vec3f center = crowd_.instance(i).position + Vec3f(0, lod_center_.y, 0);
+			crowd_lod_[i] = selectLod(center, camera_position, pixels_per_unit);
+			++crowd_lod_first_[crowd_lod_[i] + 1];
+		}
+		for (int l = 0; l < num_levels; ++l)
+			crowd_lod_first_[l + 1] += crowd_lod_first_[l];
+		for (int i = 0; i < num_instances; ++i)
+			crowd_lod_order_[crowd_lod_first_[crowd_lod_[i]]++] = i;
+		for (int l = num_levels; l > 0; --l)
+			crowd_lod_first_[l] = crowd_lod_first_[l - 1];
+		crowd_lod_first_[0] = 0;
+
+		// The instances that were not due keep their old matrices, so the whole
+		// palette is copied to the next region.
+		const auto& palette = crowd_.palette();
+		const int num_joints = crowd_.numJoints();
+		if (float* mapped = (float*)crowd_palette_stream_.map()) {
+			for (int k = 0; k < num_instances; ++k)
+				packJointMatrices(&palette[size_t(crowd_lod_order_[k]) * num_joints], num_joints,
+					mapped + size_t(k) * num_joints * JOINT_MATRIX_FLOATS);
+			crowd_palette_stream_.unmap();
+
+			const GLint palette_offset = GLint(crowd_palette_stream_.offset() / sizeof(Vec4f));
+			drawn_triangles_ = 0;
+			for (int l = 0; l < num_levels; ++l) {
+				int first = crowd_lod_first_[l], count = crowd_lod_first_[l + 1] - first;
+				if (count == 0)
+					continue;
+				renderSkinned(world_to_clip, gl_.crowd_palette_texture, palette_offset + 3 * first * num_joints, num_joints, l, count);
+				drawn_triangles_ += count * lods_[l].num_indices / 3;
+			}
+			crowd_palette_stream_.fence();
+		}
 	}
 	
 	// Check for OpenGL errors.
 	GLContext::checkErrors();
-	
-	// Show status messages.
-	common_ctrl_.message(sprintf("Use Home/End to rotate camera, Q/W to change selected bone\n    Arrow keys and PgUp/Dn to rotate selected bone\n    R to reset current bone rotation"), "instructions");
-	auto joint_rot = skel_.getJointRotation(selected_joint_);
-	auto joint_pos = Vec4f(skel_.getToWorldTransforms()[selected_joint_].getCol(3)).getXYZ();
+
+	showStatus();
+}
+
+int App::selectLod(const Vec3f& center, const Vec3f& camera_position, float pixels_per_unit) const {
+	return selectSkinLod(lod_errors_.data(), int(lod_errors_.size()), (center - camera_position).length(), pixels_per_unit);
+}
+
+void App::renderSkinned(const Mat4f& world_to_clip, GLuint palette_texture, GLint palette_offset, int num_joints, int lod, int num_instances) {
+	glUseProgram(gl_.ssd_shader);
+	glUniformMatrix4fv(gl_.ssd_world_to_clip_uniform, 1, GL_FALSE, world_to_clip.getPtr());
+	glUniform1f(gl_.ssd_shading_mix_uniform, shading_toggle_ ? 1.0f : 0.0f);
+	glUniform1i(gl_.ssd_num_joints_uniform, num_joints);
+	glUniform1i(gl_.ssd_palette_uniform, 0);
+	glUniform1i(gl_.ssd_palette_offset_uniform, palette_offset);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+
+	glBindVertexArray(gl_.ssd_vao);
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lods_[lod].num_indices, GL_UNSIGNED_INT, (GLvoid*)(sizeof(U32) * lods_[lod].first_index),
+		num_instances, lods_[lod].first_vertex);
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glUseProgram(0);
+}
+
+void App::showStatus() {
+	// Posting a message builds strings, so the lines that change every frame are
+	// only refreshed a few times a second, and the others when they change.
+	static const float refresh_interval = 0.25f;
+	if (selected_joint_ == status_joint_ && status_timer_.getElapsed() < refresh_interval)
+		return;
+	status_timer_.start();
+
+	if (status_joint_ == ~0u)
+		common_ctrl_.message(sprintf("Use Home/End to rotate camera, Q/W to change selected bone\n    Arrow keys and PgUp/Dn to rotate selected bone\n    R to reset current bone rotation"), "instructions");
+	status_joint_ = selected_joint_;
+
+	auto joint_pos = skel_.getJointWorldPosition(selected_joint_);
 	common_ctrl_.message(sprintf("Joint \"%s\" selected, rotation %.2f %.2f %.2f",
 						skel_.getJointName(selected_joint_).c_str(),
 		joint_pos.x, joint_pos.y, joint_pos.z), "jointdata");
+
+	if (drawmode_ == MODE_CROWD) {
+		const auto& stats = crowd_.stats();
+		common_ctrl_.message(sprintf("Crowd: %d characters, %d posed this frame in %.2f ms, %.1f characters/ms, %d triangles",
+			stats.num_instances, stats.num_posed, stats.milliseconds, stats.characters_per_ms, drawn_triangles_), "crowd");
+	} else {
+		common_ctrl_.message("", "crowd");
+	}
+
+	if (drawmode_ == MODE_MESH_CPU || drawmode_ == MODE_MESH_GPU)
+		common_ctrl_.message(sprintf("Level of detail %d of %d, %d triangles", drawn_lod_, int(lods_.size()) - 1, drawn_triangles_), "lod");
+	else
+		common_ctrl_.message("", "lod");
 }
 
 void App::renderSkeleton() {
@@ -370,7 +529,7 @@ void App::renderSkeleton() {
 	glPointSize(15);
 	
 	// Let's fetch the transforms you generated in Skeleton::updateToWorldTransforms().
-	vector<Mat4f> transforms = skel_.getToWorldTransforms();
+	const vector<Mat4f>& transforms = skel_.getToWorldTransforms();
 
 	// And loop through all the joints.
 	for (auto i = 0u; i < transforms.size(); ++i) {
@@ -454,32 +613,13 @@ void App::renderSkeleton() {
 	}
 }
 
-vector<Vertex> App::computeSSD(const vector<WeightedVertex>& source_vertices) {
-	vector<Mat4f> ssd_transforms = skel_.getSSDTransforms();
-	vector<Vertex> skinned_vertices;
-	skinned_vertices.reserve(source_vertices.size());
-	Vertex v;
-	for (const auto& sv : source_vertices) {
-		// YOUR CODE HERE (R4 & R5)
-		// Compute the skinned position for each vertex and push it to skinned_vertices.
-		// This starter code just copies the source vertex untouched, so the result is not animated.
-		// Replace these lines with the loop that applies the bone transforms and weights.
-		// For R5, transform the normals as well.
-		//v.position = sv.position;	
-		//v.normal = sv.normal;		
-		//v.color = sv.color;
-
-		// Initialization
-		v.position = v.normal = v.color = Vec3f(0, 0, 0);
-		for (int i = 0; i != WEIGHTS_PER_VERTEX; i++) {
-			v.position += ssd_transforms[sv.joints[i]] * sv.position * sv.weights[i];
-			v.color += sv.color * sv.weights[i];
-			v.normal += ssd_transforms[sv.joints[i]].getXYZ() * sv.normal * sv.weights[i];
-		}
-
-		skinned_vertices.push_back(v);
-	}
-	return skinned_vertices;
+void App::computeSSD(Vertex* out, int lod) {
+	const vector<Mat4f>& ssd_transforms = skel_.getSSDTransforms();
+	// YOUR CODE HERE (R4 & R5)
+	// Each vertex is transformed by the weighted sum of its joints' T_i * inv(B_i)
+	// matrices, and its normal by the upper 3x3 block of the same sum. The kernel in
+	// SkinnedMesh skips the zero weights and runs on all cores of the thread pool.
+	skinned_lods_[lod].skin(ssd_transforms, out, thread_pool_);
 }
 
 vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file, string attachment_file) {
@@ -487,97 +627,98 @@ vector<WeightedVertex> App::loadAnimatedMesh(string namefile, string mesh_file,
 	vector<array<int, WEIGHTS_PER_VERTEX>> indices;
 	vector<array<float, WEIGHTS_PER_VERTEX>> weights;
 	vector<Vec3f> colors;
+
+	// The three files are read whole and scanned in memory.
+	vector<char> text;
+	auto scan = [&text](const string& filename) {
+		readTextFile(filename, text);
+		return TextScanner(text.data(), text.data() + FW::max(text.size(), size_t(1)) - 1);
+	};
 	
 	// Load name to index conversion map
 	vector<string> names;
-	ifstream name_input(namefile, ios::in);
-	string name;
-	while (name_input.good())
 	{
-		name_input >> name;
-		names.push_back(name);
+		TextScanner in = scan(namefile);
+		string name;
+		while (in.nextToken(name))
+			names.push_back(name);
 	}
 
-	// Load vertex weights
-	ifstream attachment_input(attachment_file, ios::in);
-	string line;
-	while (getline(attachment_input, line)) {
-		auto temp_i = array<int, WEIGHTS_PER_VERTEX>();
-		auto temp_w = array<float, WEIGHTS_PER_VERTEX>();
-		stringstream ss(line);
-		int sink;
-		ss >> sink;
-		auto n_weights = 0u;
-		while(ss.good()) {
-			string word;
-			ss >> word;
-			int i = stoi(word.substr(0, word.find_first_of('.')));
-			float weight;
-			ss >> weight;
-			if (weight != 0) {
-				temp_w[n_weights] = weight;
-				temp_i[n_weights] = skel_.getJointIndex(names[names.size()-i-2]);
-				++n_weights;
+	// Load vertex weights. Each line has a vertex number and then pairs of a joint
+	// (a number, counted from the end of the name list, followed by a dot and the
+	// joint's name) and a weight.
+	{
+		TextScanner in = scan(attachment_file);
+		TextScanner line;
+		while (in.nextLine(line)) {
+			auto temp_i = array<int, WEIGHTS_PER_VERTEX>();
+			auto temp_w = array<float, WEIGHTS_PER_VERTEX>();
+			int sink;
+			line.nextInt(sink);
+			auto n_weights = 0u;
+			int i;
+			while (line.nextInt(i)) {
+				line.endToken();
+				float weight = 0.0f;
+				line.nextFloat(weight);
+				if (weight != 0) {
+					temp_w[n_weights] = weight;
+					temp_i[n_weights] = skel_.getJointIndex(names[names.size()-i-1]);
+					++n_weights;
+				}
 			}
+			assert(n_weights <= WEIGHTS_PER_VERTEX);
+			weights.push_back(temp_w);
+			indices.push_back(temp_i);
+			auto color = Vec3f();
+			for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i)
+				color += joint_colors_[temp_i[i]] * temp_w[i];
+			colors.push_back(color);
 		}
-		assert(n_weights <= WEIGHTS_PER_VERTEX);
-		weights.push_back(temp_w);
-		indices.push_back(temp_i);
-		auto color = Vec3f();
-		for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i)
-			color += joint_colors_[temp_i[i]] * temp_w[i];
-		colors.push_back(color);
 	}
 
 	// Load vertices
 	vector<Vec3f> positions;
-	ifstream mesh_input(mesh_file, ios::in);
-	while (getline(mesh_input, line)) {
-		stringstream ss(line);
+	{
+		TextScanner in = scan(mesh_file);
+		TextScanner line;
 		string s;
-		ss >> s;
-		if (s == "v") {
-			Vec3f pos;
-			ss >> pos[0] >> pos[1] >> pos[2];
-			positions.push_back(pos);
-		}
-		else if (s == "f") {
-			array<int, 3> f;
-
-			string word;
-			for (int i = 0; i < 3; ++i)
-			{
-				ss >> word;
-				word = word.substr(0, word.find_first_of('/'));
-				f[i] = stoi(word) - 1;
-			}
-
-			WeightedVertex v;
-			v.normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
-			for (auto i : f) {
-				v.position = positions[i];
-				v.color = colors[i];
-				memcpy(v.joints, indices[i].data(), sizeof(v.joints));
-				memcpy(v.weights, weights[i].data(), sizeof(v.weights));
-				vertices.push_back(v);
+		while (in.nextLine(line)) {
+			if (!line.nextToken(s))
+				continue;
+			if (s == "v") {
+				Vec3f pos;
+				line.nextFloat(pos[0]);
+				line.nextFloat(pos[1]);
+				line.nextFloat(pos[2]);
+				positions.push_back(pos);
 			}
-
-			// Read n-gons
-			while (ss.good())
-			{
-				f[1] = f[2];
-				ss >> word;
-				word = word.substr(0, word.find_first_of('/'));
-				f[2] = stoi(word) - 1;
-
-				v.normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
-				for (auto i : f) {
-					v.position = positions[i];
-					v.color = colors[i];
-					memcpy(v.joints, indices[i].data(), sizeof(v.joints));
-					memcpy(v.weights, weights[i].data(), sizeof(v.weights));
-					vertices.push_back(v);
-				}
+			else if (s == "f") {
+				// Corners are "v", "v/vt" or "v/vt/vn"; only v is used.
+				auto readCorner = [&line](int& index) {
+					if (!line.nextInt(index))
+						return false;
+					line.endToken();
+					--index;
+					return true;
+				};
+				array<int, 3> f;
+				if (!readCorner(f[0]) || !readCorner(f[1]) || !readCorner(f[2]))
+					continue;
+
+				// Fan out n-gons from their first corner.
+				do {
+					WeightedVertex v;
+					v.normal = cross(positions[f[1]] - positions[f[0]], positions[f[2]] - positions[f[0]]).normalized();
+					for (auto i : f) {
+						v.position = positions[i];
+						v.color = colors[i];
+						memcpy(v.joints, indices[i].data(), sizeof(v.joints));
+						memcpy(v.weights, weights[i].data(), sizeof(v.weights));
+						vertices.push_back(v);
+					}
+					f[1] = f[2];
+				} while (readCorner(f[2]));
 			}
 		}
 	}
@@ -618,6 +759,8 @@ vector<WeightedVertex> App::loadWeightedMesh(string mesh_file, string attachment
 			float weight;
 			ss >> weight;
 			if (weight != 0) {
+				if (i+1 >= skel_.getNumJoints())
+					fail("%s weights joint %d, but the skeleton only has %d joints!", attachment_file.c_str(), int(i+1), int(skel_.getNumJoints()));
 				temp_w[n_weights] = weight;
 				temp_i[n_weights] = i+1;
 				++n_weights;
@@ -669,6 +812,68 @@ vector<WeightedVertex> App::loadWeightedMesh(string mesh_file, string attachment
 	return vertices;
 }
 
+void App::checkJointCount(const string& skel_file) {
+	// The GPU path can only address MAX_SKIN_JOINTS joints, see PackedSkinVertex.
+	if (skel_.getNumJoints() > size_t(MAX_SKIN_JOINTS))
+		fail("%s has %d joints, but skinned meshes support at most %d!", skel_file.c_str(), int(skel_.getNumJoints()), MAX_SKIN_JOINTS);
+}
+
+void App::prepareMesh(const vector<WeightedVertex>& corners) {
+	vector<WeightedVertex> vertices;
+	vector<U32> indices;
+	// The loaders give every corner the normal of its face, so keying on the normals
+	// would leave each triangle with vertices of its own.
+	indexWeightedMesh(corners, vertices, indices, true);
+
+	auto stats = pruneSkinWeights(vertices);
+	cout << "vertices:   " << vertices.size() << " unique of " << corners.size() << endl;
+	cout << "influences: " << stats.influences_before << " -> " << stats.influences_after
+		 << ", weight error max " << stats.max_error << " mean " << stats.mean_error << endl;
+
+	Vec3f lo(FW_F32_MAX), hi(-FW_F32_MAX);
+	for (const auto& v : vertices) {
+		lo = FW::min(lo, v.position);
+		hi = FW::max(hi, v.position);
+	}
+	lod_center_ = vertices.empty() ? Vec3f(0.0f) : 0.5f * (lo + hi);
+
+	// The levels of detail follow the full mesh in the same buffers.
+	vector<SkinLodLevel> levels;
+	buildSkinLods(vertices, indices, levels);
+
+	packed_vertices_.clear();
+	indices_.clear();
+	lods_.clear();
+	lod_errors_.clear();
+	skinned_lods_.assign(levels.size() + 1, SkinnedMesh());
+	vector<PackedSkinVertex> packed;
+	auto add_level = [&](vector<WeightedVertex>& level_vertices, const vector<U32>& level_indices, float error) {
+		LodRange range;
+		range.first_index = int(indices_.size());
+		range.num_indices = int(level_indices.size());
+		range.first_vertex = int(packed_vertices_.size());
+		skinned_lods_[lods_.size()].build(level_vertices);
+		lods_.push_back(range);
+		lod_errors_.push_back(error);
+		indices_.insert(indices_.end(), level_indices.begin(), level_indices.end());
+		packSkinVertices(level_vertices, packed);
+		packed_vertices_.insert(packed_vertices_.end(), packed.begin(), packed.end());
+	};
+	add_level(vertices, indices, 0.0f);
+	for (auto& level : levels) {
+		pruneSkinWeights(level.vertices);
+		add_level(level.vertices, level.indices, level.error);
+		cout << "lod " << lods_.size() - 1 << ":      " << level.indices.size() / 3 << " triangles, "
+			 << level.vertices.size() << " vertices, error " << level.error << endl;
+	}
+}
+
+void App::initCrowd(int count) {
+	crowd_.init(&skel_);
+	crowd_.addClip(&skel_.getAnimationClip());
+	crowd_.scatter(count, CROWD_SPACING, Vec3f(0.5f, 0.0f, 0.5f), 1);
+}
+
 void App::loadAnimation(const String& filename) {
 	int end = filename.lastIndexOf('.');
 	String prefix = (end > 0) ? filename.substring(0, end) : filename;
@@ -682,8 +887,10 @@ void App::loadAnimation(const String& filename) {
 	cout << "mesh:       " << mesh_file << endl;
 	cout << "weight:     " << weight_file << endl;
 
-	scale_ = skel_.loadBVH(skel_file); 
-	weighted_vertices_ = loadAnimatedMesh(name_file, mesh_file, weight_file);
+	scale_ = skel_.loadBVH(skel_file, &thread_pool_);
+	checkJointCount(skel_file);
+	prepareMesh(loadAnimatedMesh(name_file, mesh_file, weight_file));
+	initCrowd(CROWD_SIZE);
 }
 
 void App::loadModel(const String& filename) {
@@ -700,7 +907,9 @@ void App::loadModel(const String& filename) {
 
 	scale_ = 1;
 	skel_.load(skel_file);
-	weighted_vertices_ = loadWeightedMesh(mesh_file, weight_file);
+	checkJointCount(skel_file);
+	prepareMesh(loadWeightedMesh(mesh_file, weight_file));
+	initCrowd(CROWD_SIZE);
 }
 
 void FW::init(void) {
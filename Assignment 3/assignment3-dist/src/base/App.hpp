@@ -1,30 +1,20 @@
 #pragma once
 
 #include "skeleton.hpp"
+#include "skinning.hpp"
+#include "skinlod.hpp"
+#include "crowd.hpp"
+#include "streambuffer.hpp"
+#include "parallel.hpp"
 
 #include "gui/Window.hpp"
 #include "gui/CommonControls.hpp"
+#include "base/Timer.hpp"
 
 #include <vector>
 
 namespace FW {
 
-struct Vertex
-{
-	Vec3f position;
-	Vec3f normal;
-	Vec3f color;
-};
-
-struct WeightedVertex
-{
-	Vec3f	position;
-	Vec3f	normal;
-	Vec3f	color;
-	int		joints[WEIGHTS_PER_VERTEX];
-	float	weights[WEIGHTS_PER_VERTEX];
-};
-
 struct glGeneratedIndices
 {
 	// Shader programs
@@ -34,13 +24,23 @@ struct glGeneratedIndices
 	GLuint simple_vao, ssd_vao;
 
 	// Buffers
-	GLuint simple_vertex_buffer, ssd_vertex_buffer;
+	GLuint ssd_vertex_buffer, index_buffer;
+
+	// Texture buffer objects viewing App::joint_palette_stream_ and App::crowd_palette_stream_
+	GLuint ssd_palette_texture, crowd_palette_texture;
 
 	// simple_shader uniforms
 	GLint simple_world_to_clip_uniform, simple_shading_mix_uniform;
 
 	// ssd_shader uniforms
-	GLint ssd_world_to_clip_uniform, ssd_shading_mix_uniform, ssd_transforms_uniform;
+	GLint ssd_world_to_clip_uniform, ssd_shading_mix_uniform, ssd_palette_uniform, ssd_palette_offset_uniform, ssd_num_joints_uniform;
+};
+
+// Where a level of detail of the mesh is in the index and vertex buffers. Its
+// indices count from its first vertex.
+struct LodRange
+{
+	int first_index, num_indices, first_vertex;
 };
 
 class App : public Window::Listener
@@ -50,7 +50,8 @@ private:
 	{
 		MODE_SKELETON,
 		MODE_MESH_CPU,
-		MODE_MESH_GPU
+		MODE_MESH_GPU,
+		MODE_CROWD
 	};
 
 public:
@@ -63,6 +64,9 @@ private:
 	void			initRendering		(void);
 	void			render				(void);
 	void			renderSkeleton		(void);
+	void			renderSkinned		(const Mat4f& world_to_clip, GLuint palette_texture, GLint palette_offset, int num_joints, int lod, int num_instances);
+	int				selectLod			(const Vec3f& center, const Vec3f& camera_position, float pixels_per_unit) const;
+	void			showStatus			(void);
 
 	void			loadModel			(const String& filename);
 	void			loadAnimation		(const String& filename);
@@ -70,8 +74,11 @@ private:
 
 	std::vector<WeightedVertex>	loadAnimatedMesh		(std::string namefile, std::string mesh_file, std::string attachment_file);
 	std::vector<WeightedVertex>	loadWeightedMesh		(std::string mesh_file, std::string attachment_file);
+	void						checkJointCount			(const std::string& skel_file);
+	void						prepareMesh				(const std::vector<WeightedVertex>& corners);
+	void						initCrowd				(int count);
 
-	std::vector<Vertex>			computeSSD				(const std::vector<WeightedVertex>& source);
+	void						computeSSD				(Vertex* out, int lod);
 private:
 					App             (const App&); // forbid copy
 	App&            operator=       (const App&); // forbid assignment
@@ -88,7 +95,30 @@ private:
 
 	glGeneratedIndices	gl_;
 
-	std::vector<WeightedVertex> weighted_vertices_;
+	// Rewritten every frame: the vertices skinned on the CPU, and the joint matrices
+	// of the skeleton and of the crowd for skinning on the GPU.
+	StreamBuffer	skinned_vertex_stream_;
+	StreamBuffer	joint_palette_stream_;
+	StreamBuffer	crowd_palette_stream_;
+
+	// All levels of detail of the mesh, one after the other; level 0 is the full mesh.
+	std::vector<PackedSkinVertex> packed_vertices_;	// for SSD on the GPU
+	std::vector<U32>			indices_;				// three per triangle
+	std::vector<LodRange>		lods_;
+	std::vector<float>			lod_errors_;			// see SkinLodLevel::error
+	std::vector<SkinnedMesh>	skinned_lods_;			// for SSD on the CPU
+	Vec3f						lod_center_;			// of the bind pose
+
+	// The crowd instances by level of detail, the instances of level l at
+	// [crowd_lod_first_[l], crowd_lod_first_[l+1]).
+	std::vector<int>			crowd_lod_order_;
+	std::vector<int>			crowd_lod_first_;
+	std::vector<int>			crowd_lod_;
+
+	int				drawn_lod_ = 0;
+	int				drawn_triangles_ = 0;
+	ThreadPool		thread_pool_;
+	Crowd			crowd_;
 	
 	float			camera_rotation_;
 	float			scale_ = 1.f;
@@ -98,7 +128,11 @@ private:
 	unsigned		selected_joint_;
 
 	bool			animationMode = false;
-	DWORD			animationStart;
+	Timer			animation_timer_;
+
+	// The status lines stay up until replaced; the changing ones are refreshed a few times a second.
+	Timer			status_timer_;
+	unsigned		status_joint_ = ~0u;
 };
 
 } // namespace FW
@@ -0,0 +1,167 @@
+#include "animation.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+// Quaternions are Vec4f(x, y, z, w).
+Vec4f quatMul(const Vec4f& p, const Vec4f& q) {
+	Vec3f pv = p.getXYZ(), qv = q.getXYZ();
+	return Vec4f(p.w * qv + q.w * pv + cross(pv, qv), p.w * q.w - dot(pv, qv));
+}
+
+Vec4f quatFromEuler(const Vec3f& radians) {
+	Vec3f h = radians * 0.5f;
+	Vec4f qx(sinf(h.x), 0, 0, cosf(h.x));
+	Vec4f qy(0, sinf(h.y), 0, cosf(h.y));
+	Vec4f qz(0, 0, sinf(h.z), cosf(h.z));
+	return quatMul(quatMul(qx, qy), qz);
+}
+
+Mat3f quatToMatrix(const Vec4f& q) {
+	float x = q.x, y = q.y, z = q.z, w = q.w;
+	Mat3f R;
+	R(0, 0) = 1 - 2 * (y * y + z * z);	R(0, 1) = 2 * (x * y - z * w);		R(0, 2) = 2 * (x * z + y * w);
+	R(1, 0) = 2 * (x * y + z * w);		R(1, 1) = 1 - 2 * (x * x + z * z);	R(1, 2) = 2 * (y * z - x * w);
+	R(2, 0) = 2 * (x * z - y * w);		R(2, 1) = 2 * (y * z + x * w);		R(2, 2) = 1 - 2 * (x * x + y * y);
+	return R;
+}
+
+S16 quantize(float c) {
+	return S16(FW::clamp(int(FW::floor(c * 32767.0f + 0.5f)), -32767, 32767));
+}
+
+Vec4f nlerp(const Vec4f& q0, const Vec4f& q1, float t) {
+	return lerp(q0, q1, t).normalized();
+}
+
+// Longest run of frames between two keys. Bounds the cost of the key reduction.
+const int MAX_KEY_SPACING = 256;
+
+} // namespace
+
+void AnimationClip::build(float frame_time, int num_joints, const vector<Vec3f>& positions, const vector<Vec3f>& euler_degrees, const vector<float>& tolerance_degrees) {
+	assert(euler_degrees.size() == positions.size() * num_joints);
+	assert(tolerance_degrees.size() == size_t(num_joints));
+
+	frame_time_ = frame_time > 0.0f ? frame_time : 1.0f / 60.0f;
+	num_frames_ = int(positions.size());
+	positions_ = positions;
+	channels_.resize(num_joints);
+	keys_.clear();
+	key_frames_.clear();
+
+	vector<Vec4f> q(num_frames_);
+	vector<int> kept;
+	for (int j = 0; j < num_joints; ++j) {
+		// Two unit quaternions are within the tolerance when |dot| >= cos(tolerance / 2).
+		float min_dot = cosf(tolerance_degrees[j] * (FW_PI / 180.0f) * 0.5f);
+
+		// Round the frames like the keys will be, and keep neighbours in the same
+		// hemisphere so that lerp takes the short way.
+		Vec4f prev(0, 0, 0, 1);
+		for (int f = 0; f < num_frames_; ++f) {
+			Vec4f r = quatFromEuler(euler_degrees[size_t(f) * num_joints + j] * (FW_PI / 180.0f));
+			if (dot(r, prev) < 0.0f)
+				r = -r;
+			prev = r;
+			for (int c = 0; c < 4; ++c)
+				q[f][c] = quantize(r[c]) * (1.0f / 32767.0f);
+		}
+
+		auto fits = [&](int a, int b) {
+			for (int f = a + 1; f < b; ++f)
+				if (FW::abs(dot(nlerp(q[a], q[b], float(f - a) / float(b - a)), q[f])) < min_dot)
+					return false;
+			return true;
+		};
+
+		kept.assign(1, 0);
+		bool constant = true;
+		for (int f = 1; f < num_frames_ && constant; ++f)
+			constant = FW::abs(dot(q[0], q[f])) >= min_dot;
+		if (!constant) {
+			// Greedily extend each run between keys as far as interpolation stays within
+			// the tolerance. The last frame is always a key so that the clip loops.
+			int a = 0, b = 1;
+			while (b < num_frames_ - 1) {
+				if (b + 1 - a <= MAX_KEY_SPACING && fits(a, b + 1)) {
+					++b;
+					continue;
+				}
+				kept.push_back(b);
+				a = b;
+				b = a + 1;
+			}
+			if (num_frames_ > 1)
+				kept.push_back(num_frames_ - 1);
+		}
+
+		channels_[j].first_key = int(key_frames_.size());
+		channels_[j].num_keys = int(kept.size());
+		for (int f : kept) {
+			key_frames_.push_back(U32(f));
+			for (int c = 0; c < 4; ++c)
+				keys_.push_back(quantize(q[f][c]));
+		}
+	}
+}
+
+int AnimationClip::numConstantChannels() const {
+	int n = 0;
+	for (const auto& c : channels_)
+		n += c.num_keys == 1 ? 1 : 0;
+	return n;
+}
+
+void AnimationClip::scalePositions(float scale) {
+	for (auto& p : positions_)
+		p *= scale;
+}
+
+AnimationClip::SamplePoint AnimationClip::locate(float seconds) const {
+	SamplePoint s = { 0, 0, 0.0f };
+	if (num_frames_ == 0)
+		return s;
+
+	float frame = seconds / frame_time_;
+	frame -= FW::floor(frame / num_frames_) * num_frames_;
+	s.k0 = FW::clamp(int(frame), 0, num_frames_ - 1);
+	s.k1 = (s.k0 + 1) % num_frames_;
+	s.alpha = FW::clamp(frame - s.k0, 0.0f, 1.0f);
+	return s;
+}
+
+Vec3f AnimationClip::position(const SamplePoint& s) const {
+	return lerp(positions_[s.k0], positions_[s.k1], s.alpha);
+}
+
+Vec4f AnimationClip::key(int index) const {
+	const S16* k = &keys_[4 * index];
+	return Vec4f(k[0], k[1], k[2], k[3]) * (1.0f / 32767.0f);
+}
+
+Mat3f AnimationClip::rotation(int joint, const SamplePoint& s) const {
+	const Channel& c = channels_[joint];
+	if (c.num_keys == 1)
+		return quatToMatrix(key(c.first_key).normalized());
+
+	// Find the keys around the sample time. Past the last key (the last frame) the
+	// clip blends into its first frame, i.e. into the first key.
+	float frame = float(s.k0) + s.alpha;
+	const U32* frames = &key_frames_[c.first_key];
+	int i = int(upper_bound(frames, frames + c.num_keys, U32(s.k0)) - frames) - 1;
+	int f0 = int(frames[i]);
+	int f1 = i + 1 < c.num_keys ? int(frames[i + 1]) : num_frames_;
+	Vec4f q0 = key(c.first_key + i);
+	Vec4f q1 = key(c.first_key + (i + 1 < c.num_keys ? i + 1 : 0));
+
+	// Only the wrap from the last frame to the first may cross hemispheres.
+	if (dot(q0, q1) < 0.0f)
+		q1 = -q1;
+	return quatToMatrix(nlerp(q0, q1, (frame - f0) / float(f1 - f0)));
+}
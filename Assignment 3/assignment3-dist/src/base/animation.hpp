@@ -0,0 +1,67 @@
+#pragma once
+
+#include <base/Math.hpp>
+
+#include <vector>
+
+// A looping skeletal animation clip that can be sampled at any time.
+//
+// Each joint's rotation is a channel of unit quaternions, and the keys of a channel
+// are stored next to each other with their quaternion components in 16-bit fixed
+// point. A frame only becomes a key when interpolating between its neighbouring
+// keys would be off by more than the joint's tolerance, so channels that stay the same
+// over the whole clip end up with a single key. The root translation keeps one
+// full-precision key per frame. Between keys the rotations are interpolated with
+// normalized lerp and the translation linearly; the last frame blends back into
+// the first.
+class AnimationClip
+{
+public:
+	// Where a time falls in the clip: between frames k0 and k1, alpha of the way.
+	struct SamplePoint
+	{
+		int		k0;
+		int		k1;
+		float	alpha;
+	};
+
+	// Build from per-frame root positions and per-frame, per-joint Euler angles in
+	// degrees, applied in the order Rx * Ry * Rz (euler_degrees[frame * num_joints + joint]).
+	// tolerance_degrees[joint] bounds the rotation error of the frames that are not kept as keys.
+	void					build				(float frame_time, int num_joints, const std::vector<FW::Vec3f>& positions, const std::vector<FW::Vec3f>& euler_degrees, const std::vector<float>& tolerance_degrees);
+
+	bool					empty				(void) const { return num_frames_ == 0; }
+	int						numFrames			(void) const { return num_frames_; }
+	int						numJoints			(void) const { return int(channels_.size()); }
+	int						numConstantChannels	(void) const;
+	int						numKeys				(void) const { return int(key_frames_.size()); }
+	float					frameTime			(void) const { return frame_time_; }
+	float					duration			(void) const { return num_frames_ * frame_time_; }
+
+	// Bytes used by the keys, and by the same frames stored as Euler angles.
+	size_t					memoryBytes			(void) const { return positions_.size() * sizeof(FW::Vec3f) + keys_.size() * sizeof(FW::S16) + key_frames_.size() * sizeof(FW::U32) + channels_.size() * sizeof(Channel); }
+	size_t					rawBytes			(void) const { return size_t(num_frames_) * (channels_.size() + 1) * sizeof(FW::Vec3f); }
+
+	void					scalePositions		(float scale);
+
+	SamplePoint				locate				(float seconds) const;
+	bool					isConstant			(int joint) const { return channels_[joint].num_keys == 1; }
+	FW::Vec3f				position			(const SamplePoint& s) const;
+	FW::Mat3f				rotation			(int joint, const SamplePoint& s) const;
+
+private:
+	struct Channel
+	{
+		int		first_key;
+		int		num_keys;
+	};
+
+	FW::Vec4f				key					(int index) const;
+
+	float					frame_time_ = 1.0f / 60.0f;
+	int						num_frames_ = 0;
+	std::vector<FW::Vec3f>	positions_;
+	std::vector<Channel>	channels_;
+	std::vector<FW::S16>	keys_;				// quaternions (x, y, z, w), scaled by 32767
+	std::vector<FW::U32>	key_frames_;		// frame of each key; the first key of a channel is at frame 0
+};
@@ -0,0 +1,112 @@
+#include "crowd.hpp"
+
+#include "base/Random.hpp"
+#include "base/Timer.hpp"
+
+#include <cassert>
+
+using namespace std;
+
+namespace FW {
+
+namespace {
+
+// Posing an instance takes some tens of microseconds; smaller batches would
+// spend more time waking threads than working.
+const int MIN_INSTANCES_PER_THREAD = 4;
+
+} // namespace
+
+void Crowd::init(const Skeleton* rig) {
+	rig_ = rig;
+	num_joints_ = int(rig->getNumJoints());
+	clips_.clear();
+	instances_.clear();
+	placements_.clear();
+	palette_.clear();
+	to_world_.clear();
+	frame_ = 0;
+	posed_ = false;
+	stats_ = CrowdStats();
+}
+
+int Crowd::addClip(const AnimationClip* clip) {
+	clips_.push_back(clip);
+	return int(clips_.size()) - 1;
+}
+
+void Crowd::addInstance(const CrowdInstance& instance) {
+	assert(instance.clip >= 0 && instance.clip < int(clips_.size()));
+	instances_.push_back(instance);
+
+	Mat4f placement;
+	Mat3f R = Mat3f::rotation(Vec3f(0, 1, 0), instance.heading);
+	placement.setCol(0, Vec4f(R.getCol(0), 0));
+	placement.setCol(1, Vec4f(R.getCol(1), 0));
+	placement.setCol(2, Vec4f(R.getCol(2), 0));
+	placement.setCol(3, Vec4f(instance.position, 1));
+	placements_.push_back(placement);
+
+	palette_.resize(instances_.size() * num_joints_);
+	to_world_.resize(instances_.size() * num_joints_);
+	posed_ = false;
+}
+
+void Crowd::scatter(int count, float spacing, const Vec3f& center, U32 seed) {
+	Random random(seed);
+	int side = int(ceil(sqrt(float(count))));
+	Vec3f corner = center - Vec3f(1, 0, 1) * (0.5f * spacing * (side - 1));
+	for (int i = 0; i < count; ++i) {
+		CrowdInstance instance;
+		instance.position = corner + Vec3f(float(i % side), 0, float(i / side)) * spacing;
+		instance.heading = random.getF32(0.0f, 2.0f * FW_PI);
+		instance.clip = random.getS32(int(clips_.size()));
+		instance.phase = random.getF32(0.0f, FW::max(clips_[instance.clip]->duration(), 1.0f));
+		instance.speed = random.getF32(0.8f, 1.2f);
+		addInstance(instance);
+	}
+}
+
+int Crowd::updateInterval(const CrowdInstance& instance, const Vec3f& camera_position) const {
+	int interval = 1;
+	float limit = CROWD_FULL_RATE_DISTANCE;
+	float distance = (instance.position - camera_position).length();
+	while (distance > limit && interval < CROWD_MAX_UPDATE_INTERVAL) {
+		interval *= 2;
+		limit *= 2.0f;
+	}
+	return interval;
+}
+
+void Crowd::update(float seconds, const Vec3f& camera_position, ThreadPool& pool) {
+	// Pick the instances that are due. The intervals are powers of two, and
+	// offsetting the frame by the instance index spreads the updates of instances
+	// at the same distance evenly over the frames.
+	due_.clear();
+	for (int i = 0; i < numInstances(); ++i) {
+		unsigned interval = unsigned(updateInterval(instances_[i], camera_position));
+		if (!posed_ || ((frame_ + unsigned(i)) & (interval - 1)) == 0)
+			due_.push_back(i);
+	}
+	posed_ = true;
+	++frame_;
+
+	Timer timer;
+	timer.start();
+	pool.parallelFor(int(due_.size()), MIN_INSTANCES_PER_THREAD, [&](int begin, int end) {
+		for (int d = begin; d < end; ++d) {
+			int i = due_[d];
+			const CrowdInstance& instance = instances_[i];
+			size_t first = size_t(i) * num_joints_;
+			rig_->evaluatePose(*clips_[instance.clip], instance.phase + seconds * instance.speed,
+				placements_[i], &to_world_[first], &palette_[first]);
+		}
+	});
+
+	stats_.num_instances = numInstances();
+	stats_.num_posed = int(due_.size());
+	stats_.milliseconds = timer.getElapsed() * 1000.0f;
+	stats_.characters_per_ms = stats_.milliseconds > 0.0f ? stats_.num_posed / stats_.milliseconds : 0.0f;
+}
+
+} // namespace FW
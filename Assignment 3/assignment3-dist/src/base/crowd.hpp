@@ -0,0 +1,82 @@
+#pragma once
+
+#include "skeleton.hpp"
+#include "parallel.hpp"
+
+#include <base/Math.hpp>
+
+#include <vector>
+
+namespace FW {
+
+// Instances farther from the camera than this are posed every second frame,
+// twice as far every fourth frame and so on, up to CROWD_MAX_UPDATE_INTERVAL.
+static const float	CROWD_FULL_RATE_DISTANCE = 4.0f;
+static const int	CROWD_MAX_UPDATE_INTERVAL = 8;
+
+struct CrowdInstance
+{
+	Vec3f	position;		// of the skeleton's origin, in world space
+	float	heading;		// rotation around the y axis, in radians
+	int		clip;			// index returned by Crowd::addClip()
+	float	phase;			// seconds into the clip at time 0
+	float	speed;			// playback rate
+};
+
+// Timing of the last Crowd::update().
+struct CrowdStats
+{
+	int		num_instances;
+	int		num_posed;			// instances whose pose was due this frame
+	float	milliseconds;
+	float	characters_per_ms;	// num_posed / milliseconds
+};
+
+// Many instances of one skeleton, each playing one of a set of clips with its
+// own phase and speed.
+//
+// update() poses the instances on the threads of a pool and writes the SSD
+// matrices T_i * inv(B_i) of all of them into one palette, instance after
+// instance, with the instance's placement already applied: the matrices of joint j
+// of instance k are at palette()[k * numJoints() + j], ready for one instanced draw.
+// Instances far from the camera are posed less often (animation LOD); the updates
+// of instances with the same rate are staggered over the frames, and in between
+// an instance keeps its last pose.
+class Crowd
+{
+public:
+	// The skeleton and the clips must outlive the crowd.
+	void					init			(const Skeleton* rig);
+	int						addClip			(const AnimationClip* clip);
+	void					addInstance		(const CrowdInstance& instance);
+
+	// Lay out count instances on a square grid in the xz plane centered at center,
+	// with random clips, phases, speeds and headings.
+	void					scatter			(int count, float spacing, const Vec3f& center, U32 seed);
+
+	void					update			(float seconds, const Vec3f& camera_position, ThreadPool& pool);
+
+	int						numInstances	(void) const { return int(instances_.size()); }
+	const CrowdInstance&	instance		(int i) const { return instances_[i]; }
+	int						numJoints		(void) const { return num_joints_; }
+	const std::vector<Mat4f>& palette		(void) const { return palette_; }
+	const CrowdStats&		stats			(void) const { return stats_; }
+
+private:
+	int						updateInterval	(const CrowdInstance& instance, const Vec3f& camera_position) const;
+
+	const Skeleton*			rig_ = nullptr;
+	int						num_joints_ = 0;
+	std::vector<const AnimationClip*> clips_;
+	std::vector<CrowdInstance> instances_;
+	std::vector<Mat4f>		placements_;	// per instance
+
+	std::vector<Mat4f>		palette_;		// T_i * inv(B_i), per instance and joint
+	std::vector<Mat4f>		to_world_;		// T_i, per instance and joint
+	std::vector<int>		due_;			// instances to pose this frame
+	unsigned				frame_ = 0;
+	bool					posed_ = false;	// every instance has been posed once
+	CrowdStats				stats_ = {};
+};
+
+} // namespace FW
@@ -0,0 +1,83 @@
+#include "parallel.hpp"
+
+using namespace std;
+
+namespace FW {
+
+ThreadPool::ThreadPool(int threads)
+:	task_		(nullptr),
+	num_tasks_	(0),
+	next_task_	(0),
+	busy_		(0),
+	generation_	(0),
+	quit_		(false)
+{
+	if (threads <= 0)
+		threads = int(thread::hardware_concurrency());
+	for (int i = 1; i < threads; ++i)
+		workers_.emplace_back([this]() { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> lock(mutex_);
+		quit_ = true;
+	}
+	wake_.notify_all();
+	for (auto& t : workers_)
+		t.join();
+}
+
+void ThreadPool::run(int tasks, const function<void(int)>& task) {
+	if (workers_.empty() || tasks <= 1) {
+		for (int i = 0; i < tasks; ++i)
+			task(i);
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(mutex_);
+		task_ = &task;
+		num_tasks_ = tasks;
+		next_task_ = 0;
+		++generation_;
+	}
+	wake_.notify_all();
+	drain();
+
+	// Every task has been claimed; wait for the workers still running one.
+	// A worker that wakes up late finds nothing left to do, but it may only
+	// look at the task list while we are still here.
+	unique_lock<mutex> lock(mutex_);
+	done_.wait(lock, [this]() { return busy_ == 0; });
+	task_ = nullptr;
+	num_tasks_ = 0;
+}
+
+void ThreadPool::drain() {
+	for (;;) {
+		int i = next_task_++;
+		if (i >= num_tasks_)
+			return;
+		(*task_)(i);
+	}
+}
+
+void ThreadPool::workerLoop() {
+	unsigned seen = 0;
+	unique_lock<mutex> lock(mutex_);
+	for (;;) {
+		wake_.wait(lock, [&]() { return quit_ || (generation_ != seen && task_ != nullptr); });
+		if (quit_)
+			return;
+		seen = generation_;
+		++busy_;
+		lock.unlock();
+		drain();
+		lock.lock();
+		if (--busy_ == 0)
+			done_.notify_all();
+	}
+}
+
+} // namespace FW
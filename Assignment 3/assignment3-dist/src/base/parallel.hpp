@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace FW {
+
+// A fixed set of worker threads that is kept alive between calls, so that
+// per-frame work can be split across cores without creating threads every frame.
+// The calling thread works along with the pool and run() returns when all tasks
+// are done. Calls must not be nested, and only one thread may use a pool at a time.
+class ThreadPool
+{
+public:
+	explicit		ThreadPool		(int threads = 0);	// 0 = one per hardware thread
+					~ThreadPool		(void);
+
+	// Number of threads that run tasks, including the calling thread.
+	int				numThreads		(void) const { return int(workers_.size()) + 1; }
+
+	// Run task(0) ... task(tasks-1) in parallel.
+	void			run				(int tasks, const std::function<void(int)>& task);
+
+	// Split [0, n) into contiguous ranges of at least min_range items and run
+	// body(begin, end) for each of them in parallel.
+	template <class F>
+	void			parallelFor		(int n, int min_range, const F& body);
+
+private:
+					ThreadPool		(const ThreadPool&); // forbid copy
+	ThreadPool&		operator=		(const ThreadPool&); // forbid assignment
+
+	void			workerLoop		(void);
+	void			drain			(void);
+
+	std::vector<std::thread>			workers_;
+	std::mutex							mutex_;
+	std::condition_variable				wake_;
+	std::condition_variable				done_;
+	const std::function<void(int)>*		task_;
+	int									num_tasks_;
+	std::atomic<int>					next_task_;
+	int									busy_;			// workers inside drain()
+	unsigned							generation_;
+	bool								quit_;
+};
+
+template <class F>
+void ThreadPool::parallelFor(int n, int min_range, const F& body)
+{
+	if (n <= 0)
+		return;
+	int ranges = n / (min_range > 0 ? min_range : 1);
+	ranges = ranges < 1 ? 1 : (ranges > numThreads() ? numThreads() : ranges);
+	if (ranges == 1) {
+		body(0, n);
+		return;
+	}
+	run(ranges, [&](int r) {
+		body(int((long long)n * r / ranges), int((long long)n * (r + 1) / ranges));
+	});
+}
+
+} // namespace FW
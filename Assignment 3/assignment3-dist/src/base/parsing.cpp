@@ -0,0 +1,207 @@
+#include "parsing.hpp"
+
+#include <base/Defs.hpp>
+
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace FW {
+
+namespace {
+
+inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline bool isDigit(char c) {
+	return unsigned(c - '0') < 10u;
+}
+
+// Powers of ten that are exact in double.
+const double POWERS_OF_TEN[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// Rounding to double and then to float gives the correctly rounded float unless
+// the double fell exactly halfway between two floats: the 29 bits of the double
+// mantissa that a float drops are then 1000...0.
+inline bool isFloatHalfway(double d) {
+	U64 bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return (bits & 0x1FFFFFFFull) == 0x10000000ull;
+}
+
+} // namespace
+
+bool readTextFile(const string& filename, vector<char>& text) {
+	text.clear();
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f)
+		return false;
+
+	// Read the whole file at once when its size is known, and otherwise in large
+	// blocks until the end.
+	size_t size = 0;
+	long known = -1;
+	if (fseek(f, 0, SEEK_END) == 0) {
+		known = ftell(f);
+		rewind(f);
+	}
+	if (known > 0) {
+		text.resize(size_t(known));
+		size = fread(text.data(), 1, text.size(), f);
+	}
+	const size_t BLOCK_SIZE = 1 << 20;
+	while (size == text.size()) {
+		text.resize(size + BLOCK_SIZE);
+		size += fread(text.data() + size, 1, BLOCK_SIZE, f);
+	}
+	fclose(f);
+
+	text.resize(size + 1);
+	text[size] = '\0';
+	return true;
+}
+
+void TextScanner::skipSpace() {
+	while (p_ < end_ && isSpace(*p_))
+		++p_;
+}
+
+bool TextScanner::atEnd() {
+	skipSpace();
+	return p_ == end_;
+}
+
+bool TextScanner::nextToken(string& token) {
+	skipSpace();
+	const char* begin = p_;
+	while (p_ < end_ && !isSpace(*p_))
+		++p_;
+	token.assign(begin, p_);
+	return p_ != begin;
+}
+
+bool TextScanner::skipToken() {
+	skipSpace();
+	const char* begin = p_;
+	endToken();
+	return p_ != begin;
+}
+
+void TextScanner::endToken() {
+	while (p_ < end_ && !isSpace(*p_))
+		++p_;
+}
+
+bool TextScanner::nextInt(int& value) {
+	skipSpace();
+	const char* p = p_;
+	bool negative = false;
+	if (p < end_ && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	if (p == end_ || !isDigit(*p))
+		return false;
+
+	int v = 0;
+	while (p < end_ && isDigit(*p))
+		v = v * 10 + (*p++ - '0');
+	value = negative ? -v : v;
+	p_ = p;
+	return true;
+}
+
+bool TextScanner::nextFloat(float& value) {
+	skipSpace();
+	const char* start = p_;
+	const char* p = p_;
+	bool negative = false;
+	if (p < end_ && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	// Collect up to 19 significant digits in an integer; the decimal point only
+	// shifts the exponent.
+	U64 mantissa = 0;
+	int significant = 0;
+	int exponent = 0;
+	bool any_digits = false;
+	bool exact = true;
+	for (bool fraction = false; p < end_; ++p) {
+		if (isDigit(*p)) {
+			any_digits = true;
+			if (mantissa == 0 && *p == '0') {
+				exponent -= fraction ? 1 : 0;
+				continue;
+			}
+			if (significant < 19) {
+				mantissa = mantissa * 10 + U64(*p - '0');
+				++significant;
+				exponent -= fraction ? 1 : 0;
+			} else {
+				exact &= *p == '0';
+				exponent += fraction ? 0 : 1;
+			}
+		} else if (*p == '.' && !fraction) {
+			fraction = true;
+		} else {
+			break;
+		}
+	}
+	if (!any_digits)
+		return false;
+
+	if (p < end_ && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		bool negative_exponent = false;
+		if (q < end_ && (*q == '-' || *q == '+'))
+			negative_exponent = *q++ == '-';
+		if (q < end_ && isDigit(*q)) {
+			int e = 0;
+			while (q < end_ && isDigit(*q)) {
+				e = e < 10000 ? e * 10 + (*q - '0') : e;
+				++q;
+			}
+			exponent += negative_exponent ? -e : e;
+			p = q;
+		}
+	}
+	p_ = p;
+
+	if (mantissa == 0) {
+		value = negative ? -0.0f : 0.0f;
+		return true;
+	}
+	if (exact && mantissa < (U64(1) << 53) && exponent >= -22 && exponent <= 22) {
+		double d = double(mantissa);
+		d = exponent < 0 ? d / POWERS_OF_TEN[-exponent] : d * POWERS_OF_TEN[exponent];
+		if (d >= FLT_MIN && d <= FLT_MAX && !isFloatHalfway(d)) {
+			value = float(negative ? -d : d);
+			return true;
+		}
+	}
+
+	// Too many digits, too large or small, or a tie: let the C library round it.
+	// The text is NUL-terminated or followed by more text, so strtof stops in time,
+	// at the same place as the scan above.
+	value = strtof(start, nullptr);
+	return true;
+}
+
+bool TextScanner::nextLine(TextScanner& line) {
+	if (p_ == end_)
+		return false;
+	const char* eol = (const char*)memchr(p_, '\n', size_t(end_ - p_));
+	const char* next = eol ? eol + 1 : end_;
+	eol = eol ? eol : end_;
+	if (eol > p_ && eol[-1] == '\r')
+		--eol;
+	line = TextScanner(p_, eol);
+	p_ = next;
+	return true;
+}
+
+} // namespace FW
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace FW {
+
+// Read a whole file into text with one block read and terminate it with a NUL.
+// Returns false if the file cannot be opened.
+bool			readTextFile	(const std::string& filename, std::vector<char>& text);
+
+// A tokenizer over text in memory, for the whitespace-separated formats the app
+// loads. Unlike the stream extraction operators it does no locale handling and
+// no copying, and it parses numbers by hand: a float that has at most 19
+// significant digits and a decimal exponent within 22 is converted exactly
+// through double, and only the rest go through strtod.
+//
+// The token functions skip any whitespace before the token, including line
+// breaks; use nextLine() to work line by line.
+class TextScanner
+{
+public:
+					TextScanner		(void) : p_(nullptr), end_(nullptr) {}
+					TextScanner		(const char* begin, const char* end) : p_(begin), end_(end) {}
+
+	const char*		position		(void) const { return p_; }
+	const char*		end				(void) const { return end_; }
+
+	// True when only whitespace is left.
+	bool			atEnd			(void);
+
+	// The next token as a string, or false at the end.
+	bool			nextToken		(std::string& token);
+
+	// Skip the next token.
+	bool			skipToken		(void);
+
+	// Skip what is left of the current token, e.g. "/5/3" after nextInt() has read
+	// the 12 of "12/5/3". Does nothing at whitespace.
+	void			endToken		(void);
+
+	// Parse a number at the start of the next token, and leave the rest of the token
+	// in place. Returns false, without moving, if the token does not start with a number.
+	bool			nextFloat		(float& value);
+	bool			nextInt			(int& value);
+
+	// The rest of the current line, not including the line break, and move to the
+	// start of the next line. Returns false at the end of the text.
+	bool			nextLine		(TextScanner& line);
+
+private:
+	void			skipSpace		(void);
+
+	const char*		p_;
+	const char*		end_;
+};
+
+} // namespace FW
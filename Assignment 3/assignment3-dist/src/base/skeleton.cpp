@@ -1,14 +1,23 @@
 #include "skeleton.hpp"
+#include "parallel.hpp"
+#include "parsing.hpp"
 #include "utility.hpp"
 
 #include <cassert>
+#include <cstring>
 #include <fstream>
 #include <stack>
-#include <sstream>
 
 using namespace std;
 using namespace FW;
 
+namespace {
+
+// Smallest piece of the MOTION block worth handing to another thread.
+const size_t MIN_MOTION_CHUNK_BYTES = 256 * 1024;
+
+} // namespace
+
 
 void Skeleton::setJointRotation(unsigned index, Vec3f euler_angles) {
 	Joint& joint = joints_[index];
@@ -30,12 +39,26 @@ void Skeleton::setJointRotation(unsigned index, Vec3f euler_angles) {
 	// Hints: You can use Mat3f::rotation() three times in a row,
 	// once for each main axis, and multiply the results.
 
-	// Rotations order: rotZ*rotY*rotX
-	Mat3f eulerMatrix = Mat3f::rotation(Vec3f(1, 0, 0), euler_angles.x) * Mat3f::rotation(Vec3f(0, 1, 0), euler_angles.y) * Mat3f::rotation(Vec3f(0, 0, 1), euler_angles.z);
-	// Replace the "to_parent" matrix
-	for (int i = 0; i != 3; i++) {
-		joint.to_parent.setCol(i, Vec4f(eulerMatrix.getCol(i), 0.0f));
-	}
+	// Rotations order: rotX*rotY*rotZ, multiplied out in closed form.
+	float cx = cosf(euler_angles.x), sx = sinf(euler_angles.x);
+	float cy = cosf(euler_angles.y), sy = sinf(euler_angles.y);
+	float cz = cosf(euler_angles.z), sz = sinf(euler_angles.z);
+	Mat3f R;
+	R(0, 0) = cy * cz;					R(0, 1) = -cy * sz;					R(0, 2) = sy;
+	R(1, 0) = sx * sy * cz + cx * sz;	R(1, 1) = cx * cz - sx * sy * sz;	R(1, 2) = -sx * cy;
+	R(2, 0) = sx * sz - cx * sy * cz;	R(2, 1) = cx * sy * sz + sx * cz;	R(2, 2) = cx * cy;
+	setJointToParentRotation(index, R);
+
+	// A manual edit may have replaced a pose the animation will not set again.
+	clip_posed_ = false;
+}
+
+void Skeleton::setJointToParentRotation(unsigned index, const Mat3f& rotation) {
+	Mat4f& M = joints_[index].to_parent;
+	for (int r = 0; r < 3; ++r)
+		for (int c = 0; c < 3; ++c)
+			M(r, c) = rotation(r, c);
+	dirty_[index] = 1;
 }
 
 void Skeleton::incrJointRotation(unsigned index, Vec3f euler_angles) {
@@ -43,26 +66,87 @@ void Skeleton::incrJointRotation(unsigned index, Vec3f euler_angles) {
 }
 
 void Skeleton::updateToWorldTransforms() {
-	// Here we just initiate the hierarchical transformation from the root node (at index 0)
-	// and an identity transformation, precisely as in the lecture slides on hierarchical modeling.
-	if (!animationMode)
-		updateToWorldTransforms(0, Mat4f());
-	else
-		// If we're running an animation, we need to set all of the joint rotations of the current frame
-		// and translate the root so it matches the animation.
-		setAnimationState();
+	// YOUR CODE HERE (R1)
+	// Parents come before their children in eval_order_, so one pass in that order
+	// sees every parent's to_world before it is needed. Only the subtrees below
+	// joints whose to_parent changed are recomputed.
+	for (int p = 0; p < (int)eval_order_.size(); ) {
+		if (!dirty_[eval_order_[p]]) {
+			++p;
+			continue;
+		}
+		for (int q = p; q < subtree_end_[p]; ++q) {
+			int i = eval_order_[q];
+			const Joint& joint = joints_[i];
+			to_world_[i] = (joint.parent < 0 ? root_to_world_ : to_world_[joint.parent]) * joint.to_parent;
+			ssd_[i] = to_world_[i] * joint.to_bind_joint;
+			dirty_[i] = 0;
+		}
+		p = subtree_end_[p];
+	}
 }
 
-void Skeleton::updateToWorldTransforms(unsigned joint_index, const Mat4f& parent_to_world) {
-	// YOUR CODE HERE (R1)
-	// Update transforms for joint at joint_index and its children.
-	// for this joint
-	joints_[joint_index].to_world = parent_to_world * joints_[joint_index].to_parent;
-	// for its children
-	for (int i = 0; i != joints_[joint_index].children.size(); i++) {
-		updateToWorldTransforms(joints_[joint_index].children[i], joints_[joint_index].to_world);
+void Skeleton::setRootTransform(const Mat4f& root_to_world) {
+	root_to_world_ = root_to_world;
+	for (auto i = 0u; i < joints_.size(); ++i)
+		if (joints_[i].parent < 0)
+			dirty_[i] = 1;
+}
+
+void Skeleton::evaluatePose(const AnimationClip& clip, float seconds, const Mat4f& placement, Mat4f* to_world, Mat4f* ssd) const {
+	Mat4f root_to_world = placement;
+	AnimationClip::SamplePoint sample = { 0, 0, 0.0f };
+	int numChannels = 0;
+	if (!clip.empty()) {
+		sample = clip.locate(seconds);
+		root_to_world = placement * Mat4f::translate(clip.position(sample));
+		numChannels = FW::min(int(joints_.size()), clip.numJoints());
+	}
+
+	for (int i : eval_order_) {
+		const Joint& joint = joints_[i];
+		Mat4f to_parent;
+		if (i < numChannels) {
+			Mat3f R = clip.rotation(i, sample);
+			for (int r = 0; r < 3; ++r)
+				for (int c = 0; c < 3; ++c)
+					to_parent(r, c) = R(r, c);
+		}
+		to_parent.setCol(3, Vec4f(joint.position, 1.0f));
+		to_world[i] = (joint.parent < 0 ? root_to_world : to_world[joint.parent]) * to_parent;
+		ssd[i] = to_world[i] * joint.to_bind_joint;
+	}
+}
+
+void Skeleton::buildEvaluationOrder() {
+	eval_order_.clear();
+	subtree_end_.assign(joints_.size(), 0);
+
+	// Depth-first from each root; a joint's end is known once its children are done.
+	vector<pair<int, int>> stack;	// joint, position in eval_order_
+	for (auto r = 0u; r < joints_.size(); ++r) {
+		if (joints_[r].parent >= 0)
+			continue;
+		stack.push_back(make_pair(int(r), -1));
+		while (!stack.empty()) {
+			auto& top = stack.back();
+			if (top.second < 0) {
+				top.second = int(eval_order_.size());
+				eval_order_.push_back(top.first);
+				const auto& children = joints_[top.first].children;
+				for (auto c = children.rbegin(); c != children.rend(); ++c)
+					stack.push_back(make_pair(*c, -1));
+			} else {
+				subtree_end_[top.second] = int(eval_order_.size());
+				stack.pop_back();
+			}
+		}
 	}
+	assert(eval_order_.size() == joints_.size() && "joint hierarchy is not a forest");
 
+	to_world_.assign(joints_.size(), Mat4f());
+	ssd_.assign(joints_.size(), Mat4f());
+	dirty_.assign(joints_.size(), 1);
 }
 
 void Skeleton::computeToBindTransforms() {
@@ -72,60 +156,56 @@ void Skeleton::computeToBindTransforms() {
 	// compute the inverse bind pose transformations (as per the lecture slides),
 	// and store the results in the member to_bind_joint of each joint.
 	for (int i = 0; i != joints_.size(); i++) {
-		joints_[i].to_bind_joint = joints_[i].to_world.inverted();
+		joints_[i].to_bind_joint = to_world_[i].inverted();
 	}
-
+	// The SSD transforms depend on the bind pose as well.
+	dirty_.assign(joints_.size(), 1);
 }
 
-vector<Mat4f> Skeleton::getToWorldTransforms() {
+const vector<Mat4f>& Skeleton::getToWorldTransforms() {
 	updateToWorldTransforms();
-	vector<Mat4f> transforms;
-	for (const auto& j : joints_)
-		transforms.push_back(j.to_world);
-	return transforms;
+	return to_world_;
 }
 
-vector<Mat4f> Skeleton::getSSDTransforms() {
+const vector<Mat4f>& Skeleton::getSSDTransforms() {
 	updateToWorldTransforms();
 	// YOUR CODE HERE (R4)
-	// Compute the relative transformations between the bind pose and current pose,
-	// store the results in the vector "transforms". These are the transformations
-	// passed into the actual skinning code. (In the lecture slides' terms,
-	// these are the T_i * inv(B_i) matrices.)
+	// The relative transformations between the bind pose and current pose
+	// (in the lecture slides' terms, the T_i * inv(B_i) matrices) are computed
+	// along with to_world in updateToWorldTransforms().
+	return ssd_;
+}
 
-	vector<Mat4f> transforms;
-	for (int i = 0; i != joints_.size(); i++) {
-		transforms.push_back(joints_[i].to_world * joints_[i].to_bind_joint);
-	}
-	
-	return transforms;
+Vec3f Skeleton::getJointWorldPosition(unsigned index) {
+	updateToWorldTransforms();
+	return Vec4f(to_world_[index].getCol(3)).getXYZ();
 }
 
-float Skeleton::loadBVH(string skeleton_file) {
-	ifstream in(skeleton_file);
+float Skeleton::loadBVH(string skeleton_file, ThreadPool* pool) {
+	// A missing file leaves the skeleton empty, as before.
+	vector<char> text;
+	readTextFile(skeleton_file, text);
+	TextScanner in(text.data(), text.data() + FW::max(text.size(), size_t(1)) - 1);
 
 	std::vector<Vec3i> axisPermutation;
 
 	string s;
-	string line;
-	while (getline(in, line))
+	while (in.nextToken(s))
 	{
-		stringstream stream(line);
-		stream >> s;
-		
 		if (s == "ROOT")
 		{
 			string jointName;
-			stream >> jointName;
+			in.nextToken(jointName);
 			loadJoint(in, -1, jointName, axisPermutation);
 		}
 		else if (s == "MOTION")
 		{
-			loadAnim(in, axisPermutation);
+			loadAnim(in, axisPermutation, pool);
 		}
 	}
 
 	float scale = normalizeScale();
+	buildEvaluationOrder();
 
 	// initially set to_parent matrices to identity
 	for (auto j = 0u; j < joints_.size(); ++j)
@@ -137,7 +217,7 @@ float Skeleton::loadBVH(string skeleton_file) {
 	return scale;
 }
 
-void Skeleton::loadJoint(ifstream& in, int parent, string name, std::vector<Vec3i>& axisPermutation)
+void Skeleton::loadJoint(TextScanner& in, int parent, string name, std::vector<Vec3i>& axisPermutation)
 {
 	Joint j;
 	j.name = name;
@@ -147,27 +227,19 @@ void Skeleton::loadJoint(ifstream& in, int parent, string name, std::vector<Vec3
 
 	int curIdx = -1;
 	string s;
-	string line;
-	while (getline(in, line))
+	while (in.nextToken(s))
 	{
-		stringstream stream(line);
-		stream >> s;
 		if (s == "JOINT")
 		{
 			string jointName;
-			stream >> jointName;
+			in.nextToken(jointName);
 			loadJoint(in, curIdx, jointName, axisPermutation);
 		}
 		else if (s == "End")
 		{
-			while (getline(in, line))
-			{
-				// Read End block so it doesn't get interpreted as a closing bracket or offset keyword
-				stringstream end(line);
-				end >> s;
-				if (s == "}")
-					break;
-			}
+			// Read End block so it doesn't get interpreted as a closing bracket or offset keyword
+			while (in.nextToken(s) && s != "}")
+				;
 		}
 		else if (s == "}")
 		{
@@ -175,15 +247,16 @@ void Skeleton::loadJoint(ifstream& in, int parent, string name, std::vector<Vec3
 		}
 		else if (s == "CHANNELS")
 		{
-			int channelCount;
-			stream >> channelCount;
+			int channelCount = 0;
+			in.nextInt(channelCount);
 			if (channelCount == 6)
-				stream >> s >> s >> s;
+				for (int i = 0; i < 3; ++i)
+					in.skipToken();
 
 			Vec3i permutation;
 			for (int i = 0; i < 3; ++i)
 			{
-				stream >> s;
+				in.nextToken(s);
 				if (s == "Xrotation")
 					permutation[0] = i;
 				else if (s == "Yrotation")
@@ -196,7 +269,9 @@ void Skeleton::loadJoint(ifstream& in, int parent, string name, std::vector<Vec3
 		else if (s == "OFFSET")
 		{
 			Vec3f pos;
-			stream >> pos.x >> pos.y >> pos.z;
+			in.nextFloat(pos.x);
+			in.nextFloat(pos.y);
+			in.nextFloat(pos.z);
 			j.position = pos;
 
 			if (!pushed)
@@ -213,48 +288,125 @@ void Skeleton::loadJoint(ifstream& in, int parent, string name, std::vector<Vec3
 	}
 }
 
-void Skeleton::loadAnim(ifstream& in, std::vector<Vec3i>& axisPermutation)
+void Skeleton::loadAnim(TextScanner& in, std::vector<Vec3i>& axisPermutation, ThreadPool* pool)
 {
+	// "Frames: <count>"
 	string word;
-	in >> word;
-	int frames;
-	in >> frames;
-
-	animationData.resize(frames);
-
-	int frameNum = 0;
-	string line;
+	in.nextToken(word);
+	int frames = 0;
+	in.nextInt(frames);
+
+	// "Frame Time: <seconds>"
+	float frameTime = 0.0f;
+	in.nextToken(word);
+	in.nextToken(word);
+	in.nextFloat(frameTime);
+	TextScanner line;
+	in.nextLine(line);
+
+	// The rest is one line per frame. Split it into ranges of whole lines that are
+	// parsed in parallel, each into its own arrays, and join the arrays in order.
+	const char* begin = in.position();
+	const char* end = in.end();
+	size_t bytes = size_t(end - begin);
+	int chunks = 1;
+	if (pool)
+		chunks = FW::max(1, FW::min(4 * pool->numThreads(), int(bytes / MIN_MOTION_CHUNK_BYTES)));
+	vector<const char*> bounds(chunks + 1, end);
+	bounds[0] = begin;
+	for (int k = 1; k < chunks; ++k)
+	{
+		const char* p = FW::max(bounds[k - 1], begin + bytes * k / chunks);
+		const char* eol = p < end ? (const char*)memchr(p, '\n', size_t(end - p)) : nullptr;
+		bounds[k] = eol ? eol + 1 : end;
+	}
 
-	// Discard unused lines
-	getline(in, line);
-	getline(in, line);
+	// Load animation angle and position data for each frame: the root position
+	// followed by three angles for each joint.
+	int numJoints = int(axisPermutation.size());
+	vector<vector<Vec3f>> chunkPositions(chunks);
+	vector<vector<Vec3f>> chunkAngles(chunks);
+	auto parseChunk = [&](int k)
+	{
+		TextScanner text(bounds[k], bounds[k + 1]);
+		TextScanner line;
+		vector<float> frameData;
+		while (text.nextLine(line))
+		{
+			frameData.clear();
+			float value;
+			while (line.nextFloat(value))
+				frameData.push_back(value);
+			if (frameData.size() < size_t(3 + 3 * numJoints))
+				continue;
+
+			chunkPositions[k].push_back(Vec3f(frameData[0], frameData[1], frameData[2]));
+			// Permute angle axes
+			for (int i = 0; i < numJoints; ++i)
+			{
+				const float* a = &frameData[3 + 3 * i];
+				chunkAngles[k].push_back(Vec3f(a[axisPermutation[i].x], a[axisPermutation[i].y], a[axisPermutation[i].z]));
+			}
+		}
+	};
+	if (pool)
+		pool->run(chunks, parseChunk);
+	else
+		parseChunk(0);
 
-	// Load animation angle and position data for each frame
-	while (getline(in, line))
+	vector<Vec3f> positions;
+	vector<Vec3f> angles;
+	positions.reserve(frames);
+	angles.reserve(size_t(frames) * numJoints);
+	for (int k = 0; k < chunks; ++k)
 	{
-		float* frameData = (float*)(animationData.data() + frameNum);
-		stringstream stream(line);
-		int i = 0;
-		while(stream.good())
-			stream >> frameData[i++];
-		frameNum++;
+		positions.insert(positions.end(), chunkPositions[k].begin(), chunkPositions[k].end());
+		angles.insert(angles.end(), chunkAngles[k].begin(), chunkAngles[k].end());
 	}
 
-	// Permute angle axes
+	// Offset position so that average stays at origin
 	Vec3f posAccum;
-	for (auto& f : animationData)
+	for (const auto& p : positions)
+		posAccum += p;
+	for (auto& p : positions)
+		p -= posAccum / float(positions.size());
+
+	// A rotation error of a radians at a joint moves the joints below it by up to
+	// a * reach, where reach is the distance to the farthest of them in the bind pose,
+	// and the errors of all the joints above a joint add up. Split the drift allowed
+	// for the model size (the diagonal of the bind pose's bounding box) evenly among
+	// the joints of the longest chain through each joint, and pick the joint's
+	// tolerance so that its share is not exceeded: the hips get a tight tolerance and
+	// the fingers a loose one.
+	vector<Vec3f> bindPositions(joints_.size());
+	vector<float> reach(joints_.size(), 0.0f);
+	vector<int> depth(joints_.size(), 0);		// joints above
+	vector<int> chain(joints_.size(), 1);		// joints above the deepest joint below, at least one
+	Vec3f lo(FW_F32_MAX), hi(-FW_F32_MAX);
+	for (int i = 0; i < int(joints_.size()); ++i)
 	{
-		posAccum += f.position;
-		for (int i = 0; i < ANIM_JOINT_COUNT; ++i)
+		int parent = joints_[i].parent;
+		bindPositions[i] = joints_[i].position + (parent >= 0 ? bindPositions[parent] : Vec3f());
+		depth[i] = (parent >= 0) ? depth[parent] + 1 : 0;
+		lo = FW::min(lo, bindPositions[i]);
+		hi = FW::max(hi, bindPositions[i]);
+		for (int a = parent; a >= 0; a = joints_[a].parent)
 		{
-			Vec3f angles = f.angles[i];
-			f.angles[i] = Vec3f(angles[axisPermutation[i].x], angles[axisPermutation[i].y], angles[axisPermutation[i].z]);
+			reach[a] = FW::max(reach[a], (bindPositions[i] - bindPositions[a]).length());
+			chain[a] = FW::max(chain[a], depth[i]);
 		}
 	}
+	float extent = joints_.empty() ? 0.0f : (hi - lo).length();
+	vector<float> tolerances(numJoints);
+	for (int i = 0; i < numJoints; ++i)
+	{
+		float radians = ANIM_POSITION_TOLERANCE * extent / (FW::max(reach[i], 1e-6f) * chain[i]);
+		tolerances[i] = FW::clamp(radians * (180.0f / FW_PI), ANIM_MIN_TOLERANCE_DEGREES, ANIM_MAX_TOLERANCE_DEGREES);
+	}
 
-	// Offset position so that average stays at origin
-	for (auto& f : animationData)
-		f.position -= posAccum / float(animationData.size());
+	clip_.build(frameTime, numJoints, positions, angles, tolerances);
+	cout << "animation:  " << clip_.numFrames() << " frames, " << clip_.numConstantChannels() << " of "
+		 << clip_.numJoints() << " joints constant, " << clip_.memoryBytes() / 1024 << " KB (" << clip_.rawBytes() / 1024 << " KB as Euler angles)" << endl;
 }
 
 void Skeleton::load(string skeleton_file) {	
@@ -282,6 +434,7 @@ void Skeleton::load(string skeleton_file) {
 			++current_joint;
 		}
 	}
+	buildEvaluationOrder();
 
 	// initially set to_parent matrices to identity
 	for (auto j = 0u; j < joints_.size(); ++j)
@@ -303,8 +456,7 @@ float Skeleton::normalizeScale()
 	scale *= 2;
 	for (auto& j : joints_)
 		j.position /= scale;
-	for (auto& f : animationData)
-		f.position /= scale;
+	clip_.scalePositions(1.0f / scale);
 
 	return scale;
 }
@@ -325,28 +477,21 @@ int Skeleton::getJointIndex(string name) {
 	return jointNameMap[name];
 }
 
-void Skeleton::setAnimationFrame(int AnimationFrame)
-{
-	animationFrame = AnimationFrame;
-	animationMode = true;
-}
-
-void Skeleton::setAnimationState()
+void Skeleton::setAnimationTime(float seconds)
 {
 	// No actual animation exists.
-	if (!animationData.size()) {
-		animationMode = false;
-		updateToWorldTransforms(0, Mat4f());
+	if (clip_.empty())
 		return;
-	}
 
-	// Get the current position in the animation..
-	int frame = animationFrame % animationData.size();
-	auto& frameData = animationData[frame];
-	// .. and set all joint rotations accordingly.
-	for (int j = 0; j < ANIM_JOINT_COUNT; ++j)
-		setJointRotation(j, frameData.angles[j] * FW_PI / 180.0f);
+	// Set the joint rotations for the current time. The constant channels only need
+	// to be applied once, and leaving them alone keeps their subtrees clean.
+	auto sample = clip_.locate(seconds);
+	int numJoints = FW::min(int(joints_.size()), clip_.numJoints());
+	for (int j = 0; j < numJoints; ++j)
+		if (!clip_posed_ || !clip_.isConstant(j))
+			setJointToParentRotation(j, clip_.rotation(j, sample));
+	clip_posed_ = true;
 
 	// Also translate the root to the position given in the animation description.
-	updateToWorldTransforms(0, Mat4f::translate(frameData.position));
+	setRootTransform(Mat4f::translate(clip_.position(sample)));
 }
@@ -1,18 +1,28 @@
 #pragma once
 
+#include "animation.hpp"
+
 #include <base/Math.hpp>
 
 #include <string>
 #include <vector>
 #include <map>
 
+namespace FW {
+class TextScanner;
+class ThreadPool;
+}
+
 static const unsigned WEIGHTS_PER_VERTEX = 8u;
-static const unsigned ANIM_JOINT_COUNT = 100u;
-struct AnimFrame
-{
-	FW::Vec3f position;
-	FW::Vec3f angles[ ANIM_JOINT_COUNT ];
-};
+
+// How far the joints of an animation clip may drift from the captured motion, as a
+// fraction of the diagonal of the bind pose's bounding box, and the range the per-joint
+// rotation tolerance is kept in. The minimum is about the smallest angle the float
+// quaternion test in AnimationClip::build() resolves, so the joints below the hips
+// of a long chain may drift somewhat further than the fraction allows.
+static const float ANIM_POSITION_TOLERANCE = 0.002f;
+static const float ANIM_MIN_TOLERANCE_DEGREES = 0.05f;
+static const float ANIM_MAX_TOLERANCE_DEGREES = 2.0f;
 
 struct Joint
 {
@@ -28,9 +38,8 @@ struct Joint
 	// (It is computed using the rotation and the position.)
 	FW::Mat4f to_parent;
 
-	// Current transform from joint space to world space.
-	// (This is the matrix T_i in the lecture slides' notation.)
-	FW::Mat4f to_world;
+	// The current transform from joint space to world space (the matrix T_i in
+	// the lecture slides' notation) is kept in Skeleton::to_world_.
 
 	// Transform from world space to joint space for the initial "bind" configuration.
 	// (This is the matrix inv(B_i) in the lecture slides' notation)
@@ -49,36 +58,61 @@ class Skeleton
 {
 public:
 	void					load(std::string skeleton_file);
-	float					loadBVH(std::string skeleton_file);
+	// With a thread pool, the frames of the animation are parsed in parallel.
+	float					loadBVH(std::string skeleton_file, FW::ThreadPool* pool = nullptr);
 
 	int						getJointIndex(std::string name);
 	std::string				getJointName(unsigned index) const;
 	FW::Vec3f				getJointRotation(unsigned index) const;
 	int						getJointParent(unsigned index) const;
 
-	void					setAnimationFrame(int frame);
+	// Pose the skeleton as the loaded animation clip is at the given time (looping).
+	void					setAnimationTime(float seconds);
+	const AnimationClip&	getAnimationClip() const { return clip_; }
 	void					setJointRotation(unsigned index, FW::Vec3f euler_angles);
 	void					incrJointRotation(unsigned index, FW::Vec3f euler_angles);
 	
 	void					updateToWorldTransforms();
 	float					normalizeScale();
 
-	std::vector<FW::Mat4f>	getToWorldTransforms();
-	std::vector<FW::Mat4f>	getSSDTransforms();
+	// These bring the transforms up to date and return the skeleton's own arrays,
+	// which stay valid until the next call that changes the pose.
+	const std::vector<FW::Mat4f>&	getToWorldTransforms();
+	const std::vector<FW::Mat4f>&	getSSDTransforms();
+	FW::Vec3f				getJointWorldPosition(unsigned index);
+
+	size_t					getNumJoints() const { return joints_.size(); }
 
-	size_t					getNumJoints() { return joints_.size(); }
+	// Pose another instance of this skeleton as the given clip is at the given time,
+	// placed in the world by placement, and write its T_i and T_i * inv(B_i) to
+	// to_world[joint] and ssd[joint]. The skeleton itself is not changed, so any
+	// number of instances can be evaluated in parallel.
+	void					evaluatePose(const AnimationClip& clip, float seconds, const FW::Mat4f& placement, FW::Mat4f* to_world, FW::Mat4f* ssd) const;
 
 private:
-	void					setAnimationState();
-	void					loadJoint(std::ifstream& in, int parent, std::string name, std::vector<FW::Vec3i>& axisPermutation);
-	void					loadAnim(std::ifstream& in, std::vector<FW::Vec3i>& axisPermutation);
-	void					updateToWorldTransforms(unsigned joint_index, const FW::Mat4f& parent_to_world);
+	void					setRootTransform(const FW::Mat4f& root_to_world);
+	void					setJointToParentRotation(unsigned index, const FW::Mat3f& rotation);
+	void					loadJoint(FW::TextScanner& in, int parent, std::string name, std::vector<FW::Vec3i>& axisPermutation);
+	void					loadAnim(FW::TextScanner& in, std::vector<FW::Vec3i>& axisPermutation, FW::ThreadPool* pool);
 
+	void					buildEvaluationOrder();
 	void					computeToBindTransforms();
 
 	std::vector<Joint>		joints_;
+
+	// The joints in depth-first order, so that every parent comes before its children
+	// and the subtree at position p is the range [p, subtree_end_[p]). The transforms
+	// are updated with one linear pass over this order, skipping the subtrees whose
+	// joints have not changed since the last update.
+	std::vector<int>		eval_order_;
+	std::vector<int>		subtree_end_;
+	std::vector<FW::U8>		dirty_;			// per joint: to_parent changed
+	FW::Mat4f				root_to_world_;
+
+	std::vector<FW::Mat4f>	to_world_;		// T_i
+	std::vector<FW::Mat4f>	ssd_;			// T_i * inv(B_i)
+
 	std::map<std::string, int> jointNameMap;
-	std::vector<AnimFrame>  animationData;
-	int						animationFrame;
-	bool					animationMode = false;
+	AnimationClip			clip_;
+	bool					clip_posed_ = false;	// the constant channels have been applied
 };
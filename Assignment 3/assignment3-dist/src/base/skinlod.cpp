@@ -0,0 +1,520 @@
+#include "skinlod.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+
+using namespace std;
+
+namespace FW {
+
+namespace {
+
+// Levels with fewer triangles are not worth a draw of their own.
+const int MIN_LOD_TRIANGLES = 64;
+
+// A level that removes less than this fraction of the triangles of the one before
+// ends the chain.
+const float MIN_LOD_REDUCTION = 0.2f;
+
+// Weight of the planes that hold open edges in place, per squared edge length.
+const double BOUNDARY_WEIGHT = 10.0;
+
+// Cost of merging two vertices whose weights differ completely, per squared edge length.
+const double SKIN_WEIGHT_COST = 1.0;
+
+// A collapse may turn a triangle by at most about 80 degrees.
+const float MIN_NORMAL_COSINE = 0.2f;
+
+// Sum of weighted squared distances to a set of planes n . p + d = 0, as the
+// symmetric matrix of (n, d) (n, d)^T.
+struct Quadric
+{
+	Quadric() { memset(this, 0, sizeof(*this)); }
+
+	Quadric(const Vec3f& n, float d, double scale, double area)
+	{
+		double a = n.x, b = n.y, c = n.z, e = d;
+		aa = scale * a * a; ab = scale * a * b; ac = scale * a * c; ad = scale * a * e;
+		bb = scale * b * b; bc = scale * b * c; bd = scale * b * e;
+		cc = scale * c * c; cd = scale * c * e;
+		dd = scale * e * e;
+		weight = area;
+	}
+
+	Quadric& operator+=(const Quadric& o)
+	{
+		aa += o.aa; ab += o.ab; ac += o.ac; ad += o.ad;
+		bb += o.bb; bc += o.bc; bd += o.bd;
+		cc += o.cc; cd += o.cd;
+		dd += o.dd;
+		weight += o.weight;
+		return *this;
+	}
+
+	double eval(const Vec3f& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double r = aa * x * x + bb * y * y + cc * z * z + dd +
+			2.0 * (ab * x * y + ac * x * z + bc * y * z + ad * x + bd * y + cd * z);
+		return FW::max(r, 0.0);
+	}
+
+	double aa, ab, ac, ad, bb, bc, bd, cc, cd, dd;
+	double weight;		// area of the surface planes; the boundary planes add none
+};
+
+// Collapse of the edge (from, to) into to, placed at lerp(to, from, t). The stamps
+// tell whether either vertex has changed since the cost was computed.
+struct Collapse
+{
+	bool operator<(const Collapse& o) const { return cost > o.cost; } // cheapest first
+
+	double		cost;
+	float		t;
+	int			from, to;
+	unsigned	from_stamp, to_stamp;
+};
+
+float pointSegmentDistance(const Vec3f& p, const Vec3f& a, const Vec3f& b) {
+	Vec3f e = b - a;
+	float t = FW::clamp(dot(p - a, e) / FW::max(e.lenSqr(), FLT_MIN), 0.0f, 1.0f);
+	return (a + e * t - p).length();
+}
+
+float pointTriangleDistance(const Vec3f& p, const Vec3f& a, const Vec3f& b, const Vec3f& c) {
+	Vec3f n = cross(b - a, c - a);
+	float length = n.length();
+	if (length > 0.0f) {
+		n /= length;
+		float d = dot(p - a, n);
+		Vec3f q = p - n * d;
+		if (dot(cross(b - a, q - a), n) >= 0.0f && dot(cross(c - b, q - b), n) >= 0.0f && dot(cross(a - c, q - c), n) >= 0.0f)
+			return FW::abs(d);
+	}
+	return FW::min(pointSegmentDistance(p, a, b), FW::min(pointSegmentDistance(p, b, c), pointSegmentDistance(p, c, a)));
+}
+
+// Half of the summed absolute differences of the weights: 0 for equal weights,
+// 1 for weights on disjoint joints.
+float weightDistance(const WeightedVertex& a, const WeightedVertex& b) {
+	float d = 0.0f;
+	for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i) {
+		if (a.weights[i] == 0.0f)
+			continue;
+		float wb = 0.0f;
+		for (auto k = 0u; k < WEIGHTS_PER_VERTEX; ++k)
+			if (b.joints[k] == a.joints[i])
+				wb += b.weights[k];
+		d += FW::abs(a.weights[i] - wb);
+	}
+	for (auto k = 0u; k < WEIGHTS_PER_VERTEX; ++k) {
+		if (b.weights[k] == 0.0f)
+			continue;
+		bool shared = false;
+		for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i)
+			shared |= a.weights[i] != 0.0f && a.joints[i] == b.joints[k];
+		d += shared ? 0.0f : b.weights[k];
+	}
+	return 0.5f * d;
+}
+
+// lerp(a, b, t) of all attributes. Of the merged influences the heaviest
+// WEIGHTS_PER_VERTEX are kept, renormalized, in the first slots.
+WeightedVertex blendVertices(const WeightedVertex& a, const WeightedVertex& b, float t) {
+	WeightedVertex r;
+	r.position = a.position + (b.position - a.position) * t;
+	r.normal = a.normal + (b.normal - a.normal) * t;
+	float length = r.normal.length();
+	r.normal = length > 0.0f ? r.normal / length : a.normal;
+	r.color = a.color + (b.color - a.color) * t;
+
+	pair<float, int> merged[2 * WEIGHTS_PER_VERTEX];
+	int n = 0;
+	auto add = [&](int joint, float weight) {
+		if (weight == 0.0f)
+			return;
+		for (int i = 0; i < n; ++i)
+			if (merged[i].second == joint) {
+				merged[i].first += weight;
+				return;
+			}
+		merged[n++] = make_pair(weight, joint);
+	};
+	for (auto i = 0u; i < WEIGHTS_PER_VERTEX; ++i) {
+		add(a.joints[i], a.weights[i] * (1.0f - t));
+		add(b.joints[i], b.weights[i] * t);
+	}
+	sort(merged, merged + n, [](const pair<float, int>& x, const pair<float, int>& y) { return x.first > y.first; });
+	n = FW::min(n, int(WEIGHTS_PER_VERTEX));
+
+	float sum = 0.0f;
+	for (int i = 0; i < n; ++i)
+		sum += merged[i].first;
+	for (int i = 0; i < int(WEIGHTS_PER_VERTEX); ++i) {
+		r.joints[i] = i < n ? merged[i].second : 0;
+		r.weights[i] = i < n ? merged[i].first / sum : 0.0f;
+	}
+	return r;
+}
+
+// The mesh being simplified. Removed triangles and vertices stay in the arrays
+// and are skipped; the triangle lists of the vertices are cleaned up lazily.
+class Simplifier
+{
+public:
+	Simplifier(const vector<WeightedVertex>& vertices, const vector<U32>& indices);
+
+	int			numTriangles	(void) const { return num_triangles_; }
+
+	// Collapse edges until at most target triangles are left or no edge can be collapsed.
+	void		simplify		(int target);
+	void		extract			(SkinLodLevel& level) const;
+
+private:
+	Collapse	plan			(int from, int to) const;
+	bool		isValid			(const Collapse& c) const;
+	void		apply			(const Collapse& c);
+	void		neighbors		(int v, vector<int>& out) const;
+
+	bool		contains		(int tri, int v) const
+	{
+		return indices_[3 * tri] == U32(v) || indices_[3 * tri + 1] == U32(v) || indices_[3 * tri + 2] == U32(v);
+	}
+
+	vector<Vec3f>			original_;		// positions in the full mesh
+	vector<WeightedVertex>	vertices_;
+	vector<U32>				indices_;
+	vector<Quadric>			quadrics_;
+	vector<vector<int>>		vertex_tris_;
+	vector<unsigned>		stamps_;
+	vector<char>			vertex_alive_;
+	vector<char>			tri_alive_;
+	vector<vector<int>>		merged_;		// the original vertices each vertex stands for
+	priority_queue<Collapse> heap_;
+	int						num_triangles_;
+};
+
+Simplifier::Simplifier(const vector<WeightedVertex>& vertices, const vector<U32>& indices) {
+	// Vertices at the same position are welded, so that a seam in the normals or
+	// weights does not split the surface into pieces that are simplified apart. The
+	// welded vertex keeps the weights of the first and the average of the normals.
+	vector<int> order(vertices.size()), weld(vertices.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = int(i);
+	auto less = [&](int a, int b) {
+		const Vec3f& p = vertices[a].position;
+		const Vec3f& q = vertices[b].position;
+		return p.x < q.x || (p.x == q.x && (p.y < q.y || (p.y == q.y && p.z < q.z)));
+	};
+	sort(order.begin(), order.end(), less);
+	for (size_t i = 0; i < order.size(); ++i) {
+		if (i == 0 || less(order[i - 1], order[i]))
+			vertices_.push_back(vertices[order[i]]);
+		else
+			vertices_.back().normal += vertices[order[i]].normal;
+		weld[order[i]] = int(vertices_.size()) - 1;
+	}
+	for (auto& v : vertices_) {
+		float length = v.normal.length();
+		if (length > 0.0f)
+			v.normal /= length;
+	}
+	for (size_t t = 0; t < indices.size(); t += 3) {
+		U32 a = U32(weld[indices[t]]), b = U32(weld[indices[t + 1]]), c = U32(weld[indices[t + 2]]);
+		if (a == b || b == c || c == a)
+			continue;
+		indices_.push_back(a);
+		indices_.push_back(b);
+		indices_.push_back(c);
+	}
+
+	size_t n = vertices_.size();
+	quadrics_.resize(n);
+	vertex_tris_.resize(n);
+	stamps_.assign(n, 0u);
+	vertex_alive_.assign(n, 1);
+	merged_.resize(n);
+	num_triangles_ = int(indices_.size() / 3);
+	tri_alive_.assign(num_triangles_, 1);
+	for (size_t i = 0; i < n; ++i) {
+		original_.push_back(vertices_[i].position);
+		merged_[i].push_back(int(i));
+	}
+
+	// Each vertex starts with the planes of the triangles around it, weighted by area.
+	unordered_map<U64, int> edge_uses;
+	for (int t = 0; t < num_triangles_; ++t) {
+		const U32* tri = &indices_[3 * t];
+		Vec3f p0 = vertices_[tri[0]].position;
+		Vec3f n = cross(vertices_[tri[1]].position - p0, vertices_[tri[2]].position - p0);
+		float length = n.length();
+		for (int k = 0; k < 3; ++k) {
+			vertex_tris_[tri[k]].push_back(t);
+			U32 a = tri[k], b = tri[(k + 1) % 3];
+			++edge_uses[(U64(FW::min(a, b)) << 32) | FW::max(a, b)];
+		}
+		if (length == 0.0f)
+			continue;
+		n /= length;
+		Quadric q(n, -dot(n, p0), 0.5 * length, 0.5 * length);
+		for (int k = 0; k < 3; ++k)
+			quadrics_[tri[k]] += q;
+	}
+
+	// Open edges get a plane through the edge, perpendicular to its triangle.
+	for (int t = 0; t < num_triangles_; ++t) {
+		const U32* tri = &indices_[3 * t];
+		Vec3f p0 = vertices_[tri[0]].position;
+		Vec3f n = cross(vertices_[tri[1]].position - p0, vertices_[tri[2]].position - p0);
+		for (int k = 0; k < 3; ++k) {
+			U32 a = tri[k], b = tri[(k + 1) % 3];
+			if (edge_uses[(U64(FW::min(a, b)) << 32) | FW::max(a, b)] != 1)
+				continue;
+			Vec3f e = vertices_[b].position - vertices_[a].position;
+			Vec3f m = cross(e, n);
+			float length = m.length();
+			if (length == 0.0f)
+				continue;
+			m /= length;
+			Quadric q(m, -dot(m, vertices_[a].position), BOUNDARY_WEIGHT * e.lenSqr(), 0.0);
+			quadrics_[a] += q;
+			quadrics_[b] += q;
+		}
+	}
+
+	for (int t = 0; t < num_triangles_; ++t)
+		for (int k = 0; k < 3; ++k) {
+			int a = int(indices_[3 * t + k]), b = int(indices_[3 * t + (k + 1) % 3]);
+			if (a != b)
+				heap_.push(plan(a, b));
+		}
+}
+
+Collapse Simplifier::plan(int from, int to) const {
+	Quadric q = quadrics_[to];
+	q += quadrics_[from];
+	const Vec3f& p_to = vertices_[to].position;
+	const Vec3f& p_from = vertices_[from].position;
+
+	Collapse c;
+	c.from = from;
+	c.to = to;
+	c.from_stamp = stamps_[from];
+	c.to_stamp = stamps_[to];
+	c.t = 0.0f;
+	double best = q.eval(p_to);
+	for (float t : { 0.5f, 1.0f }) {
+		double e = q.eval(p_to + (p_from - p_to) * t);
+		if (e < best) {
+			best = e;
+			c.t = t;
+		}
+	}
+
+	double area = FW::max(q.weight, 1e-12);
+	c.cost = best / area + SKIN_WEIGHT_COST * weightDistance(vertices_[from], vertices_[to]) * (p_from - p_to).lenSqr();
+	return c;
+}
+
+void Simplifier::neighbors(int v, vector<int>& out) const {
+	out.clear();
+	for (int t : vertex_tris_[v]) {
+		if (!tri_alive_[t])
+			continue;
+		for (int k = 0; k < 3; ++k)
+			if (indices_[3 * t + k] != U32(v))
+				out.push_back(int(indices_[3 * t + k]));
+	}
+	sort(out.begin(), out.end());
+	out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+bool Simplifier::isValid(const Collapse& c) const {
+	// The edge may only be shared by the triangles on its two sides: more common
+	// neighbors would fold the surface onto itself.
+	vector<int> a, b, common;
+	neighbors(c.from, a);
+	neighbors(c.to, b);
+	set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(common));
+	int shared = 0;
+	for (int t : vertex_tris_[c.from])
+		shared += tri_alive_[t] && contains(t, c.to);
+	if (shared == 0 || int(common.size()) != shared)
+		return false;
+
+	// Nor may it leave a vertex without triangles, which would drop the surface that
+	// vertex stands for from the level.
+	auto keeps = [&](int v) {
+		for (int t : vertex_tris_[v])
+			if (tri_alive_[t] && !(contains(t, c.from) && contains(t, c.to)))
+				return true;
+		return false;
+	};
+	if (!keeps(c.from) && !keeps(c.to))
+		return false;
+	for (int t : vertex_tris_[c.from])
+		if (tri_alive_[t] && contains(t, c.to))
+			for (int k = 0; k < 3; ++k) {
+				int w = int(indices_[3 * t + k]);
+				if (w != c.from && w != c.to && !keeps(w))
+					return false;
+			}
+
+	// The triangles that stay must not turn over or collapse to a line.
+	Vec3f p = vertices_[c.to].position + (vertices_[c.from].position - vertices_[c.to].position) * c.t;
+	for (int moved : { c.from, c.to })
+		for (int t : vertex_tris_[moved]) {
+			if (!tri_alive_[t] || contains(t, moved == c.from ? c.to : c.from))
+				continue;
+			Vec3f before[3], after[3];
+			for (int k = 0; k < 3; ++k) {
+				before[k] = vertices_[indices_[3 * t + k]].position;
+				after[k] = indices_[3 * t + k] == U32(moved) ? p : before[k];
+			}
+			Vec3f n0 = cross(before[1] - before[0], before[2] - before[0]);
+			Vec3f n1 = cross(after[1] - after[0], after[2] - after[0]);
+			if (dot(n0, n1) <= MIN_NORMAL_COSINE * n0.length() * n1.length())
+				return false;
+		}
+	return true;
+}
+
+void Simplifier::apply(const Collapse& c) {
+	vertices_[c.to] = blendVertices(vertices_[c.to], vertices_[c.from], c.t);
+	quadrics_[c.to] += quadrics_[c.from];
+	vertex_alive_[c.from] = 0;
+	++stamps_[c.to];
+
+	auto& merged = merged_[c.to];
+	if (merged.size() < merged_[c.from].size())
+		merged.swap(merged_[c.from]);
+	merged.insert(merged.end(), merged_[c.from].begin(), merged_[c.from].end());
+	merged_[c.from].clear();
+	merged_[c.from].shrink_to_fit();
+
+	for (int t : vertex_tris_[c.from]) {
+		if (!tri_alive_[t])
+			continue;
+		if (contains(t, c.to)) {
+			tri_alive_[t] = 0;
+			--num_triangles_;
+			continue;
+		}
+		for (int k = 0; k < 3; ++k)
+			if (indices_[3 * t + k] == U32(c.from))
+				indices_[3 * t + k] = U32(c.to);
+		vertex_tris_[c.to].push_back(t);
+	}
+	vertex_tris_[c.from].clear();
+
+	auto& tris = vertex_tris_[c.to];
+	tris.erase(remove_if(tris.begin(), tris.end(), [&](int t) { return !tri_alive_[t]; }), tris.end());
+
+	vector<int> around;
+	neighbors(c.to, around);
+	for (int w : around)
+		heap_.push(plan(w, c.to));
+}
+
+void Simplifier::simplify(int target) {
+	while (num_triangles_ > target && !heap_.empty()) {
+		Collapse c = heap_.top();
+		heap_.pop();
+		if (!vertex_alive_[c.from] || !vertex_alive_[c.to] ||
+			stamps_[c.from] != c.from_stamp || stamps_[c.to] != c.to_stamp)
+			continue;
+		if (isValid(c))
+			apply(c);
+	}
+}
+
+void Simplifier::extract(SkinLodLevel& level) const {
+	vector<int> remap(vertices_.size(), -1);
+	level.vertices.clear();
+	level.indices.clear();
+	level.error = 0.0f;
+	for (size_t t = 0; t < tri_alive_.size(); ++t) {
+		if (!tri_alive_[t])
+			continue;
+		for (int k = 0; k < 3; ++k) {
+			U32 v = indices_[3 * t + k];
+			if (remap[v] < 0) {
+				remap[v] = int(level.vertices.size());
+				level.vertices.push_back(vertices_[v]);
+			}
+			level.indices.push_back(U32(remap[v]));
+		}
+	}
+
+	// The error is how far the vertices of the full mesh are from the surface near
+	// the vertex they were merged into: the triangles within two edges of it. Every
+	// vertex of the full mesh is measured; should the one it was merged into have
+	// no triangles left, against the whole level.
+	vector<int> around, tris;
+	for (size_t v = 0; v < vertices_.size(); ++v) {
+		if (merged_[v].empty())
+			continue;
+		neighbors(int(v), around);
+		around.push_back(int(v));
+		tris.clear();
+		for (int w : around)
+			for (int t : vertex_tris_[w])
+				if (tri_alive_[t])
+					tris.push_back(t);
+		if (tris.empty())
+			for (size_t t = 0; t < tri_alive_.size(); ++t)
+				if (tri_alive_[t])
+					tris.push_back(int(t));
+		sort(tris.begin(), tris.end());
+		tris.erase(unique(tris.begin(), tris.end()), tris.end());
+		for (int o : merged_[v]) {
+			float d = FLT_MAX;
+			for (int t : tris)
+				d = FW::min(d, pointTriangleDistance(original_[o], vertices_[indices_[3 * t]].position,
+					vertices_[indices_[3 * t + 1]].position, vertices_[indices_[3 * t + 2]].position));
+			level.error = FW::max(level.error, d);
+		}
+	}
+}
+
+} // namespace
+
+void buildSkinLods(const vector<WeightedVertex>& vertices, const vector<U32>& indices,
+				   vector<SkinLodLevel>& levels, int max_levels, float ratio) {
+	assert(indices.size() % 3 == 0);
+	assert(ratio > 0.0f && ratio < 1.0f);
+
+	// One simplification runs through all levels, so the error of each level is
+	// measured against the full mesh.
+	Simplifier mesh(vertices, indices);
+	float error = 0.0f;
+	for (int i = 0; i < max_levels; ++i) {
+		int before = mesh.numTriangles();
+		int target = int(before * ratio);
+		if (target < MIN_LOD_TRIANGLES)
+			break;
+		mesh.simplify(target);
+		if (mesh.numTriangles() > int(before * (1.0f - MIN_LOD_REDUCTION)))
+			break;
+		levels.emplace_back();
+		mesh.extract(levels.back());
+
+		// The error near each vertex only bounds the distance to the whole level, so
+		// a coarser level could measure less; selectSkinLod() needs them increasing.
+		error = levels.back().error = FW::max(levels.back().error, error);
+	}
+}
+
+int selectSkinLod(const float* errors, int count, float distance, float pixels_per_unit, float max_pixels) {
+	float pixels_per_error = pixels_per_unit / FW::max(distance, 1e-6f);
+	int level = 0;
+	while (level + 1 < count && errors[level + 1] * pixels_per_error <= max_pixels)
+		++level;
+	return level;
+}
+
+} // namespace FW
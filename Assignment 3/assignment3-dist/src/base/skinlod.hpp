@@ -0,0 +1,51 @@
+#pragma once
+
+#include "skinning.hpp"
+
+#include <vector>
+
+namespace FW {
+
+// Coarser levels built by buildSkinLods(), at most.
+static const int SKIN_LOD_LEVELS = 3;
+
+// Each level keeps about this fraction of the triangles of the one before.
+static const float SKIN_LOD_RATIO = 0.5f;
+
+// A level is used while its error covers at most this many pixels on screen.
+static const float SKIN_LOD_PIXEL_ERROR = 1.0f;
+
+// A simplified version of a skinned mesh.
+struct SkinLodLevel
+{
+	std::vector<WeightedVertex>	vertices;
+	std::vector<U32>			indices;	// three per triangle
+	float						error;		// no vertex of the full mesh is farther from the level's surface, in world units
+};
+
+// Simplify an indexed skinned mesh by quadric error edge collapses (Garland and
+// Heckbert 1997) and append the coarser levels to levels, from finest to coarsest.
+//
+// A collapse moves the two vertices of an edge to whichever of the endpoints and
+// the midpoint has the least quadric error, and the joint weights, normal and color
+// of the merged vertex are blended the same way, so each level deforms like the full
+// mesh. Edges between vertices with different weights cost more to collapse, which
+// keeps the detail around the joints where the skin bends. Collapses that would flip
+// a triangle, make the mesh non-manifold or leave a vertex without triangles are
+// skipped, and open edges are held in place. Vertices at the same position are
+// welded first, so seams in the normals or weights do not open. The merged weights may have more than SKIN_INFLUENCES influences; run
+// pruneSkinWeights() on each level before packing it.
+//
+// The errors of the levels never decrease, and the chain stops early when the mesh
+// cannot be simplified further.
+void						buildSkinLods		(const std::vector<WeightedVertex>& vertices, const std::vector<U32>& indices,
+												 std::vector<SkinLodLevel>& levels,
+												 int max_levels = SKIN_LOD_LEVELS, float ratio = SKIN_LOD_RATIO);
+
+// The coarsest of count levels with the given errors (increasing) whose error, seen
+// from distance, covers at most max_pixels. pixels_per_unit is the size on screen
+// of one world unit at distance one, i.e. P(0,0) * viewport width / 2.
+int							selectSkinLod		(const float* errors, int count, float distance, float pixels_per_unit,
+												 float max_pixels = SKIN_LOD_PIXEL_ERROR);
+
+} // namespace FW
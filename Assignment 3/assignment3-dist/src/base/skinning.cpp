@@ -0,0 +1,319 @@
+#include "skinning.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+
+#include <xmmintrin.h>
+
+using namespace std;
+
+namespace FW {
+
+namespace {
+
+// Vertices per thread below which splitting the work does not pay off.
+const int MIN_VERTICES_PER_THREAD = 8192;
+
+// Identity of a corner for indexWeightedMesh(): position, normal, joints and weights.
+// The normal is rounded so that corners whose normals differ by float noise still merge,
+// and zeros are made positive so that -0.0f and 0.0f compare equal as bytes.
+struct CornerKey
+{
+	CornerKey(const WeightedVertex& v, bool with_normal)
+	{
+		memset(this, 0, sizeof(*this));
+		for (int i = 0; i < 3; ++i) {
+			position[i] = v.position[i] + 0.0f;
+			if (with_normal)
+				normal[i] = int(FW::floor(v.normal[i] * 32767.0f + 0.5f));
+		}
+		memcpy(joints, v.joints, sizeof(joints));
+		for (auto k = 0u; k < WEIGHTS_PER_VERTEX; ++k)
+			weights[k] = v.weights[k] + 0.0f;
+	}
+
+	bool operator==(const CornerKey& o) const { return memcmp(this, &o, sizeof(*this)) == 0; }
+
+	float	position[3];
+	int		normal[3];
+	int		joints[WEIGHTS_PER_VERTEX];
+	float	weights[WEIGHTS_PER_VERTEX];
+};
+
+// Round weights that sum to about one to 16-bit fixed point so that they sum to exactly
+// 65535. The rounding residue goes to the heaviest weight, where it matters least.
+void quantizeWeights(const float* weights, int n, U16* out)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < n; ++i)
+		sum += weights[i];
+	int total = 0, heaviest = 0;
+	for (int i = 0; i < n; ++i) {
+		out[i] = U16(FW::clamp(int(weights[i] / sum * 65535.0f + 0.5f), 0, 65535));
+		total += out[i];
+		if (weights[i] > weights[heaviest])
+			heaviest = i;
+	}
+	if (n > 0)
+		out[heaviest] = U16(out[heaviest] + 65535 - total);
+}
+
+// Signed normalized 10-bit components, as read for GL_INT_2_10_10_10_REV.
+U32 packNormal(const Vec3f& n)
+{
+	U32 r = 0;
+	for (int i = 0; i < 3; ++i)
+		r |= (U32(FW::clamp(int(FW::floor(n[i] * 511.0f + 0.5f)), -511, 511)) & 0x3FFu) << (10 * i);
+	return r;
+}
+
+struct CornerKeyHash
+{
+	size_t operator()(const CornerKey& k) const
+	{
+		// FNV-1a over the raw bytes; the keys are zero-filled, so padding is deterministic.
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(&k);
+		U64 h = 14695981039346656037ull;
+		for (size_t i = 0; i < sizeof(k); ++i)
+			h = (h ^ p[i]) * 1099511628211ull;
+		return size_t(h);
+	}
+};
+
+} // namespace
+
+void indexWeightedMesh(const vector<WeightedVertex>& corners, vector<WeightedVertex>& vertices, vector<U32>& indices, bool smooth_normals) {
+	assert(corners.size() % 3 == 0 && "expected a triangle list");
+
+	unordered_map<CornerKey, U32, CornerKeyHash> unique;
+	unique.reserve(corners.size() / 4);
+	vertices.clear();
+	indices.clear();
+	indices.reserve(corners.size());
+
+	for (const auto& c : corners) {
+		auto it = unique.emplace(CornerKey(c, !smooth_normals), U32(vertices.size()));
+		if (it.second)
+			vertices.push_back(c);
+		indices.push_back(it.first->second);
+	}
+	if (!smooth_normals)
+		return;
+
+	// The cross product is twice the triangle's area, which weights the average.
+	vector<Vec3f> normals(vertices.size(), Vec3f(0.0f));
+	for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+		const Vec3f& p0 = vertices[indices[t]].position;
+		Vec3f n = cross(vertices[indices[t + 1]].position - p0, vertices[indices[t + 2]].position - p0);
+		for (int k = 0; k < 3; ++k)
+			normals[indices[t + k]] += n;
+	}
+	// Vertices of degenerate triangles only keep the normal they were loaded with.
+	for (size_t i = 0; i < vertices.size(); ++i)
+		if (normals[i].lenSqr() > 0.0f)
+			vertices[i].normal = normals[i].normalized();
+}
+
+SkinWeightStats pruneSkinWeights(vector<WeightedVertex>& vertices, int max_influences, float min_weight) {
+	assert(max_influences >= 1 && max_influences <= int(WEIGHTS_PER_VERTEX));
+
+	SkinWeightStats stats = { int(vertices.size()), 0, 0, 0.0f, 0.0f };
+	double total_error = 0.0;
+	for (auto& v : vertices) {
+		// Gather the influences, heaviest first.
+		int order[WEIGHTS_PER_VERTEX];
+		int n = 0;
+		for (auto k = 0u; k < WEIGHTS_PER_VERTEX; ++k)
+			if (v.weights[k] != 0.0f)
+				order[n++] = int(k);
+		sort(order, order + n, [&](int a, int b) { return v.weights[a] > v.weights[b]; });
+		stats.influences_before += n;
+
+		int kept = 0;
+		while (kept < FW::min(n, max_influences) && (kept == 0 || v.weights[order[kept]] >= min_weight))
+			++kept;
+
+		int joints[WEIGHTS_PER_VERTEX] = {};
+		float weights[WEIGHTS_PER_VERTEX] = {};
+		U16 quantized[WEIGHTS_PER_VERTEX];
+		for (int i = 0; i < kept; ++i) {
+			joints[i] = v.joints[order[i]];
+			weights[i] = v.weights[order[i]];
+		}
+		quantizeWeights(weights, kept, quantized);
+		for (int i = 0; i < kept; ++i)
+			weights[i] = quantized[i] * (1.0f / 65535.0f);
+
+		// The error counts the dropped weights and the change of the kept ones.
+		float error = 0.0f;
+		for (int i = 0; i < n; ++i)
+			error += FW::abs((i < kept ? weights[i] : 0.0f) - v.weights[order[i]]);
+		stats.max_error = FW::max(stats.max_error, error);
+		total_error += error;
+		stats.influences_after += kept;
+
+		memcpy(v.joints, joints, sizeof(joints));
+		memcpy(v.weights, weights, sizeof(weights));
+	}
+	stats.mean_error = vertices.empty() ? 0.0f : float(total_error / vertices.size());
+	return stats;
+}
+
+void packSkinVertices(const vector<WeightedVertex>& vertices, vector<PackedSkinVertex>& packed) {
+	packed.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		const WeightedVertex& v = vertices[i];
+		PackedSkinVertex& p = packed[i];
+		p.position = v.position;
+		p.normal = packNormal(v.normal);
+		for (int c = 0; c < 3; ++c)
+			p.color[c] = U8(FW::clamp(int(v.color[c] * 255.0f + 0.5f), 0, 255));
+		p.color[3] = 255;
+
+		// After pruning the influences are in the first slots, and the rest are zero.
+		int n = 0;
+		while (n < SKIN_INFLUENCES && v.weights[n] != 0.0f)
+			++n;
+		for (auto k = unsigned(n); k < WEIGHTS_PER_VERTEX; ++k)
+			assert(v.weights[k] == 0.0f && "call pruneSkinWeights() first");
+		quantizeWeights(v.weights, n, p.weights);
+		for (int k = 0; k < SKIN_INFLUENCES; ++k) {
+			assert(k >= n || (0 <= v.joints[k] && v.joints[k] < MAX_SKIN_JOINTS));
+			p.joints[k] = U16(k < n ? v.joints[k] : 0);
+			if (k >= n)
+				p.weights[k] = 0;
+		}
+	}
+}
+
+void SkinnedMesh::build(const vector<WeightedVertex>& vertices) {
+	num_vertices_ = int(vertices.size());
+
+	// Padded by three so that four floats can be loaded starting from any vertex.
+	size_t padded = vertices.size() + 3;
+	for (auto* a : { &px_, &py_, &pz_, &nx_, &ny_, &nz_ })
+		a->assign(padded, 0.0f);
+	colors_.resize(vertices.size());
+
+	first_influence_.clear();
+	influences_.clear();
+	first_influence_.reserve(vertices.size() + 1);
+
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		const WeightedVertex& v = vertices[i];
+		px_[i] = v.position.x; py_[i] = v.position.y; pz_[i] = v.position.z;
+		nx_[i] = v.normal.x;   ny_[i] = v.normal.y;   nz_[i] = v.normal.z;
+		colors_[i] = v.color;
+
+		first_influence_.push_back(int(influences_.size()));
+		int joints[WEIGHTS_PER_VERTEX];
+		float weights[WEIGHTS_PER_VERTEX];
+		U16 quantized[WEIGHTS_PER_VERTEX];
+		int n = 0;
+		for (auto k = 0u; k < WEIGHTS_PER_VERTEX; ++k) {
+			if (v.weights[k] == 0.0f)
+				continue;
+			assert(0 <= v.joints[k] && v.joints[k] < 65536);
+			joints[n] = v.joints[k];
+			weights[n++] = v.weights[k];
+		}
+		quantizeWeights(weights, n, quantized);
+		for (int k = 0; k < n; ++k) {
+			Influence inf = { U16(joints[k]), quantized[k] };
+			influences_.push_back(inf);
+		}
+	}
+	first_influence_.push_back(int(influences_.size()));
+}
+
+void packJointMatrices(const Mat4f* transforms, size_t count, float* out) {
+	for (size_t j = 0; j < count; ++j, out += JOINT_MATRIX_FLOATS)
+		for (int r = 0; r < 3; ++r)
+			for (int c = 0; c < 4; ++c)
+				out[4 * r + c] = transforms[j](r, c);
+}
+
+void SkinnedMesh::setPalette(const vector<Mat4f>& transforms) {
+	// The vector keeps its capacity, so this only allocates when joints are added.
+	palette_.resize(JOINT_MATRIX_FLOATS * transforms.size());
+	packJointMatrices(transforms.data(), transforms.size(), palette_.data());
+}
+
+void SkinnedMesh::skin(const vector<Mat4f>& transforms, Vertex* out, int begin, int end) {
+	setPalette(transforms);
+	skinRange(out, begin, end);
+}
+
+void SkinnedMesh::skin(const vector<Mat4f>& transforms, Vertex* out, ThreadPool& pool) {
+	setPalette(transforms);
+	pool.parallelFor(num_vertices_, MIN_VERTICES_PER_THREAD, [this, out](int begin, int end) {
+		skinRange(out, begin, end);
+	});
+}
+
+void SkinnedMesh::skinRange(Vertex* out, int begin, int end) const {
+	const float* rows = palette_.data();
+	size_t num_rows = palette_.size();
+	(void)num_rows; // only used in asserts
+
+	for (int base = begin; base < end; base += 4) {
+		int count = FW::min(4, end - base);
+
+		// Blend the joint matrices of four vertices. m[k][r] is row r of vertex k's matrix.
+		__m128 m[4][3];
+		for (int k = 0; k < 4; ++k) {
+			__m128 r0 = _mm_setzero_ps(), r1 = _mm_setzero_ps(), r2 = _mm_setzero_ps();
+			if (k < count) {
+				int v = base + k;
+				for (int i = first_influence_[v]; i < first_influence_[v + 1]; ++i) {
+					const Influence& inf = influences_[i];
+					const float* M = rows + JOINT_MATRIX_FLOATS * inf.joint;
+					assert(size_t(JOINT_MATRIX_FLOATS * (inf.joint + 1)) <= num_rows && "joint index out of range");
+					__m128 w = _mm_set1_ps(inf.weight * (1.0f / 65535.0f));
+					r0 = _mm_add_ps(r0, _mm_mul_ps(w, _mm_loadu_ps(M + 0)));
+					r1 = _mm_add_ps(r1, _mm_mul_ps(w, _mm_loadu_ps(M + 4)));
+					r2 = _mm_add_ps(r2, _mm_mul_ps(w, _mm_loadu_ps(M + 8)));
+				}
+			}
+			m[k][0] = r0;
+			m[k][1] = r1;
+			m[k][2] = r2;
+		}
+
+		// Transpose to structure-of-arrays: e[r][c] holds element (r, c) of all four matrices.
+		__m128 e[3][4];
+		for (int r = 0; r < 3; ++r) {
+			__m128 c0 = m[0][r], c1 = m[1][r], c2 = m[2][r], c3 = m[3][r];
+			_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+			e[r][0] = c0;
+			e[r][1] = c1;
+			e[r][2] = c2;
+			e[r][3] = c3;
+		}
+
+		__m128 x = _mm_loadu_ps(&px_[base]), y = _mm_loadu_ps(&py_[base]), z = _mm_loadu_ps(&pz_[base]);
+		__m128 nx = _mm_loadu_ps(&nx_[base]), ny = _mm_loadu_ps(&ny_[base]), nz = _mm_loadu_ps(&nz_[base]);
+
+		alignas(16) float p[3][4];
+		alignas(16) float n[3][4];
+		for (int r = 0; r < 3; ++r) {
+			__m128 pr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[r][0], x), _mm_mul_ps(e[r][1], y)),
+			                       _mm_add_ps(_mm_mul_ps(e[r][2], z), e[r][3]));
+			__m128 nr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[r][0], nx), _mm_mul_ps(e[r][1], ny)),
+			                       _mm_mul_ps(e[r][2], nz));
+			_mm_store_ps(p[r], pr);
+			_mm_store_ps(n[r], nr);
+		}
+
+		for (int k = 0; k < count; ++k) {
+			Vertex& v = out[base + k];
+			v.position = Vec3f(p[0][k], p[1][k], p[2][k]);
+			v.normal = Vec3f(n[0][k], n[1][k], n[2][k]);
+			v.color = colors_[base + k];
+		}
+	}
+}
+
+} // namespace FW
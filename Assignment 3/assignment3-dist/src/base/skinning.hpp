@@ -0,0 +1,133 @@
+#pragma once
+
+#include "skeleton.hpp"
+#include "parallel.hpp"
+
+#include <base/Math.hpp>
+
+#include <vector>
+
+namespace FW {
+
+struct Vertex
+{
+	Vec3f position;
+	Vec3f normal;
+	Vec3f color;
+};
+
+struct WeightedVertex
+{
+	Vec3f	position;
+	Vec3f	normal;
+	Vec3f	color;
+	int		joints[WEIGHTS_PER_VERTEX];
+	float	weights[WEIGHTS_PER_VERTEX];
+};
+
+// Influences kept per vertex after pruneSkinWeights().
+static const int SKIN_INFLUENCES = 4;
+
+// Joints a skinned mesh may reference; PackedSkinVertex stores joint indices in 16 bits.
+// The GPU path also needs three texels per joint (and crowd instance) in the palette
+// texture buffer, whose size GL only guarantees to be 65536 texels; App draws fewer
+// crowd instances when GL_MAX_TEXTURE_BUFFER_SIZE cannot hold them all.
+static const int MAX_SKIN_JOINTS = 65536;
+
+// Floats per matrix in a joint palette, for the CPU kernel and the shaders alike:
+// the top three rows of the affine transform, row by row. The last row is always
+// (0, 0, 0, 1) and is left out.
+static const int JOINT_MATRIX_FLOATS = 12;
+
+// Write count transforms to out in the palette layout.
+void						packJointMatrices	(const Mat4f* transforms, size_t count, float* out);
+
+// Vertex format of the GPU skinning path, 36 bytes against the 100 of a WeightedVertex.
+struct PackedSkinVertex
+{
+	Vec3f	position;
+	U32		normal;						// GL_INT_2_10_10_10_REV, signed normalized
+	U8		color[4];					// unsigned normalized
+	U16		joints[SKIN_INFLUENCES];
+	U16		weights[SKIN_INFLUENCES];	// unsigned normalized, sum to exactly 65535
+};
+
+// Weight error introduced by pruneSkinWeights(), as the sum of absolute weight
+// changes of a vertex.
+struct SkinWeightStats
+{
+	int		num_vertices;
+	int		influences_before;
+	int		influences_after;
+	float	max_error;
+	float	mean_error;
+};
+
+// Keep at most max_influences influences per vertex, drop those lighter than
+// min_weight (but always keep the heaviest one), renormalize, and round the weights
+// to the 16-bit fixed point that both skinning paths use.
+SkinWeightStats				pruneSkinWeights	(std::vector<WeightedVertex>& vertices, int max_influences = SKIN_INFLUENCES, float min_weight = 1.0f / 256.0f);
+
+// Convert pruned vertices to the GPU format. The joint indices must be below
+// MAX_SKIN_JOINTS, which the loaders check.
+void						packSkinVertices	(const std::vector<WeightedVertex>& vertices, std::vector<PackedSkinVertex>& packed);
+
+// Turn a triangle soup with one WeightedVertex per corner into unique vertices and
+// an index buffer, so each vertex is skinned and uploaded only once. Corners are merged
+// when they have the same position, normal, joints and weights, which keeps the loaded
+// normals and thus hard edges. With smooth_normals, corners are merged regardless of
+// their normals, and each merged vertex gets the area-weighted average of the normals
+// of the triangles around it instead.
+void						indexWeightedMesh	(const std::vector<WeightedVertex>& corners, std::vector<WeightedVertex>& vertices, std::vector<U32>& indices,
+												 bool smooth_normals = false);
+
+// Skinning input laid out for the CPU skinning kernel.
+//
+// Positions and normals are stored as separate x, y and z arrays so that four
+// vertices can be transformed at once with SSE. The influences are packed
+// CSR-style as 16-bit (joint, weight) pairs: the zero weights are dropped, and
+// the influences of vertex i are [first_influence_[i], first_influence_[i+1]). For each vertex the kernel first
+// blends the 3x4 joint matrices by the weights and then transforms the position
+// and the normal once with the blended matrix. The 3x4 matrices are kept between
+// calls, so skinning a frame does not allocate.
+class SkinnedMesh
+{
+public:
+	void					build			(const std::vector<WeightedVertex>& vertices);
+
+	int						numVertices		(void) const { return num_vertices_; }
+	int						numInfluences	(void) const { return int(influences_.size()); }
+
+	// Skin vertices [begin, end) with the SSD transforms T_i * inv(B_i) and
+	// write them to out[begin] ... out[end-1]. out may point to mapped GPU memory;
+	// it is only written, never read.
+	void					skin			(const std::vector<Mat4f>& transforms, Vertex* out, int begin, int end);
+
+	// Skin all vertices, splitting the work across the threads of the pool.
+	void					skin			(const std::vector<Mat4f>& transforms, Vertex* out, ThreadPool& pool);
+
+private:
+	struct Influence
+	{
+		U16					joint;
+		U16					weight;		// unsigned normalized
+	};
+
+	void					setPalette		(const std::vector<Mat4f>& transforms);
+	void					skinRange		(Vertex* out, int begin, int end) const;
+
+	int						num_vertices_ = 0;
+
+	// Three zeros of slack at the end, so that the unaligned four-float load of the
+	// last vertices stays in bounds.
+	std::vector<float>		px_, py_, pz_;
+	std::vector<float>		nx_, ny_, nz_;
+	std::vector<Vec3f>		colors_;
+
+	std::vector<int>		first_influence_;
+	std::vector<Influence>	influences_;
+
+	std::vector<float>		palette_;		// the SSD transforms as 3x4 row-major matrices
+};
+
+} // namespace FW
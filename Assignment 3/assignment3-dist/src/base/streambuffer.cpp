@@ -0,0 +1,76 @@
+#include "streambuffer.hpp"
+
+#include "gpu/GLContext.hpp"
+
+namespace FW {
+
+namespace {
+
+// How long one wait for the GPU may block before it is retried, in nanoseconds.
+const GLuint64 FENCE_TIMEOUT = 100000000;
+
+} // namespace
+
+StreamBuffer::StreamBuffer(void)
+:	target_			(GL_ARRAY_BUFFER),
+	buffer_			(0),
+	region_bytes_	(0),
+	region_			(REGIONS - 1)
+{
+	for (auto& f : fences_)
+		f = nullptr;
+}
+
+void StreamBuffer::init(GLenum target, size_t region_bytes) {
+	for (auto& f : fences_) {
+		if (f)
+			glDeleteSync(f);
+		f = nullptr;
+	}
+	if (!buffer_)
+		glGenBuffers(1, &buffer_);
+
+	target_ = target;
+	region_bytes_ = region_bytes;
+	region_ = REGIONS - 1;
+	glBindBuffer(target_, buffer_);
+	glBufferData(target_, GLsizeiptr(REGIONS * region_bytes_), nullptr, GL_STREAM_DRAW);
+	glBindBuffer(target_, 0);
+}
+
+void* StreamBuffer::map(void) {
+	if (region_bytes_ == 0)
+		return nullptr;
+
+	// The GPU normally finished with this region two frames ago, and then the
+	// fence is already signaled.
+	region_ = (region_ + 1) % REGIONS;
+	if (GLsync f = fences_[region_]) {
+		while (glClientWaitSync(f, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(f);
+		fences_[region_] = nullptr;
+	}
+
+	glBindBuffer(target_, buffer_);
+	void* ptr = glMapBufferRange(target_, GLintptr(offset()), GLsizeiptr(region_bytes_),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	glBindBuffer(target_, 0);
+	return ptr;
+}
+
+void StreamBuffer::unmap(void) {
+	glBindBuffer(target_, buffer_);
+	glUnmapBuffer(target_);
+	glBindBuffer(target_, 0);
+}
+
+void StreamBuffer::fence(void) {
+	if (region_bytes_ == 0)
+		return;
+	if (fences_[region_])
+		glDeleteSync(fences_[region_]);
+	fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+} // namespace FW
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "base/DLLImports.hpp"
+
+#include <cstddef>
+
+namespace FW {
+
+// A GL buffer for data that the CPU rewrites every frame and the GPU reads once.
+//
+// The storage is allocated once, with room for REGIONS frames, and each frame
+// writes the next region through an unsynchronized mapping. A fence placed after
+// the draws that read a region keeps the region from being written again before
+// the GPU is done with it, so in the steady state neither mapping nor drawing
+// waits for the GPU, and the driver never has to reallocate the storage.
+//
+// Per frame: map() the region, fill it, unmap(), draw from offset(), then fence().
+class StreamBuffer
+{
+public:
+	static const int		REGIONS = 3;
+
+							StreamBuffer	(void);
+
+	// Allocate the buffer for region_bytes per frame. Needs a current GL context.
+	void					init			(GLenum target, size_t region_bytes);
+
+	GLuint					getHandle		(void) const { return buffer_; }
+	size_t					regionBytes		(void) const { return region_bytes_; }
+
+	// Move to the next region and map it for writing. Returns nullptr if the buffer
+	// is empty.
+	void*					map				(void);
+	void					unmap			(void);
+
+	// Byte offset of the region that was last mapped.
+	size_t					offset			(void) const { return size_t(region_) * region_bytes_; }
+
+	// Call after the draws that read the region that was last mapped.
+	void					fence			(void);
+
+private:
+							StreamBuffer	(const StreamBuffer&); // forbid copy
+	StreamBuffer&			operator=		(const StreamBuffer&); // forbid assignment
+
+	GLenum					target_;
+	GLuint					buffer_;
+	size_t					region_bytes_;
+	int						region_;
+	GLsync					fences_[REGIONS];
+};
+
+} // namespace FW
@@ -148,6 +148,8 @@ typedef char            GLchar;
 typedef ptrdiff_t       GLintptr;
 typedef ptrdiff_t       GLsizeiptr;
 typedef unsigned int    GLhandleARB;
+typedef struct __GLsync* GLsync;
+typedef FW::U64         GLuint64;
 
 #define GL_ALPHA32F_ARB                     0x8816
 #define GL_ARRAY_BUFFER                     0x8892
@@ -167,8 +169,13 @@ typedef unsigned int    GLhandleARB;
 #define GL_GEOMETRY_SHADER_ARB              0x8DD9
 #define GL_GEOMETRY_VERTICES_OUT_ARB        0x8DDA
 #define GL_INFO_LOG_LENGTH                  0x8B84
+#define GL_INT_2_10_10_10_REV               0x8D9F
 #define GL_INVALID_FRAMEBUFFER_OPERATION    0x0506
 #define GL_LINK_STATUS                      0x8B82
+#define GL_MAP_INVALIDATE_RANGE_BIT         0x0004
+#define GL_MAP_UNSYNCHRONIZED_BIT           0x0020
+#define GL_MAP_WRITE_BIT                    0x0002
+#define GL_MAX_TEXTURE_BUFFER_SIZE          0x8C2B
 #define GL_PIXEL_PACK_BUFFER                0x88EB
 #define GL_PIXEL_UNPACK_BUFFER              0x88EC
 #define GL_RENDERBUFFER                     0x8D41
@@ -177,13 +184,18 @@ typedef unsigned int    GLhandleARB;
 #define GL_RGBA32UI                         0x8D70
 #define GL_RGBA_INTEGER                     0x8D99
 #define GL_STATIC_DRAW                      0x88E4
+#define GL_SYNC_FLUSH_COMMANDS_BIT          0x00000001
+#define GL_SYNC_GPU_COMMANDS_COMPLETE       0x9117
+#define GL_STREAM_DRAW                      0x88E0
 #define GL_DYNAMIC_COPY                     0x88EA
 #define GL_TEXTURE0                         0x84C0
 #define GL_TEXTURE1                         0x84C1
 #define GL_TEXTURE2                         0x84C2
 #define GL_TEXTURE_3D                       0x806F
+#define GL_TEXTURE_BUFFER                   0x8C2A
 #define GL_TEXTURE_CUBE_MAP                 0x8513
 #define GL_TEXTURE_CUBE_MAP_POSITIVE_X      0x8515
+#define GL_TIMEOUT_EXPIRED                  0x911B
 #define GL_UNSIGNED_SHORT_5_5_5_1           0x8034
 #define GL_UNSIGNED_SHORT_5_6_5             0x8363
 #define GL_VERTEX_SHADER                    0x8B31
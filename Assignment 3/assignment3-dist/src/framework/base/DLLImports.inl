@@ -379,6 +379,7 @@ FW_DLL_DECLARE_VOID(void,       APIENTRY,   glBindRenderbuffer,
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glBlendEquation,                        (GLenum mode), (mode))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glBufferData,                           (GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage), (target, size, data, usage))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glBufferSubData,                        (GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid* data), (target, offset, size, data))
+FW_DLL_DECLARE_RETV(GLenum,     APIENTRY,   glClientWaitSync,                       (GLsync sync, GLbitfield flags, GLuint64 timeout), (sync, flags, timeout))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glCompileShader,                        (GLuint shader), (shader))
 FW_DLL_DECLARE_RETV(GLuint,     APIENTRY,   glCreateProgram,                        (void), ())
 FW_DLL_DECLARE_RETV(GLuint,     APIENTRY,   glCreateShader,                         (GLenum type), (type))
@@ -387,9 +388,14 @@ FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDeleteFramebuffers,
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDeleteProgram,                        (GLuint program), (program))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDeleteRenderbuffers,                  (GLsizei n, const GLuint* renderbuffers), (n, renderbuffers))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDeleteShader,                         (GLuint shader), (shader))
+FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDeleteSync,                           (GLsync sync), (sync))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDisableVertexAttribArray,             (GLuint v), (v))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDrawBuffers,                          (GLsizei n, const GLenum* bufs), (n, bufs))
+FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDrawElementsBaseVertex,               (GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLint basevertex), (mode, count, type, indices, basevertex))
+FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDrawElementsInstanced,                (GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLsizei instancecount), (mode, count, type, indices, instancecount))
+FW_DLL_DECLARE_VOID(void,       APIENTRY,   glDrawElementsInstancedBaseVertex,      (GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLsizei instancecount, GLint basevertex), (mode, count, type, indices, instancecount, basevertex))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glEnableVertexAttribArray,              (GLuint v), (v))
+FW_DLL_DECLARE_RETV(GLsync,     APIENTRY,   glFenceSync,                            (GLenum condition, GLbitfield flags), (condition, flags))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glFramebufferRenderbuffer,              (GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer), (target, attachment, renderbuffertarget, renderbuffer))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glFramebufferTexture2D,                 (GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level), (target, attachment, textarget, texture, level))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glGenBuffers,                           (GLsizei n, GLuint* buffers), (n, buffers))
@@ -404,9 +410,11 @@ FW_DLL_DECLARE_VOID(void,       APIENTRY,   glGetShaderInfoLog,
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glGetShaderiv,                          (GLuint shader, GLenum pname, GLint* param), (shader, pname, param))
 FW_DLL_DECLARE_RETV(GLint,      APIENTRY,   glGetUniformLocation,                   (GLuint program, const GLchar* name), (program, name))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glLinkProgram,                          (GLhandleARB programObj), (programObj))
+FW_DLL_DECLARE_RETV(GLvoid*,    APIENTRY,   glMapBufferRange,                       (GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access), (target, offset, length, access))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glProgramParameteriARB,                 (GLuint program, GLenum pname, GLint value), (program, pname, value))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glRenderbufferStorage,                  (GLenum target, GLenum internalformat, GLsizei width, GLsizei height), (target, internalformat, width, height))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glShaderSource,                         (GLuint shader, GLsizei count, const GLchar** strings, const GLint* lengths), (shader, count, strings, lengths))
+FW_DLL_DECLARE_VOID(void,       APIENTRY,   glTexBuffer,                            (GLenum target, GLenum internalformat, GLuint buffer), (target, internalformat, buffer))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glTexImage3D,                           (GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const GLvoid* pixels), (target, level, internalFormat, width, height, depth, border, format, type, pixels))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUniform1f,                            (GLint location, GLfloat v0), (location, v0))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUniform1fv,                           (GLint location, GLsizei count, const GLfloat* value), (location, count, value))
@@ -419,6 +427,7 @@ FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUniform4fv,
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUniformMatrix2fv,                     (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value), (location, count, transpose, value))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUniformMatrix3fv,                     (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value), (location, count, transpose, value))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUniformMatrix4fv,                     (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value), (location, count, transpose, value))
+FW_DLL_DECLARE_RETV(GLboolean,  APIENTRY,   glUnmapBuffer,                          (GLenum target), (target))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glUseProgram,                           (GLuint program), (program))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glVertexAttrib2f,                       (GLuint index, GLfloat x, GLfloat y), (index, x, y))
 FW_DLL_DECLARE_VOID(void,       APIENTRY,   glVertexAttrib3f,                       (GLuint index, GLfloat x, GLfloat y, GLfloat z), (index, x, y, z))
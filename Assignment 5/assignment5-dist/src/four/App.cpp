@@ -242,6 +242,8 @@ Args App::get_args() {
 	args.sampling_pattern = (Args::SamplePatternType)sampler_type_;
 	args.num_samples = sample_count_;
 	args.output_file = "debug.png";
+	args.stream_rows = 0;
+	args.paged_cache_mb = 0;
 	args.depth_min = .0f;
 	args.depth_max = 1000.0f;
 	args.show_progress = true;
@@ -13,9 +13,13 @@ Args::Args(const vector<string>& args) :
 	output_file(""),
 	depth_file(""),
 	normals_file(""),
+	pfm_file(""),
 	width(100),
 	height(100),
 	stats(false),
+	stream_rows(0),
+	sequence_file(""),
+	sequence_frames(0),
 
 	// rendering options
 	depth_min(0),
@@ -25,6 +29,8 @@ Args::Args(const vector<string>& args) :
 	transparent_shadows(false),
 	shadows(false),
 	shade_back(false),
+	bvh_layout(BVH_Compressed),
+	paged_cache_mb(0),
 
 	// sampling
 	num_samples(1),
@@ -61,8 +67,15 @@ void Args::parse(const vector<string>& args) {
 		} else if (*it == "-size") {
 			width = stoi(*++it);
 			height = stoi(*++it);
+		} else if (*it == "-pfm") {
+			pfm_file = *++it;
 		} else if (*it == "-stats") {
 			stats = true;
+		} else if (*it == "-stream") {
+			stream_rows = stoi(*++it);
+		} else if (*it == "-sequence") {
+			sequence_file = *++it;
+			sequence_frames = stoi(*++it);
 		}
 		// Rendering options
 		else if (*it == "-depth") {
@@ -83,6 +96,20 @@ void Args::parse(const vector<string>& args) {
 		} else if (*it == "-uv") {
 			display_uv = true;
 		}
+		// Acceleration structure
+		else if (*it == "-bvh") {
+			++it;
+			if (it != end(args) && *it == "binary")
+				bvh_layout = BVH_Binary;
+			else if (it != end(args) && *it == "compressed")
+				bvh_layout = BVH_Compressed;
+			else {
+				::printf("FATAL: Unknown BVH layout '%s', expected binary or compressed!\n", it != end(args) ? it->c_str() : "");
+				exit(1);
+			}
+		} else if (*it == "-paged") {
+			paged_cache_mb = stoi(*++it);
+		}
 		// Supersampling
 		else if (*it == "-uniform_samples") {
 			sampling_pattern = Pattern_Uniform;
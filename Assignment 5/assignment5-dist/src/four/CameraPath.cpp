@@ -0,0 +1,82 @@
+#include "CameraPath.h"
+
+#include "Camera.h"
+
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+Mat3f orthonormalFrame(const Vec3f& direction, const Vec3f& up) {
+	// Same construction as the camera constructors.
+	Vec3f d = direction.normalized();
+	Vec3f h = cross(d, up).normalized();
+	Mat3f result;
+	result.setCol(0, h);
+	result.setCol(1, cross(h, d).normalized());
+	result.setCol(2, d);
+	return result;
+}
+
+} // namespace
+
+CameraPath::CameraPath(const char* filename) {
+	ifstream input(filename);
+	if (!input.is_open()) {
+		cerr << "Could not open camera path " << filename << endl;
+		return;
+	}
+
+	string line;
+	while (getline(input, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		vector<float> v;
+		float f;
+		istringstream iss(line);
+		while (iss >> f)
+			v.push_back(f);
+
+		if (v.size() == 9) {
+			centers_.push_back(Vec3f(v[0], v[1], v[2]));
+			directions_.push_back(Vec3f(v[3], v[4], v[5]));
+			ups_.push_back(Vec3f(v[6], v[7], v[8]));
+		} else if (v.size() == 12) {
+			// rows of [horizontal up direction center]
+			centers_.push_back(Vec3f(v[3], v[7], v[11]));
+			ups_.push_back(Vec3f(v[1], v[5], v[9]));
+			directions_.push_back(Vec3f(v[2], v[6], v[10]));
+		} else if (!v.empty()) {
+			cerr << "Skipping malformed camera path key: " << line << endl;
+		}
+	}
+}
+
+void CameraPath::evaluate(float u, Vec3f& center, Mat3f& orientation) const {
+	assert(numKeys() > 0);
+
+	float x = clamp(u, 0.0f, 1.0f) * (numKeys() - 1);
+	int i = FW::min(int(x), numKeys() - 1);
+	int j = FW::min(i + 1, numKeys() - 1);
+	float a = x - i;
+
+	center = lerp(centers_[i], centers_[j], a);
+	orientation = orthonormalFrame(lerp(directions_[i], directions_[j], a), lerp(ups_[i], ups_[j], a));
+}
+
+void CameraPath::apply(Camera* camera, int frame, int num_frames) const {
+	assert(camera != nullptr);
+
+	Vec3f center;
+	Mat3f orientation;
+	evaluate(num_frames > 1 ? float(frame) / (num_frames - 1) : 0.0f, center, orientation);
+	camera->setCenter(center);
+	camera->setOrientation(orientation);
+}
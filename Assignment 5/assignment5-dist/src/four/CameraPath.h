@@ -0,0 +1,35 @@
+#pragma once
+
+#include "base/Math.hpp"
+
+#include <vector>
+
+class Camera;
+
+// A camera fly-through for rendering frame sequences.
+//
+// The path file holds one key per line; empty lines and lines starting with '#' are skipped.
+// A key is either
+//   cx cy cz  dx dy dz  ux uy uz          (center, direction and up, as in the scene files), or
+//   12 numbers                            (a row-major 3x4 camera-to-world matrix whose columns
+//                                          are horizontal, up, direction and center).
+// Frames are spread evenly along the keys; positions are interpolated linearly and the
+// orientation frame is rebuilt from the interpolated direction and up vectors.
+class CameraPath
+{
+public:
+	CameraPath(const char* filename);
+
+	int numKeys() const { return int(centers_.size()); }
+
+	// Evaluate the path at u in [0,1].
+	void evaluate(float u, FW::Vec3f& center, FW::Mat3f& orientation) const;
+
+	// Move the camera to frame `frame` of a sequence of `num_frames` frames.
+	void apply(Camera* camera, int frame, int num_frames) const;
+
+private:
+	std::vector<FW::Vec3f> centers_;
+	std::vector<FW::Vec3f> directions_;
+	std::vector<FW::Vec3f> ups_;
+};
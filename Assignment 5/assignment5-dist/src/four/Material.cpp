@@ -3,6 +3,8 @@
 #include "lights.hpp"
 #include "VecUtils.h"
 
+#include "base/FastMath.hpp"
+
 using namespace FW;
 
 Vec3f PhongMaterial::shade(const Ray &ray, const Hit &hit, 
@@ -41,7 +43,11 @@ Vec3f PhongMaterial::shade(const Ray &ray, const Hit &hit,
 	rV.normalize();
 	auto R = dot(rV, dir_to_light);
 	//answer += specular_color_ * incident_intensity * FW::pow(clamp((R),0.0f, FLT_MAX),exponent_);
+#if FW_FAST_MATH
+	answer += specular_color_ * incident_intensity * fastPow(clamp((R), 0.0f, 1.0f), exponent_);
+#else
 	answer += specular_color_ * incident_intensity * FW::pow(clamp((R), 0.0f, 1.0f), exponent_);
+#endif
 
 	return answer;
 }
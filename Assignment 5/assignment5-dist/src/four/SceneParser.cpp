@@ -5,6 +5,7 @@
 #include "lights.hpp"
 #include "material.hpp"
 #include "objects.hpp"
+#include "paging.hpp"
 #include "utility.hpp"
 
 #include <cstdio>
@@ -17,9 +18,11 @@
 using namespace std;
 using namespace FW;
 
-SceneParser::SceneParser( const char* filename )
+SceneParser::SceneParser( const char* filename, Args::BVHLayoutType bvh_layout, int paged_cache_mb )
 {
 	// initialize some reasonable default values
+	this->bvh_layout = bvh_layout;
+	cluster_cache = paged_cache_mb > 0 ? new ClusterCache(size_t(paged_cache_mb) << 20) : nullptr;
 	group = nullptr;
 	camera = nullptr;
 	background_color = Vec3f(0.5,0.5,0.5);
@@ -66,6 +69,8 @@ SceneParser::SceneParser( const char* filename )
 
 SceneParser::SceneParser()
 {
+	bvh_layout = Args::BVH_Compressed;
+	cluster_cache = nullptr;
 	group = nullptr;
 	camera = nullptr;
 	background_color = Vec3f(0.5, 0.5, 0.5);
@@ -81,6 +86,7 @@ SceneParser::~SceneParser()
 {
 	if (group != nullptr) 
 		delete group;
+	delete cluster_cache;
 	if (camera != nullptr) 
 		delete camera;
 	int i;
@@ -495,7 +501,7 @@ Triangle* SceneParser::parseTriangle() {
 	// return new Triangle(v0,v1,v2,current_material,t0,t1,t2);
 }
 
-Group* SceneParser::parseTriangleMesh() {
+Object3D* SceneParser::parseTriangleMesh() {
 	char token[MAX_PARSER_TOKEN_LENGTH];
 	char filename[MAX_PARSER_TOKEN_LENGTH];
 	// get the filename
@@ -505,6 +511,14 @@ Group* SceneParser::parseTriangleMesh() {
 	getToken( token ); assert (!strcmp(token, "}"));
 	const char *ext = &filename[strlen(filename)-4];
 	assert(!strcmp(ext,".obj"));
+
+	// paged meshes are preprocessed into a cluster file next to the .obj, which is reused
+	// until the .obj changes
+	char cluster_filename[MAX_PARSER_TOKEN_LENGTH + 16];
+	sprintf(cluster_filename, "%.*s.clusters", int(ext - filename), filename);
+	if (cluster_cache != nullptr && PagedMesh::isUpToDate(cluster_filename, filename))
+		return loadPagedMesh(cluster_filename);
+
 	// read it once, get counts
 	FILE *mesh_file = fopen(filename,"r");
 	assert (mesh_file != nullptr);
@@ -524,10 +538,8 @@ Group* SceneParser::parseTriangleMesh() {
 	}
 	fclose(mesh_file);
 	// make arrays
-	Vec3f *verts = new Vec3f[vcount];
-
-	// load the whole model as a single preview model instead of dealing with each triangle separately
-	Group *answer = new Group(current_material, (FW::Mesh<FW::VertexPNT>*)FW::importMesh(filename));
+	vector<Vec3f> verts(vcount);
+	vector<Vec3i> faces(fcount);
 	
 	// read it again, save it
 	mesh_file = fopen(filename,"r");
@@ -549,16 +561,28 @@ Group* SceneParser::parseTriangleMesh() {
 			assert (f0 > 0 && f0 <= vcount);
 			assert (f1 > 0 && f1 <= vcount);
 			assert (f2 > 0 && f2 <= vcount);
-			assert (current_material != nullptr);
-			auto t = new Triangle(verts[f0-1], verts[f1-1], verts[f2-1], current_material, false);
-			answer->insert(t);
+			faces[new_fcount] = Vec3i(f0-1, f1-1, f2-1);
 			new_fcount++; 
 		} // otherwise, must be whitespace
 	}
-	delete [] verts;
 	assert (fcount == new_fcount);
 	assert (vcount == new_vcount);
 	fclose(mesh_file);
+
+	assert (current_material != nullptr);
+	if (cluster_cache != nullptr) {
+		if (!PagedMesh::writeClusters(cluster_filename, filename, verts, faces)) {
+			::printf("FATAL: Could not write %s!\n", cluster_filename);
+			exit(0);
+		}
+		return loadPagedMesh(cluster_filename);
+	}
+
+	// the triangles go into the mesh's BVH; the whole model is loaded as a single preview model
+	auto answer = new TriangleMesh(verts, faces, current_material, (FW::Mesh<FW::VertexPNT>*)FW::importMesh(filename), bvh_layout);
+	::printf("Loaded %s: %d triangles, %d BVH nodes (%d KB, %s layout)\n", filename, fcount,
+		int(answer->bvh().numNodes()), int(answer->bvh().nodeBytes() / 1024),
+		bvh_layout == Args::BVH_Compressed ? "compressed" : "binary");
 	return answer;
 }
 
@@ -703,3 +727,16 @@ int SceneParser::readInt() {
 	}
 	return answer;
 }
+
+PagedMesh* SceneParser::loadPagedMesh(const char* cluster_filename) {
+	// paged meshes have no preview model, since that would load the whole mesh again
+	assert (current_material != nullptr);
+	auto answer = new PagedMesh(cluster_filename, current_material, cluster_cache, bvh_layout);
+	if (!answer->isOpen()) {
+		::printf("FATAL: Could not open %s!\n", cluster_filename);
+		exit(0);
+	}
+	::printf("Opened %s: %d clusters (%d KB resident, %s layout)\n", cluster_filename, answer->numClusters(),
+		int(answer->tableBytes() / 1024), bvh_layout == Args::BVH_Compressed ? "compressed" : "binary");
+	return answer;
+}
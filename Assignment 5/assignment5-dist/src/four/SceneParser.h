@@ -1,5 +1,7 @@
 #pragma once
 
+#include "args.hpp"
+
 #include "base/Math.hpp"
 
 #include <cassert>
@@ -14,13 +16,16 @@ class Sphere;
 class Plane;
 class Triangle;
 class Transform;
+class TriangleMesh;
+class ClusterCache;
+class PagedMesh;
 
 #define MAX_PARSER_TOKEN_LENGTH 100
 
 class SceneParser
 {
 public:
-    SceneParser(const char* filename);
+    SceneParser(const char* filename, Args::BVHLayoutType bvh_layout = Args::BVH_Compressed, int paged_cache_mb = 0);
 	SceneParser();
 
     ~SceneParser();
@@ -63,6 +68,11 @@ public:
         return group;
     }
 
+    // Cache shared by the paged meshes, or null if meshes are loaded into memory.
+    ClusterCache* getClusterCache() const {
+        return cluster_cache;
+    }
+
 private:
     void parseFile();
     void parseOrthographicCamera();
@@ -80,7 +90,8 @@ private:
     Sphere* parseSphere();
     Plane* parsePlane();
     Triangle* parseTriangle();
-    Group* parseTriangleMesh();
+    Object3D* parseTriangleMesh();
+    PagedMesh* loadPagedMesh(const char* cluster_filename);
     Transform* parseTransform();
     void parseMatrixHelper(FW::Mat4f& matrix, char token[MAX_PARSER_TOKEN_LENGTH]);
 
@@ -100,4 +111,6 @@ private:
     Material** materials;
     Material* current_material;
     Group* group;
+    Args::BVHLayoutType bvh_layout;
+    ClusterCache* cluster_cache;
 };
@@ -15,9 +15,13 @@ struct Args
 	std::string output_file;
 	std::string depth_file;
 	std::string normals_file;
+	std::string pfm_file;		// floating-point color output
 	int		width;
 	int		height;
 	bool	stats;
+	int		stream_rows;		// if > 0, trace and write the images out in bands of this many scanlines
+	std::string sequence_file;	// camera path; if set, render a numbered frame sequence along it
+	int		sequence_frames;	// number of frames in the sequence; 0 = one per path key
 
 	// Rendering options
 
@@ -30,6 +34,15 @@ struct Args
 	bool	shade_back;
 	bool	display_uv;
 
+	// Acceleration structure
+
+	enum BVHLayoutType {
+		BVH_Binary		= 0,	// binary nodes with float bounds
+		BVH_Compressed	= 1		// 4-wide nodes with 8-bit quantized child bounds
+	};
+	BVHLayoutType bvh_layout;
+	int		paged_cache_mb;		// if > 0, page triangle meshes in from disk through a cache of this many MB
+
 	// Supersampling
 
 	int	num_samples;
@@ -67,3 +80,4 @@ struct Args
 class RayTracer; class SceneParser;
 typedef unsigned GLuint;
 GLuint render(RayTracer& rt, SceneParser& scene, const Args& args);
+int renderSequence(RayTracer& rt, SceneParser& scene, const Args& args); // returns the number of frames rendered
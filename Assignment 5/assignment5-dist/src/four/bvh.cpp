@@ -0,0 +1,368 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+const int	NUM_BINS		= 16;
+const int	MAX_LEAF_SIZE	= 4;	// preferred leaf size
+const int	MAX_SAH_LEAF	= 16;	// larger leaves are split even if SAH prefers not to
+const float	COST_TRAVERSAL	= 1.0f;
+const float	COST_TRIANGLE	= 1.0f;
+
+static_assert(sizeof(BVH::Node) == 32, "BVH::Node should be 32 bytes");
+static_assert(sizeof(BVH::QuantizedNode) == 64, "BVH::QuantizedNode should be 64 bytes");
+
+// Quantize [lo,hi] on one axis of a grid with the given origin and spacing, rounding outwards.
+// The rounding is checked with the same expression the traversal uses to decode.
+inline void quantizeAxis(float lo, float hi, float origin, float scale, uint8_t& qlo, uint8_t& qhi) {
+	int l = FW::clamp(int(floorf((lo - origin) / scale)), 0, 255);
+	int h = FW::clamp(int(ceilf((hi - origin) / scale)), 0, 255);
+	while (l > 0 && origin + l * scale > lo) --l;
+	while (h < 255 && origin + h * scale < hi) ++h;
+	qlo = uint8_t(l);
+	qhi = uint8_t(h);
+}
+
+} // namespace
+
+BVH::BVH(const vector<Vec3f>& vertices, const vector<Vec3i>& triangles, Args::BVHLayoutType layout) :
+	layout_(layout), stack_size_(0)
+{
+	int n = int(triangles.size());
+	if (n == 0)
+		return;
+
+	vector<AABB> boxes(n);
+	for (int i = 0; i < n; ++i)
+		for (int k = 0; k < 3; ++k)
+			boxes[i].grow(vertices[triangles[i][k]]);
+
+	vector<int> order;
+	// The binary traversal defers at most one child per level.
+	stack_size_ = buildNodes(boxes, order, nodes_, MAX_LEAF_SIZE) + 1;
+	bounds_ = AABB(nodes_[0].lo, nodes_[0].hi);
+
+	// Flatten the triangles in leaf order.
+	v0_.resize(n); e1_.resize(n); e2_.resize(n);
+	for (int i = 0; i < n; ++i) {
+		const Vec3i& tri = triangles[order[i]];
+		v0_[i] = vertices[tri[0]];
+		e1_[i] = vertices[tri[1]] - vertices[tri[0]];
+		e2_[i] = vertices[tri[2]] - vertices[tri[0]];
+	}
+
+	if (layout_ == Args::BVH_Compressed) {
+		qnodes_.reserve(nodes_.size() / 3 + 1);
+		stack_size_ = 0;
+		collapse(0, 1);
+		vector<Node>().swap(nodes_);
+	}
+}
+
+int BVH::buildNodes(const vector<AABB>& boxes, vector<int>& order, vector<Node>& nodes, int leaf_size) {
+	int n = int(boxes.size());
+	vector<Vec3f> centroids(n);
+	order.resize(n);
+	for (int i = 0; i < n; ++i) {
+		centroids[i] = boxes[i].center();
+		order[i] = i;
+	}
+
+	nodes.clear();
+	nodes.reserve(2 * n / leaf_size + 1);
+	int levels = 0;
+	if (n > 0)
+		build(nodes, order, boxes, centroids, 0, n, leaf_size, 1, levels);
+	return levels;
+}
+
+int BVH::build(vector<Node>& nodes, vector<int>& order, const vector<AABB>& boxes, const vector<Vec3f>& centroids, int begin, int end, int leaf_size, int depth, int& levels) {
+	int index = int(nodes.size());
+	nodes.push_back(Node());
+	levels = FW::max(levels, depth);
+
+	AABB box, centroid_box;
+	for (int i = begin; i < end; ++i) {
+		box.grow(boxes[order[i]]);
+		centroid_box.grow(centroids[order[i]]);
+	}
+	nodes[index].lo = box.lo;
+	nodes[index].hi = box.hi;
+
+	int count = end - begin;
+	auto makeLeaf = [&]() {
+		nodes[index].first = begin;
+		nodes[index].count = count;
+		return index;
+	};
+	if (count <= leaf_size)
+		return makeLeaf();
+
+	// Binned SAH over the longest centroid axis.
+	Vec3f extent = centroid_box.hi - centroid_box.lo;
+	int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	int mid = begin + count / 2;
+
+	if (extent[axis] > 0.0f) {
+		AABB bin_box[NUM_BINS];
+		int bin_count[NUM_BINS] = {};
+		float k = NUM_BINS * (1.0f - 1e-5f) / extent[axis];
+		auto binOf = [&](int tri) { return FW::clamp(int((centroids[tri][axis] - centroid_box.lo[axis]) * k), 0, NUM_BINS - 1); };
+		for (int i = begin; i < end; ++i) {
+			int b = binOf(order[i]);
+			bin_box[b].grow(boxes[order[i]]);
+			++bin_count[b];
+		}
+
+		// Sweep from the right, then evaluate the split candidates from the left.
+		float right_area[NUM_BINS];
+		int right_count[NUM_BINS];
+		AABB acc;
+		int acc_count = 0;
+		for (int b = NUM_BINS - 1; b > 0; --b) {
+			acc.grow(bin_box[b]);
+			acc_count += bin_count[b];
+			right_area[b] = acc.area();
+			right_count[b] = acc_count;
+		}
+
+		float best_cost = FLT_MAX;
+		int best_split = -1;
+		acc = AABB();
+		acc_count = 0;
+		for (int b = 1; b < NUM_BINS; ++b) {
+			acc.grow(bin_box[b - 1]);
+			acc_count += bin_count[b - 1];
+			if (acc_count == 0 || right_count[b] == 0)
+				continue;
+			float cost = acc.area() * acc_count + right_area[b] * right_count[b];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_split = b;
+			}
+		}
+
+		float leaf_cost = COST_TRIANGLE * count;
+		float split_cost = COST_TRAVERSAL + COST_TRIANGLE * best_cost / FW::max(box.area(), FLT_MIN);
+		if (best_split >= 0 && count <= MAX_SAH_LEAF && leaf_cost <= split_cost)
+			return makeLeaf();
+
+		if (best_split >= 0)
+			mid = int(partition(order.begin() + begin, order.begin() + end, [&](int tri) { return binOf(tri) < best_split; }) - order.begin());
+	}
+
+	// Degenerate centroids: keep small leaves, split larger ones in the middle.
+	if (extent[axis] <= 0.0f && count <= MAX_SAH_LEAF)
+		return makeLeaf();
+
+	build(nodes, order, boxes, centroids, begin, mid, leaf_size, depth + 1, levels);
+	int right = build(nodes, order, boxes, centroids, mid, end, leaf_size, depth + 1, levels);
+	nodes[index].first = right;
+	nodes[index].count = 0;
+	return index;
+}
+
+int BVH::collapse(int node, int depth) {
+	// Pull grandchildren up until there are four children, always opening the largest inner child.
+	int children[4];
+	int num_children = 0;
+	const Node& n = nodes_[node];
+	if (n.count > 0) {
+		children[num_children++] = node;
+	} else {
+		children[num_children++] = node + 1;
+		children[num_children++] = n.first;
+		while (num_children < 4) {
+			int best = -1;
+			float best_area = -1.0f;
+			for (int i = 0; i < num_children; ++i) {
+				const Node& c = nodes_[children[i]];
+				float area = AABB(c.lo, c.hi).area();
+				if (c.count == 0 && area > best_area) {
+					best = i;
+					best_area = area;
+				}
+			}
+			if (best < 0)
+				break;
+			int opened = children[best];
+			children[best] = opened + 1;
+			children[num_children++] = nodes_[opened].first;
+		}
+	}
+
+	int index = int(qnodes_.size());
+	qnodes_.push_back(QuantizedNode());
+
+	// Traversal leaves at most three siblings waiting on each level above, plus the four children.
+	stack_size_ = FW::max(stack_size_, 3 * (depth - 1) + 4);
+
+	// Quantization grid: the smallest power of two spacing that covers the box in 255 steps.
+	QuantizedNode q = {};
+	q.origin = n.lo;
+	Vec3f scale;
+	for (int a = 0; a < 3; ++a) {
+		float extent = n.hi[a] - n.lo[a];
+		int e = (extent > 0.0f) ? int(ceilf(log2f(extent / 255.0f))) : -126;
+		e = FW::clamp(e, -126, 127);
+		while (e < 127 && q.origin[a] + FW::exp2(e) * 255.0f < n.hi[a])
+			++e;
+		q.exponent[a] = int8_t(e);
+		scale[a] = FW::exp2(e);
+	}
+
+	q.num_children = uint8_t(num_children);
+	for (int i = 0; i < num_children; ++i) {
+		const Node& c = nodes_[children[i]];
+		quantizeAxis(c.lo.x, c.hi.x, q.origin.x, scale.x, q.lo_x[i], q.hi_x[i]);
+		quantizeAxis(c.lo.y, c.hi.y, q.origin.y, scale.y, q.lo_y[i], q.hi_y[i]);
+		quantizeAxis(c.lo.z, c.hi.z, q.origin.z, scale.z, q.lo_z[i], q.hi_z[i]);
+		if (c.count > 0) {
+			assert(c.count <= 255);
+			q.child[i] = ~c.first;
+			q.leaf_count[i] = uint8_t(c.count);
+		} else {
+			q.child[i] = collapse(children[i], depth + 1);
+		}
+	}
+
+	qnodes_[index] = q;
+	return index;
+}
+
+bool BVH::intersect(const Ray& r, float tmin, float& tmax, int& triangle) const {
+	if (v0_.empty())
+		return false;
+
+	Vec3f inv_dir = Vec3f(1.0f) / r.direction;
+	if (layout_ == Args::BVH_Compressed)
+		return intersectCompressed(r, inv_dir, tmin, tmax, triangle);
+	return intersectBinary(r, inv_dir, tmin, tmax, triangle);
+}
+
+bool BVH::intersectLeaf(const Ray& r, int first, int count, float tmin, float& tmax, int& triangle) const {
+	// Moller-Trumbore against the flattened triangles.
+	bool hit = false;
+	for (int i = first; i < first + count; ++i) {
+		Vec3f p = cross(r.direction, e2_[i]);
+		float det = dot(e1_[i], p);
+		if (det == 0.0f)
+			continue;
+		float inv_det = 1.0f / det;
+		Vec3f s = r.origin - v0_[i];
+		float beta = dot(s, p) * inv_det;
+		if (beta <= 0.0f || beta >= 1.0f)
+			continue;
+		Vec3f q = cross(s, e1_[i]);
+		float gamma = dot(r.direction, q) * inv_det;
+		if (gamma <= 0.0f || beta + gamma >= 1.0f)
+			continue;
+		float t = dot(e2_[i], q) * inv_det;
+		if (t > tmin && t < tmax) {
+			tmax = t;
+			triangle = i;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+bool BVH::intersectBinary(const Ray& r, const Vec3f& inv_dir, float tmin, float& tmax, int& triangle) const {
+	BVHStack stack(stack_size_);
+	int sp = 0;
+	bool hit = false;
+
+	float tnear;
+	if (!intersectBox(nodes_[0].lo, nodes_[0].hi, r.origin, inv_dir, tmin, tmax, tnear))
+		return false;
+	stack[sp++] = { 0, tnear };
+
+	while (sp > 0) {
+		BVHStackEntry e = stack[--sp];
+		if (e.tnear > tmax)
+			continue;
+
+		int node = e.node;
+		for (;;) {
+			const Node& n = nodes_[node];
+			if (n.count > 0) {
+				hit |= intersectLeaf(r, n.first, n.count, tmin, tmax, triangle);
+				break;
+			}
+
+			int left = node + 1, right = n.first;
+			float tl, tr;
+			bool hl = intersectBox(nodes_[left].lo, nodes_[left].hi, r.origin, inv_dir, tmin, tmax, tl);
+			bool hr = intersectBox(nodes_[right].lo, nodes_[right].hi, r.origin, inv_dir, tmin, tmax, tr);
+			if (hl && hr) {
+				// Descend into the nearer child, defer the other one.
+				if (tr < tl) {
+					swap(left, right);
+					swap(tl, tr);
+				}
+				assert(sp < stack_size_);
+				stack[sp++] = { right, tr };
+				node = left;
+			} else if (hl) {
+				node = left;
+			} else if (hr) {
+				node = right;
+			} else {
+				break;
+			}
+		}
+	}
+	return hit;
+}
+
+bool BVH::intersectCompressed(const Ray& r, const Vec3f& inv_dir, float tmin, float& tmax, int& triangle) const {
+	BVHStack stack(stack_size_);
+	int sp = 0;
+	bool hit = false;
+
+	float tnear;
+	if (!intersectBox(bounds_.lo, bounds_.hi, r.origin, inv_dir, tmin, tmax, tnear))
+		return false;
+	stack[sp++] = { 0, tnear };
+
+	while (sp > 0) {
+		BVHStackEntry e = stack[--sp];
+		if (e.tnear > tmax)
+			continue;
+
+		const QuantizedNode& q = qnodes_[e.node];
+		Vec3f scale(FW::exp2(int(q.exponent[0])), FW::exp2(int(q.exponent[1])), FW::exp2(int(q.exponent[2])));
+
+		// Test all children; sort the inner ones that were hit by distance.
+		BVHStackEntry inner[4];
+		int num_inner = 0;
+		for (int i = 0; i < q.num_children; ++i) {
+			Vec3f lo(q.origin.x + q.lo_x[i] * scale.x, q.origin.y + q.lo_y[i] * scale.y, q.origin.z + q.lo_z[i] * scale.z);
+			Vec3f hi(q.origin.x + q.hi_x[i] * scale.x, q.origin.y + q.hi_y[i] * scale.y, q.origin.z + q.hi_z[i] * scale.z);
+			float t;
+			if (!intersectBox(lo, hi, r.origin, inv_dir, tmin, tmax, t))
+				continue;
+
+			if (q.child[i] < 0) {
+				hit |= intersectLeaf(r, ~q.child[i], q.leaf_count[i], tmin, tmax, triangle);
+			} else {
+				int k = num_inner++;
+				for (; k > 0 && inner[k - 1].tnear < t; --k)
+					inner[k] = inner[k - 1];
+				inner[k] = { q.child[i], t };
+			}
+		}
+
+		// Farthest first, so that the nearest child is popped next.
+		assert(sp + num_inner <= stack_size_);
+		for (int i = 0; i < num_inner; ++i)
+			stack[sp++] = inner[i];
+	}
+	return hit;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "args.hpp"
+#include "ray.hpp"
+
+#include "base/Math.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct AABB
+{
+	AABB() : lo(FLT_MAX), hi(-FLT_MAX) {}
+	AABB(const FW::Vec3f& lo, const FW::Vec3f& hi) : lo(lo), hi(hi) {}
+
+	void grow(const FW::Vec3f& p) { lo = lo.min(p); hi = hi.max(p); }
+	void grow(const AABB& b) { lo = lo.min(b.lo); hi = hi.max(b.hi); }
+	FW::Vec3f center() const { return (lo + hi) * 0.5f; }
+	float area() const {
+		FW::Vec3f d = (hi - lo).max(FW::Vec3f(0.0f));
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	FW::Vec3f lo;
+	FW::Vec3f hi;
+};
+
+// Ray-box slab test. Returns the entry distance in tnear.
+inline bool intersectBox(const FW::Vec3f& lo, const FW::Vec3f& hi, const FW::Vec3f& origin, const FW::Vec3f& inv_dir, float tmin, float tmax, float& tnear) {
+	FW::Vec3f t0 = (lo - origin) * inv_dir;
+	FW::Vec3f t1 = (hi - origin) * inv_dir;
+	tnear = FW::max(t0.min(t1).max(), tmin);
+	float tfar = FW::min(t0.max(t1).min(), tmax);
+	return tnear <= tfar;
+}
+
+// Traversal stack entry: a node and the distance at which the ray enters it.
+struct BVHStackEntry
+{
+	int		node;
+	float	tnear;
+};
+
+// Traversal stack with room for `size` entries. Hierarchies are normally shallow enough
+// for the fixed array; deeper ones (e.g. very unbalanced splits) get a heap allocation.
+class BVHStack
+{
+public:
+	explicit BVHStack(int size) : entries_(local_) {
+		if (size > LOCAL_SIZE) {
+			heap_.resize(size);
+			entries_ = heap_.data();
+		}
+	}
+
+	BVHStackEntry& operator[](int i) { return entries_[i]; }
+
+private:
+	enum { LOCAL_SIZE = 128 };
+
+	BVHStackEntry				local_[LOCAL_SIZE];
+	std::vector<BVHStackEntry>	heap_;
+	BVHStackEntry*				entries_;
+};
+
+// Bounding volume hierarchy over a triangle soup.
+//
+// The triangles are flattened into arrays (first vertex and two edges) and reordered
+// so that every leaf references a contiguous range of them. The hierarchy is built with
+// binned SAH and then stored in one of two layouts, selected by Args::BVHLayoutType:
+//  - Binary:     two children per node, full-precision float bounds (32-byte nodes).
+//  - Compressed: up to four children per node, child bounds quantized to 8 bits
+//                relative to the node's own box (64-byte nodes, one per cache line).
+// The compressed layout needs about half the node memory of the binary one.
+class BVH
+{
+public:
+	struct Node
+	{
+		FW::Vec3f	lo;
+		FW::Vec3f	hi;
+		int32_t		first;	// inner: index of the second child (the first one follows the node); leaf: first triangle
+		int32_t		count;	// leaf: number of triangles; inner: 0
+	};
+
+	struct QuantizedNode
+	{
+		FW::Vec3f	origin;			// lower corner of the node's box
+		int8_t		exponent[3];	// per-axis grid spacing is 2^exponent
+		uint8_t		num_children;
+		uint8_t		lo_x[4], lo_y[4], lo_z[4];
+		uint8_t		hi_x[4], hi_y[4], hi_z[4];
+		int32_t		child[4];		// >= 0: index of an inner node; < 0: ~(first triangle) of a leaf
+		uint8_t		leaf_count[4];	// number of triangles in a leaf child
+		uint8_t		pad[4];
+	};
+
+	BVH() : layout_(Args::BVH_Compressed), stack_size_(0) {}
+	BVH(const std::vector<FW::Vec3f>& vertices, const std::vector<FW::Vec3i>& triangles, Args::BVHLayoutType layout);
+
+	int numTriangles() const { return int(v0_.size()); }
+	Args::BVHLayoutType layout() const { return layout_; }
+	const AABB& bounds() const { return bounds_; }
+
+	// Size of the node array in bytes.
+	size_t nodeBytes() const { return nodes_.size() * sizeof(Node) + qnodes_.size() * sizeof(QuantizedNode); }
+	size_t numNodes() const { return nodes_.size() + qnodes_.size(); }
+
+	// Find the closest triangle hit along the ray with tmin < t < tmax.
+	// On a hit, updates tmax and returns the index of the triangle in the flattened arrays.
+	bool intersect(const Ray& r, float tmin, float& tmax, int& triangle) const;
+
+	// Geometric normal of a triangle, with the same winding as the Triangle class.
+	FW::Vec3f normal(int triangle) const { return cross(e1_[triangle], e2_[triangle]).normalized(); }
+
+	// Total size of the nodes and the flattened triangles in bytes.
+	size_t memoryBytes() const { return nodeBytes() + v0_.size() * 3 * sizeof(FW::Vec3f); }
+
+	// Build a binary SAH hierarchy over primitive boxes into `nodes` (root first).
+	// `order` receives the primitive indices in leaf order; leaves hold at most `leaf_size`
+	// primitives unless SAH prefers slightly larger ones. Returns the number of levels.
+	static int buildNodes(const std::vector<AABB>& boxes, std::vector<int>& order, std::vector<Node>& nodes, int leaf_size);
+
+private:
+	static int build(std::vector<Node>& nodes, std::vector<int>& order, const std::vector<AABB>& boxes, const std::vector<FW::Vec3f>& centroids, int begin, int end, int leaf_size, int depth, int& levels);
+	int collapse(int node, int depth);
+	bool intersectBinary(const Ray& r, const FW::Vec3f& inv_dir, float tmin, float& tmax, int& triangle) const;
+	bool intersectCompressed(const Ray& r, const FW::Vec3f& inv_dir, float tmin, float& tmax, int& triangle) const;
+	bool intersectLeaf(const Ray& r, int first, int count, float tmin, float& tmax, int& triangle) const;
+
+	Args::BVHLayoutType			layout_;
+	AABB						bounds_;
+	std::vector<Node>			nodes_;		// binary layout; also the build result the compressed layout is made from
+	std::vector<QuantizedNode>	qnodes_;	// compressed layout
+	int							stack_size_;	// traversal stack entries needed for the deepest path
+
+	// Flattened triangles in leaf order.
+	std::vector<FW::Vec3f>		v0_;
+	std::vector<FW::Vec3f>		e1_;
+	std::vector<FW::Vec3f>		e2_;
+};
@@ -12,15 +12,20 @@
 #include "Film.h"
 #include "Sampler.h"
 #include "Filter.h"
+#include "CameraPath.h"
+#include "paging.hpp"
 
 #include "gui/Image.hpp"
 #include "io/File.hpp"
 #include "io/ImageLodePngIO.hpp"
+#include "io/ImagePfmIO.hpp"
+#include "io/ImageRawPngIO.hpp"
 #include "base/Main.hpp"
 
 #include <atomic>
 #include <algorithm>
 #include <chrono>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <numeric>
@@ -52,7 +57,7 @@ int main(int argcp, char *argvp[]) {
 	// Parse the arguments
 	auto args = Args(arg);
 	// Parse the scene
-	auto scene_parser = SceneParser(args.input_file.c_str());
+	auto scene_parser = SceneParser(args.input_file.c_str(), args.bvh_layout, args.paged_cache_mb);
 	// Construct tracer
 	auto ray_tracer = RayTracer(scene_parser, args);
 
@@ -60,32 +65,219 @@ int main(int argcp, char *argvp[]) {
 	if (!scene_parser.getGroup())
 		args.display_uv = true;
 
+	// Render a fly-through sequence; measure time
+	if (!args.sequence_file.empty()) {
+		auto start = chrono::steady_clock::now();
+		int num_frames = renderSequence(ray_tracer, scene_parser, args);
+		auto end = chrono::steady_clock::now();
+
+		auto ms = chrono::duration_cast<chrono::milliseconds>(end-start).count();
+		cout << "Rendered " << num_frames << " frames in " << ms << "ms (" << (num_frames ? ms / num_frames : 0) << "ms/frame)." << endl;
+		if (scene_parser.getClusterCache())
+			scene_parser.getClusterCache()->printStats();
+		return 0;
+	}
+
 	// Render; measure time
 	auto start = chrono::steady_clock::now();
 	render(ray_tracer, scene_parser, args);
 	auto end = chrono::steady_clock::now();
 
 	cout << "Rendered " << args.output_file << " in " << chrono::duration_cast<chrono::milliseconds>(end-start).count() << "ms." << endl;
+	if (scene_parser.getClusterCache())
+		scene_parser.getClusterCache()->printStats();
 	return 0;
 }
 
-GLuint render(RayTracer& ray_tracer, SceneParser& scene, const Args& args) {
+namespace {
+
+// Renders scanline j of the full image into row `row` of the given images.
+// Any of the images may be null. Used by both the in-memory and the streaming
+// render paths, so the images may either cover the whole frame or just a band.
+void renderScanline(RayTracer& ray_tracer, SceneParser& scene, const Args& args, Sampler* sampler,
+		int j, int row, Image* image, Image* depth_image, Image* normals_image) {
 	auto image_pixels = Vec2i(args.width, args.height);
 
-	// Construct images
-	unique_ptr<Image> image, depth_image, normals_image;
+	// Loop over pixels on a scanline
+	for (int i = 0; i < args.width; ++i) {
+		// Loop through all the samples for this pixel.
+		Vec3f sample_color = Vec3f(0.0f);
+		for (int n = 0; n < args.num_samples; ++n) {
+			// Get the offset of the sample inside the pixel. 
+			// You need to fill in the implementation for this function when implementing supersampling.
+			// The starter implementation only supports one sample per pixel through the pixel center.
+			Vec2f offset = sampler->getSamplePosition(n);
+
+			// Convert floating-point pixel coordinate to canonical view coordinates in [-1,1]^2
+			// You need to fill in the implementation for Camera::normalizedImageCoordinateFromPixelCoordinate.
+			Vec2f ray_xy = Camera::normalizedImageCoordinateFromPixelCoordinate(Vec2f(float(i), float(j)) + offset, image_pixels);
+
+			// Generate the ray using the view coordinates
+			// You need to fill in the implementation for this function.
+			Ray r = scene.getCamera()->generateRay(ray_xy);
+
+			// Trace the ray!
+			Hit hit;
+			float tmin = scene.getCamera()->getTMin();
+
+			// You should fill in the gaps in the implementation of traceRay().
+			// args.bounces gives the maximum number of reflections/refractions that should be traced.
+			sample_color += ray_tracer.traceRay(r, tmin, args.bounces, 1.0f, hit, Vec3f(1.0f));
+
+			// YOUR CODE HERE (R9)
+			// This starter code only supports one sample per pixel and consequently directly
+			// puts the returned color to the image. You should extend this code to handle
+			// multiple samples per pixel. Also sample the depth and normal visualization like the color.
+			// The requirement is just to take an average of all the samples within the pixel
+			// (so-called "box filtering"). Note that this starter code does not take an average,
+			// it just assumes the first and only sample is the final color.
+
+			//image->setVec4f(Vec2i(i, j), Vec4f(image->getVec4f(Vec2f(i, j)) + Vec4f(sample_color / args.num_samples, 1)));
+
+			// For extra credit, you can implement more sophisticated ones, such as "tent" and bicubic
+			// "Mitchell-Netravali" filters. This requires you to implement the addSample()
+			// function in the Film class and use it instead of directly setting pixel values in the image.
+
+			// YOUR CODE HERE (R0)
+			// If args.display_uv is true, we want to render a test UV image where the color of each pixel
+			// is a simple function of its position in the image. The red component should linearly increase
+			// from 0 to 1 with the x coordinate increasing from 0 to args.width. Likewise the green component
+			// should linearly increase from 0 to 1 as the y coordinate increases from 0 to args.height. Since
+			// our image is two-dimensional we can't map blue to a simple linear function and just set it to 1.
+
+			//if (args.display_uv)
+			//	sample_color = ...
+			if (args.display_uv)
+				sample_color = Vec3f(float(i) / (args.width - 1), float(j) / (args.height - 1), 1);
+
+
+			//image->setVec4f(Vec2i(i,j), Vec4f(sample_color, 1));
+			if (image)
+				image->setVec4f(Vec2i(i, row), Vec4f(sample_color / (args.num_samples * 1.0f), 1));
+
+			if (depth_image) {
+				// YOUR CODE HERE (R2)
+				// Here you should linearly map the t range [depth_min, depth_max] to the inverted range [1,0] for visualization
+				// Note the inversion; closer objects should appear brighter.
+				float f = 0.0f;
+				if (hit.t >= args.depth_min && hit.t <= args.depth_max)
+					f = 1 - (hit.t - args.depth_min) / (args.depth_max - args.depth_min);
+
+				depth_image->setVec4f(Vec2i(i, row), Vec4f(Vec3f(f), 1));
+			}
+			if (normals_image) {
+				Vec3f normal = hit.normal;
+				Vec3f col(fabs(normal[0]), fabs(normal[1]), fabs(normal[2]));
+				col = col.clamp(Vec3f(0), Vec3f(1));
+				normals_image->setVec4f( Vec2i( i, row ), Vec4f( col, 1 ) );
+			}
+		}
+	}
+}
+
+// Streaming variant of render(): the image is traced in bands of args.stream_rows
+// scanlines, and each finished band is quantized and appended to the output files
+// on a background thread while the next band is being traced. Only two bands are
+// ever resident, so memory use does not depend on the image height.
+void renderStreaming(RayTracer& ray_tracer, SceneParser& scene, const Args& args) {
+	auto image_pixels = Vec2i(args.width, args.height);
+	int band_rows = FW::min(args.stream_rows, args.height);
+
+	// Open the output files and their writers
+	unique_ptr<File> image_file, pfm_file, depth_file, normals_file;
+	unique_ptr<RawPngStreamWriter> image_writer, depth_writer, normals_writer;
+	unique_ptr<PfmStreamWriter> pfm_writer;
 	if (!args.output_file.empty()) {
-		image.reset(new Image(image_pixels, ImageFormat::RGBA_Vec4f));
-		image->clear(Vec4f());
+		image_file.reset(new File(args.output_file.c_str(), File::Create));
+		image_writer.reset(new RawPngStreamWriter(*image_file, image_pixels, true));
+	}
+	if (!args.pfm_file.empty()) {
+		pfm_file.reset(new File(args.pfm_file.c_str(), File::Create));
+		pfm_writer.reset(new PfmStreamWriter(*pfm_file, image_pixels));
+	}
+	if (!args.depth_file.empty()) {
+		depth_file.reset(new File(args.depth_file.c_str(), File::Create));
+		depth_writer.reset(new RawPngStreamWriter(*depth_file, image_pixels, true));
+	}
+	if (!args.normals_file.empty()) {
+		normals_file.reset(new File(args.normals_file.c_str(), File::Create));
+		normals_writer.reset(new RawPngStreamWriter(*normals_file, image_pixels, true));
+	}
+
+	// Two sets of band buffers: one is being traced while the other is being written out.
+	struct Band {
+		unique_ptr<Image> image, depth_image, normals_image;
+	} bands[2];
+	auto band_pixels = Vec2i(args.width, band_rows);
+	for (auto& band : bands) {
+		if (image_writer || pfm_writer)
+			band.image.reset(new Image(band_pixels, ImageFormat::RGBA_Vec4f));
+		if (depth_writer)
+			band.depth_image.reset(new Image(band_pixels, ImageFormat::RGBA_Vec4f));
+		if (normals_writer)
+			band.normals_image.reset(new Image(band_pixels, ImageFormat::RGBA_Vec4f));
+	}
+
+	// progress counter
+	atomic<int> lines_done = 0;
+
+	future<void> writer;
+	for (int band_start = 0, b = 0; band_start < args.height; band_start += band_rows, b ^= 1) {
+		int num_rows = FW::min(band_rows, args.height - band_start);
+		Band& band = bands[b];
+
+		// Trace the band; the previous band may still be writing out from the other buffer.
+		#pragma omp parallel for
+		for (int row = 0; row < num_rows; ++row) {
+			if (args.show_progress) ::printf("%.2f%% \r", lines_done * 100.0f / image_pixels.y);
+
+			auto sampler = unique_ptr<Sampler>(Sampler::constructSampler(args.sampling_pattern, args.num_samples));
+			renderScanline(ray_tracer, scene, args, sampler.get(), band_start + row, row,
+				band.image.get(), band.depth_image.get(), band.normals_image.get());
+			++lines_done;
+		}
+
+		// Hand the band over to the writer thread once it has finished with the previous one.
+		if (writer.valid())
+			writer.get();
+		writer = async(launch::async, [&band, num_rows, &image_writer, &pfm_writer, &depth_writer, &normals_writer]() {
+			if (image_writer)	image_writer->writeRows(*band.image, num_rows);
+			if (pfm_writer)		pfm_writer->writeRows(*band.image, num_rows);
+			if (depth_writer)	depth_writer->writeRows(*band.depth_image, num_rows);
+			if (normals_writer)	normals_writer->writeRows(*band.normals_image, num_rows);
+			if (hasError())
+				::printf("Error writing output: %s\n", clearError().getPtr());
+		});
+	}
+	if (writer.valid())
+		writer.get();
+}
+
+// The full-frame images of the in-memory render path.
+struct FrameImages {
+	unique_ptr<Image> image, depth_image, normals_image;
+};
+
+void allocateImages(const Args& args, FrameImages& images) {
+	auto image_pixels = Vec2i(args.width, args.height);
+
+	// Construct images
+	if (!args.output_file.empty() || !args.pfm_file.empty()) {
+		images.image.reset(new Image(image_pixels, ImageFormat::RGBA_Vec4f));
+		images.image->clear(Vec4f());
 	}
 	if (!args.depth_file.empty()) {
-		depth_image.reset(new Image(image_pixels, ImageFormat::RGBA_Vec4f));
-		depth_image->clear(Vec4f());
+		images.depth_image.reset(new Image(image_pixels, ImageFormat::RGBA_Vec4f));
+		images.depth_image->clear(Vec4f());
 	}
 	if (!args.normals_file.empty()) {
-		normals_image.reset(new Image(image_pixels, ImageFormat::RGBA_Vec4f));
-		normals_image->clear(Vec4f());
+		images.normals_image.reset(new Image(image_pixels, ImageFormat::RGBA_Vec4f));
+		images.normals_image->clear(Vec4f());
 	}
+}
+
+void traceImages(RayTracer& ray_tracer, SceneParser& scene, const Args& args, FrameImages& images) {
+	auto image_pixels = Vec2i(args.width, args.height);
 
 	// EXTRA
 	// The Filter and Film objects are not used by the starter code. They provide starting points
@@ -113,102 +305,112 @@ GLuint render(RayTracer& ray_tracer, SceneParser& scene, const Args& args) {
 		// Construct sampler.
 		auto sampler = unique_ptr<Sampler>(Sampler::constructSampler(args.sampling_pattern, args.num_samples));
 
-		// Loop over pixels on a scanline
-		for (int i = 0; i < args.width; ++i) {
-			// Loop through all the samples for this pixel.
-			Vec3f sample_color = Vec3f(0.0f);
-			for (int n = 0; n < args.num_samples; ++n) {
-				// Get the offset of the sample inside the pixel. 
-				// You need to fill in the implementation for this function when implementing supersampling.
-				// The starter implementation only supports one sample per pixel through the pixel center.
-				Vec2f offset = sampler->getSamplePosition(n);
-
-				// Convert floating-point pixel coordinate to canonical view coordinates in [-1,1]^2
-				// You need to fill in the implementation for Camera::normalizedImageCoordinateFromPixelCoordinate.
-				Vec2f ray_xy = Camera::normalizedImageCoordinateFromPixelCoordinate(Vec2f(float(i), float(j)) + offset, image_pixels);
-
-				// Generate the ray using the view coordinates
-				// You need to fill in the implementation for this function.
-				Ray r = scene.getCamera()->generateRay(ray_xy);
-
-				// Trace the ray!
-				Hit hit;
-				float tmin = scene.getCamera()->getTMin();
-
-				// You should fill in the gaps in the implementation of traceRay().
-				// args.bounces gives the maximum number of reflections/refractions that should be traced.
-				sample_color += ray_tracer.traceRay(r, tmin, args.bounces, 1.0f, hit, Vec3f(1.0f));
-
-				// YOUR CODE HERE (R9)
-				// This starter code only supports one sample per pixel and consequently directly
-				// puts the returned color to the image. You should extend this code to handle
-				// multiple samples per pixel. Also sample the depth and normal visualization like the color.
-				// The requirement is just to take an average of all the samples within the pixel
-				// (so-called "box filtering"). Note that this starter code does not take an average,
-				// it just assumes the first and only sample is the final color.
-
-				//image->setVec4f(Vec2i(i, j), Vec4f(image->getVec4f(Vec2f(i, j)) + Vec4f(sample_color / args.num_samples, 1)));
-
-				// For extra credit, you can implement more sophisticated ones, such as "tent" and bicubic
-				// "Mitchell-Netravali" filters. This requires you to implement the addSample()
-				// function in the Film class and use it instead of directly setting pixel values in the image.
-
-				// YOUR CODE HERE (R0)
-				// If args.display_uv is true, we want to render a test UV image where the color of each pixel
-				// is a simple function of its position in the image. The red component should linearly increase
-				// from 0 to 1 with the x coordinate increasing from 0 to args.width. Likewise the green component
-				// should linearly increase from 0 to 1 as the y coordinate increases from 0 to args.height. Since
-				// our image is two-dimensional we can't map blue to a simple linear function and just set it to 1.
-
-				//if (args.display_uv)
-				//	sample_color = ...
-				if (args.display_uv)
-					sample_color = Vec3f(float(i) / (args.width - 1), float(j) / (args.height - 1), 1);
-
-
-				//image->setVec4f(Vec2i(i,j), Vec4f(sample_color, 1));
-				image->setVec4f(Vec2i(i, j), Vec4f(sample_color / (args.num_samples * 1.0f), 1));
-
-				if (depth_image) {
-					// YOUR CODE HERE (R2)
-					// Here you should linearly map the t range [depth_min, depth_max] to the inverted range [1,0] for visualization
-					// Note the inversion; closer objects should appear brighter.
-					float f = 0.0f;
-					if (hit.t >= args.depth_min && hit.t <= args.depth_max)
-						f = 1 - (hit.t - args.depth_min) / (args.depth_max - args.depth_min);
-
-					depth_image->setVec4f(Vec2i(i, j), Vec4f(Vec3f(f), 1));
-				}
-				if (normals_image) {
-					Vec3f normal = hit.normal;
-					Vec3f col(fabs(normal[0]), fabs(normal[1]), fabs(normal[2]));
-					col = col.clamp(Vec3f(0), Vec3f(1));
-					normals_image->setVec4f( Vec2i( i, j ), Vec4f( col, 1 ) );
-				}
-			}
-		}
+		renderScanline(ray_tracer, scene, args, sampler.get(), j, j, images.image.get(), images.depth_image.get(), images.normals_image.get());
 		++lines_done;
 	}
 
 	// YOUR CODE HERE (EXTRA)
 	// When you implement smarter filtering, you should normalize the filter weight
 	// carried in the 4th channel.
-	if (image) {
+	if (images.image) {
 	}
+}
 
+void writeImages(const Args& args, const FrameImages& images) {
 	// And finally, save the images as PNG!
-	if (image) {
+	if (images.image && !args.output_file.empty()) {
 		FW::File f(args.output_file.c_str(), FW::File::Create);
-		exportLodePngImage(f, image.get());
+		exportLodePngImage(f, images.image.get());
+	}
+	if (images.image && !args.pfm_file.empty()) {
+		FW::File f(args.pfm_file.c_str(), FW::File::Create);
+		exportPfmImage(f, images.image.get());
 	}
-	if (depth_image) { 
+	if (images.depth_image) { 
 		FW::File f(args.depth_file.c_str(), FW::File::Create);
-		exportLodePngImage(f, depth_image.get());
+		exportLodePngImage(f, images.depth_image.get());
 	}
-	if (normals_image) { 
+	if (images.normals_image) { 
 		FW::File f(args.normals_file.c_str(), FW::File::Create);
-		exportLodePngImage(f, normals_image.get());
+		exportLodePngImage(f, images.normals_image.get());
+	}
+}
+
+// "out.png" -> "out_0012.png"
+string frameFileName(const string& file, int frame) {
+	if (file.empty())
+		return file;
+	char number[16];
+	::sprintf(number, "_%04d", frame);
+	auto dot = file.find_last_of('.');
+	auto slash = file.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return file + number;
+	return file.substr(0, dot) + number + file.substr(dot);
+}
+
+} // namespace
+
+GLuint render(RayTracer& ray_tracer, SceneParser& scene, const Args& args) {
+	// Large renders go straight to disk without ever holding the full image.
+	if (args.stream_rows > 0) {
+		renderStreaming(ray_tracer, scene, args);
+		return 0;
+	}
+
+	FrameImages images;
+	allocateImages(args, images);
+	traceImages(ray_tracer, scene, args, images);
+	writeImages(args, images);
+
+	return images.image->createGLTexture();
+}
+
+// Renders a camera fly-through in one process. The scene and the tracer are set up
+// once and reused for every frame, and frame K is written out on a background thread
+// while frame K+1 is being traced.
+int renderSequence(RayTracer& ray_tracer, SceneParser& scene, const Args& args) {
+	CameraPath path(args.sequence_file.c_str());
+	if (path.numKeys() == 0 || !scene.getCamera()) {
+		cerr << "Cannot render sequence: no camera or no keys in " << args.sequence_file << endl;
+		return 0;
+	}
+	int num_frames = args.sequence_frames > 0 ? args.sequence_frames : path.numKeys();
+
+	// Two sets of frame buffers: one is being traced while the other is being written out.
+	FrameImages buffers[2];
+	future<void> writer;
+
+	for (int frame = 0; frame < num_frames; ++frame) {
+		path.apply(scene.getCamera(), frame, num_frames);
+
+		Args frame_args = args;
+		frame_args.output_file = frameFileName(args.output_file, frame);
+		frame_args.pfm_file = frameFileName(args.pfm_file, frame);
+		frame_args.depth_file = frameFileName(args.depth_file, frame);
+		frame_args.normals_file = frameFileName(args.normals_file, frame);
+
+		// Streamed frames already overlap tracing and output internally.
+		if (args.stream_rows > 0) {
+			renderStreaming(ray_tracer, scene, frame_args);
+			continue;
+		}
+
+		FrameImages& images = buffers[frame & 1];
+		if (frame < 2)
+			allocateImages(args, images);
+		traceImages(ray_tracer, scene, args, images);
+
+		if (writer.valid())
+			writer.get();
+		writer = async(launch::async, [&images, frame_args]() {
+			writeImages(frame_args, images);
+			if (hasError())
+				::printf("Error writing output: %s\n", clearError().getPtr());
+		});
 	}
+	if (writer.valid())
+		writer.get();
 
-	return image->createGLTexture();
+	return num_frames;
 }
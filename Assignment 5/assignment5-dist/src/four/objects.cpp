@@ -3,6 +3,8 @@
 #include "hit.hpp"
 #include "VecUtils.h"
 
+#include "base/FastMath.hpp"
+
 #include <cassert>
 
 using namespace std;
@@ -95,9 +97,15 @@ bool Sphere::intersect( const Ray& r, Hit& h, float tmin ) const {
 	if (radical < 0)
 		return false;
 
+#if FW_FAST_MATH
+	radical = fastSqrt(radical);
+	float inv_2a = fastRcp(2 * A);
+#else
 	radical = sqrtf(radical);
-	float t_m = ( -B - radical ) / ( 2 * A );
-	float t_p = ( -B + radical ) / ( 2 * A );
+	float inv_2a = 1.0f / (2 * A);
+#endif
+	float t_m = ( -B - radical ) * inv_2a;
+	float t_p = ( -B + radical ) * inv_2a;
 	Vec3f pt_m = r.pointAtParameter( t_m );
 	Vec3f pt_p = r.pointAtParameter( t_p );
 
@@ -116,7 +124,11 @@ bool Sphere::intersect( const Ray& r, Hit& h, float tmin ) const {
 	if (h.t > t  && t > tmin) {
 		Vec3f normal = r.pointAtParameter(t);
 		normal -= center_;
+#if FW_FAST_MATH
+		normal *= fastRsqrt(normal.lenSqr());
+#else
 		normal.normalize();
+#endif
 		h.set(t, this->material(), normal);
 		return true;
 	}
@@ -176,4 +188,14 @@ const Vec3f& Triangle::vertex(int i) const {
 	return vertices_[i];
 }
 
+bool TriangleMesh::intersect(const Ray& r, Hit& h, float tmin) const {
+	float t = h.t;
+	int triangle;
+	if (!bvh_.intersect(r, tmin, t, triangle))
+		return false;
+
+	h.set(t, material_, bvh_.normal(triangle));
+	return true;
+}
+
 
@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 
+#include "bvh.hpp"
 #include "material.hpp"
 #include "base/Math.hpp"
 #include "3d/Mesh.hpp"
@@ -160,3 +161,20 @@ private:
 	FW::Vec3f vertices_[3];
 	FW::Vec2f texcoords_[3];  
 };
+
+// A triangle mesh loaded from an .obj file. The triangles are stored flattened
+// inside a BVH instead of as individual Triangle objects.
+class TriangleMesh : public Object3D
+{
+public:
+	TriangleMesh(const std::vector<FW::Vec3f>& vertices, const std::vector<FW::Vec3i>& triangles,
+			Material* m, FW::Mesh<FW::VertexPNT>* mesh, Args::BVHLayoutType layout) :
+		Object3D(m, mesh), bvh_(vertices, triangles, layout) {}
+
+	bool intersect(const Ray& r, Hit& h, float tmin) const override;
+
+	const BVH& bvh() const { return bvh_; }
+
+private:
+	BVH bvh_;
+};
@@ -0,0 +1,326 @@
+#include "paging.hpp"
+
+#include "base/Defs.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace FW;
+
+namespace {
+
+const char	CLUSTER_MAGIC[8]	= { 'C', 'L', 'U', 'S', 'T', 'E', 'R', '2' };
+
+struct ClusterHeader
+{
+	char	magic[8];
+	int32_t	num_clusters;
+	int32_t	reserved;
+	int64_t	source_size;	// of the mesh the clusters were built from
+	int64_t	source_mtime;
+};
+
+bool statSource(const char* filename, int64_t& size, int64_t& mtime) {
+	struct _stat64 st;
+	if (_stat64(filename, &st) != 0)
+		return false;
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+// Triangles are stored as three vertex positions each.
+const int	TRIANGLE_BYTES		= 9 * sizeof(float);
+
+} // namespace
+
+//------------------------------------------------------------------------
+
+ClusterCache::Slot& ClusterCache::slot(const Key& key) const {
+	return key.first->slots_[key.second];
+}
+
+shared_ptr<const BVH> ClusterCache::get(const PagedMesh* mesh, int cluster) {
+	Key key(mesh, cluster);
+	Slot& s = slot(key);
+	uint64_t now = ticks_.fetch_add(1, memory_order_relaxed);
+
+	shared_ptr<const BVH> resident = atomic_load(&s.cluster);
+	if (resident) {
+		s.last_used.store(now, memory_order_relaxed);
+		return resident;
+	}
+
+	if (s.unreadable.load(memory_order_relaxed))
+		return resident;
+
+	// Load outside the lock so that other threads can keep using resident clusters.
+	++misses_;
+	shared_ptr<const BVH> loaded = mesh->loadCluster(cluster);
+
+	lock_guard<mutex> lock(mutex_);
+	resident = atomic_load(&s.cluster);
+	if (resident) {
+		// Another thread paged it in meanwhile.
+		s.last_used.store(now, memory_order_relaxed);
+		return resident;
+	}
+	if (!loaded) {
+		s.unreadable.store(true, memory_order_relaxed);
+		return loaded;
+	}
+	s.bytes = loaded->memoryBytes();
+	s.last_used.store(now, memory_order_relaxed);
+	atomic_store(&s.cluster, loaded);
+	resident_keys_.push_back(key);
+	resident_ += s.bytes;
+
+	// Evict the least recently used, but always keep the cluster we just loaded.
+	while (resident_ > budget_ && resident_keys_.size() > 1) {
+		size_t victim = 0;
+		uint64_t oldest = UINT64_MAX;
+		for (size_t i = 0; i < resident_keys_.size(); ++i) {
+			uint64_t t = slot(resident_keys_[i]).last_used.load(memory_order_relaxed);
+			if (t < oldest && resident_keys_[i] != key) {
+				oldest = t;
+				victim = i;
+			}
+		}
+		Slot& v = slot(resident_keys_[victim]);
+		resident_ -= v.bytes;
+		atomic_store(&v.cluster, shared_ptr<const BVH>());
+		resident_keys_[victim] = resident_keys_.back();
+		resident_keys_.pop_back();
+	}
+	peak_resident_ = std::max(peak_resident_, resident_);
+	return loaded;
+}
+
+size_t ClusterCache::residentBytes() const {
+	lock_guard<mutex> lock(mutex_);
+	return resident_;
+}
+
+size_t ClusterCache::peakResidentBytes() const {
+	lock_guard<mutex> lock(mutex_);
+	return peak_resident_;
+}
+
+void ClusterCache::printStats() const {
+	int64_t h = hits(), m = misses();
+	::printf("Cluster cache: %lld hits, %lld misses (%.1f%% hit rate), peak %d KB of %d KB budget\n",
+		(long long)h, (long long)m, h + m > 0 ? 100.0 * h / double(h + m) : 0.0,
+		int(peakResidentBytes() / 1024), int(budget_ / 1024));
+}
+
+//------------------------------------------------------------------------
+
+PagedMesh::PagedMesh(const char* filename, Material* m, ClusterCache* cache, Args::BVHLayoutType layout) :
+	Object3D(m), stack_size_(0), cache_(cache), layout_(layout)
+{
+	file_.reset(new File(filename, File::Read));
+	ClusterHeader header;
+	if (hasError() || file_->read(&header, sizeof(header)) != sizeof(header) ||
+		memcmp(header.magic, CLUSTER_MAGIC, sizeof(CLUSTER_MAGIC)) != 0 || header.num_clusters < 0)
+	{
+		::printf("Cannot read cluster file %s\n", filename);
+		clearError();
+		file_.reset();
+		return;
+	}
+
+	clusters_.resize(header.num_clusters);
+	int table_bytes = int(clusters_.size() * sizeof(ClusterInfo));
+	if (file_->read(clusters_.data(), table_bytes) != table_bytes) {
+		::printf("Truncated cluster table in %s\n", filename);
+		clearError();
+		clusters_.clear();
+		file_.reset();
+		return;
+	}
+
+	slots_.reset(new ClusterCache::Slot[clusters_.size()]);
+
+	vector<AABB> boxes(clusters_.size());
+	for (size_t i = 0; i < clusters_.size(); ++i)
+		boxes[i] = AABB(clusters_[i].lo, clusters_[i].hi);
+	// The traversal pushes both children of a node, and defers at most one per level.
+	stack_size_ = BVH::buildNodes(boxes, order_, nodes_, 1) + 1;
+}
+
+shared_ptr<const BVH> PagedMesh::loadCluster(int cluster) const {
+	const ClusterInfo& info = clusters_[cluster];
+	vector<Vec3f> vertices(info.num_triangles * 3);
+	{
+		lock_guard<mutex> lock(file_mutex_);
+		int bytes = info.num_triangles * TRIANGLE_BYTES;
+		file_->seek(info.offset);
+		if (hasError() || file_->read(vertices.data(), bytes) != bytes) {
+			::printf("Truncated cluster %d in %s\n", cluster, file_->getName().getPtr());
+			clearError();
+			return nullptr;
+		}
+	}
+
+	vector<Vec3i> triangles(info.num_triangles);
+	for (int i = 0; i < info.num_triangles; ++i)
+		triangles[i] = Vec3i(3 * i, 3 * i + 1, 3 * i + 2);
+	return make_shared<const BVH>(vertices, triangles, layout_);
+}
+
+template <class Visit, class TMax>
+void PagedMesh::traverse(const Ray& r, float tmin, TMax tmax, Visit visit) const {
+	if (nodes_.empty())
+		return;
+
+	Vec3f inv_dir = Vec3f(1.0f) / r.direction;
+	BVHStack stack(stack_size_);
+	int sp = 0;
+
+	float tnear;
+	if (!intersectBox(nodes_[0].lo, nodes_[0].hi, r.origin, inv_dir, tmin, tmax(), tnear))
+		return;
+	stack[sp++] = { 0, tnear };
+
+	while (sp > 0) {
+		BVHStackEntry e = stack[--sp];
+		if (e.tnear > tmax())
+			continue;
+
+		const BVH::Node& n = nodes_[e.node];
+		if (n.count > 0) {
+			for (int i = n.first; i < n.first + n.count; ++i) {
+				// Test the cluster's own box before paging it in.
+				int c = order_[i];
+				if (intersectBox(clusters_[c].lo, clusters_[c].hi, r.origin, inv_dir, tmin, tmax(), tnear))
+					visit(c);
+			}
+			continue;
+		}
+
+		// Push the farther child first so that the nearer one is visited first.
+		int left = e.node + 1, right = n.first;
+		float tl, tr;
+		bool hl = intersectBox(nodes_[left].lo, nodes_[left].hi, r.origin, inv_dir, tmin, tmax(), tl);
+		bool hr = intersectBox(nodes_[right].lo, nodes_[right].hi, r.origin, inv_dir, tmin, tmax(), tr);
+		if (hl && hr && tr < tl) {
+			swap(left, right);
+			swap(tl, tr);
+			swap(hl, hr);
+		}
+		assert(sp + 2 <= stack_size_);
+		if (hr) stack[sp++] = { right, tr };
+		if (hl) stack[sp++] = { left, tl };
+	}
+}
+
+bool PagedMesh::intersect(const Ray& r, Hit& h, float tmin) const {
+	float t = h.t;
+	shared_ptr<const BVH> best;
+	int best_triangle = -1;
+
+	traverse(r, tmin, [&]() { return t; }, [&](int c) {
+		shared_ptr<const BVH> cluster = cache_->get(this, c);
+		int triangle;
+		if (cluster && cluster->intersect(r, tmin, t, triangle)) {
+			best = cluster;
+			best_triangle = triangle;
+		}
+	});
+
+	if (!best)
+		return false;
+	h.set(t, material_, best->normal(best_triangle));
+	return true;
+}
+
+bool PagedMesh::isUpToDate(const char* filename, const char* source_filename) {
+	int64_t size, mtime;
+	if (!statSource(source_filename, size, mtime))
+		return false;
+
+	FILE* file = fopen(filename, "rb");
+	if (file == nullptr)
+		return false;
+	ClusterHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, CLUSTER_MAGIC, sizeof(CLUSTER_MAGIC)) == 0 &&
+		header.source_size == size && header.source_mtime == mtime;
+	fclose(file);
+	return ok;
+}
+
+bool PagedMesh::writeClusters(const char* filename, const char* source_filename, const vector<Vec3f>& vertices, const vector<Vec3i>& triangles, int cluster_size) {
+	// Group the triangles with the same SAH builder, using big leaves as clusters.
+	vector<AABB> boxes(triangles.size());
+	for (size_t i = 0; i < triangles.size(); ++i) {
+		boxes[i].grow(vertices[triangles[i][0]]);
+		boxes[i].grow(vertices[triangles[i][1]]);
+		boxes[i].grow(vertices[triangles[i][2]]);
+	}
+	vector<int> order;
+	vector<BVH::Node> nodes;
+	BVH::buildNodes(boxes, order, nodes, cluster_size);
+
+	vector<ClusterInfo> clusters;
+	vector<int> first;		// first triangle of each cluster in `order`
+	int64_t offset = 0;
+	for (const BVH::Node& n : nodes) {
+		if (n.count == 0)
+			continue;
+		ClusterInfo info;
+		info.lo = n.lo;
+		info.hi = n.hi;
+		info.offset = offset;	// relative to the data section for now
+		info.num_triangles = n.count;
+		info.pad = 0;
+		clusters.push_back(info);
+		first.push_back(n.first);
+		offset += int64_t(n.count) * TRIANGLE_BYTES;
+	}
+
+	ClusterHeader header;
+	memcpy(header.magic, CLUSTER_MAGIC, sizeof(CLUSTER_MAGIC));
+	header.num_clusters = int32_t(clusters.size());
+	header.reserved = 0;
+	if (!statSource(source_filename, header.source_size, header.source_mtime)) {
+		::printf("Cannot stat %s\n", source_filename);
+		return false;
+	}
+	int64_t data_start = sizeof(header) + clusters.size() * sizeof(ClusterInfo);
+
+	for (ClusterInfo& info : clusters)
+		info.offset += data_start;
+
+	File file(filename, File::Create);
+	if (hasError()) {
+		::printf("Cannot write cluster file %s\n", filename);
+		clearError();
+		return false;
+	}
+	file.write(&header, sizeof(header));
+	file.write(clusters.data(), int(clusters.size() * sizeof(ClusterInfo)));
+
+	vector<Vec3f> buffer;
+	for (size_t i = 0; i < clusters.size(); ++i) {
+		buffer.clear();
+		for (int j = first[i]; j < first[i] + clusters[i].num_triangles; ++j) {
+			const Vec3i& tri = triangles[order[j]];
+			buffer.push_back(vertices[tri[0]]);
+			buffer.push_back(vertices[tri[1]]);
+			buffer.push_back(vertices[tri[2]]);
+		}
+		file.write(buffer.data(), int(buffer.size() * sizeof(Vec3f)));
+	}
+	file.flush();
+
+	if (hasError()) {
+		::printf("Error writing cluster file %s: %s\n", filename, clearError().getPtr());
+		return false;
+	}
+	return true;
+}
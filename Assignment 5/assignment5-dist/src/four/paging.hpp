@@ -0,0 +1,125 @@
+#pragma once
+
+#include "args.hpp"
+#include "bvh.hpp"
+#include "hit.hpp"
+#include "objects.hpp"
+
+#include "io/File.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class PagedMesh;
+
+// Least-recently-used cache of mesh clusters, shared by all the paged meshes of a scene.
+// Clusters are paged in on demand and evicted once the resident size exceeds the budget.
+// A cluster that is evicted while a ray is still intersecting it stays alive until that
+// ray lets go of it.
+//
+// Hits take no lock: each cluster has a slot in its mesh that holds the resident cluster
+// and the tick it was last used at. The lock is only taken on a miss, which inserts the
+// loaded cluster and evicts the resident clusters with the oldest ticks.
+class ClusterCache
+{
+public:
+	struct Slot
+	{
+		Slot() : last_used(0), unreadable(false), bytes(0) {}
+
+		std::shared_ptr<const BVH>	cluster;		// accessed with std::atomic_load/atomic_store
+		std::atomic<uint64_t>		last_used;
+		std::atomic<bool>			unreadable;		// loading failed, don't retry
+		size_t						bytes;			// guarded by the cache's mutex
+	};
+
+	ClusterCache(size_t budget_bytes) : budget_(budget_bytes), resident_(0), peak_resident_(0), ticks_(0), misses_(0) {}
+
+	// Return the cluster, paging it in if it is not resident. Null if it cannot be read.
+	std::shared_ptr<const BVH> get(const PagedMesh* mesh, int cluster);
+
+	size_t budgetBytes() const { return budget_; }
+	size_t residentBytes() const;
+	size_t peakResidentBytes() const;
+	int64_t hits() const { return int64_t(ticks_) - misses_; }
+	int64_t misses() const { return misses_; }
+
+	void printStats() const;
+
+private:
+	typedef std::pair<const PagedMesh*, int> Key;
+
+	Slot& slot(const Key& key) const;
+
+	mutable std::mutex		mutex_;
+	std::vector<Key>		resident_keys_;
+	size_t					budget_;
+	size_t					resident_;
+	size_t					peak_resident_;
+	std::atomic<uint64_t>	ticks_;			// one per get(), used to stamp the slots
+	std::atomic<int64_t>	misses_;
+};
+
+// A triangle mesh that lives on disk and is paged in one cluster at a time.
+//
+// writeClusters() splits a mesh into spatially coherent clusters and writes them to a
+// cluster file: a header, a table of cluster bounds and file offsets, and the triangles
+// of each cluster. A PagedMesh keeps only the table and a BVH over the cluster bounds in
+// memory. When a ray reaches a cluster, the cluster is fetched through the ClusterCache,
+// which loads its triangles and builds a BVH over them.
+class PagedMesh : public Object3D
+{
+public:
+	PagedMesh(const char* filename, Material* m, ClusterCache* cache, Args::BVHLayoutType layout);
+
+	bool intersect(const Ray& r, Hit& h, float tmin) const override;
+
+	bool isOpen() const { return file_ && !clusters_.empty(); }
+	int numClusters() const { return int(clusters_.size()); }
+
+	// Memory held permanently: the cluster table and the top-level hierarchy.
+	size_t tableBytes() const { return clusters_.size() * sizeof(ClusterInfo) + nodes_.size() * sizeof(BVH::Node) + order_.size() * sizeof(int); }
+
+	// Read a cluster's triangles from disk and build its BVH, or return null if the file is
+	// truncated. Called by the cache.
+	std::shared_ptr<const BVH> loadCluster(int cluster) const;
+
+	// Split the mesh read from source_filename into clusters of about cluster_size triangles
+	// and write them to a cluster file. The size and modification time of the source are
+	// recorded in the header.
+	static bool writeClusters(const char* filename, const char* source_filename, const std::vector<FW::Vec3f>& vertices,
+		const std::vector<FW::Vec3i>& triangles, int cluster_size = 4096);
+
+	// Whether the cluster file exists and was built from the current version of source_filename.
+	static bool isUpToDate(const char* filename, const char* source_filename);
+
+private:
+	friend class ClusterCache;
+
+	struct ClusterInfo
+	{
+		FW::Vec3f	lo;
+		FW::Vec3f	hi;
+		int64_t		offset;			// file offset of the triangle data
+		int32_t		num_triangles;
+		int32_t		pad;
+	};
+
+	// Call visit(cluster) for each cluster whose bounds the ray enters before tmax(),
+	// roughly front to back. tmax is re-read after every visit.
+	template <class Visit, class TMax>
+	void traverse(const Ray& r, float tmin, TMax tmax, Visit visit) const;
+
+	std::unique_ptr<FW::File>	file_;
+	mutable std::mutex			file_mutex_;
+	std::vector<ClusterInfo>	clusters_;
+	std::vector<BVH::Node>		nodes_;		// hierarchy over the cluster bounds
+	std::vector<int>			order_;		// cluster indices in leaf order
+	int							stack_size_;
+	std::unique_ptr<ClusterCache::Slot[]> slots_;	// one per cluster, owned by the cache
+	ClusterCache*				cache_;
+	Args::BVHLayoutType			layout_;
+};
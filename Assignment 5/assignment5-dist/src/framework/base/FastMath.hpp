@@ -0,0 +1,258 @@
+/*
+ *  Copyright (c) 2009-2011, NVIDIA Corporation
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of NVIDIA Corporation nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include "base/Math.hpp"
+
+//------------------------------------------------------------------------
+// Approximate math for hot shading and intersection code.
+//
+// Each function comes in a scalar version and in 4-wide (SSE2) and 8-wide
+// (AVX2) versions for packet code. The scalar versions evaluate the 4-wide
+// code in a single lane, so all widths return bit-identical results.
+//
+// Error bounds, measured over all floats in the stated range (fastPow over
+// a dense sample of a <= 1e6, |b| < 200). fastRsqrt() and fastRcp() refine the hardware estimates,
+// which differ slightly between CPU vendors.
+//
+//  fastExp2(x)     relative error < 2.4e-7,                    x in [-126, 127], clamped outside
+//  fastLog2(x)     absolute error < 1.8e-7 * max(1, |log2(x)|), x positive and normal
+//  fastExp(x)      relative error < 3.0e-7 * max(1, |x|),      x in [-87, 88]
+//  fastLog(x)      absolute error < 2.0e-7 * max(1, |log(x)|),  x positive and normal
+//  fastPow(a, b)   relative error < 2.4e-7 + 2.5e-7 * |b * log2(a)|, a >= 0; fastPow(0, b) = 0
+//  fastRsqrt(x)    relative error < 2.8e-7,                    x positive and normal
+//  fastRcp(x)      relative error < 2.0e-7,                    x and 1/x normal
+//  fastSqrt(x)     relative error < 3.2e-7,                    x >= 0
+//
+// Define FW_FAST_MATH to 1 to make the ray tracer's shading and intersection
+// code use these instead of the exact library functions.
+//------------------------------------------------------------------------
+
+#ifndef FW_FAST_MATH
+#   define FW_FAST_MATH 0
+#endif
+
+#if !FW_CUDA && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#   define FW_SSE 1
+#   include <emmintrin.h>
+#else
+#   define FW_SSE 0
+#endif
+
+#if FW_SSE && defined(__AVX2__)
+#   define FW_AVX2 1
+#   include <immintrin.h>
+#else
+#   define FW_AVX2 0
+#endif
+
+namespace FW
+{
+//------------------------------------------------------------------------
+// Polynomial coefficients, fitted for minimax relative error.
+
+// 2^f for f in [-0.5, 0.5].
+static const F32 s_exp2C0 = 1.000000072e+00f;
+static const F32 s_exp2C1 = 6.931469671e-01f;
+static const F32 s_exp2C2 = 2.402211972e-01f;
+static const F32 s_exp2C3 = 5.550713292e-02f;
+static const F32 s_exp2C4 = 9.675541682e-03f;
+static const F32 s_exp2C5 = 1.327646720e-03f;
+
+// log2(m) = t * P(t^2) with t = (m - 1) / (m + 1), for m in [sqrt(1/2), sqrt(2)].
+static const F32 s_log2C0 = 2.885390424e+00f;
+static const F32 s_log2C1 = 9.615883272e-01f;
+static const F32 s_log2C2 = 5.957807140e-01f;
+
+#if FW_SSE
+//------------------------------------------------------------------------
+// 4-wide.
+
+inline __m128 fastExp2(__m128 x)
+{
+    // Split into an integer part, which goes into the exponent, and a fraction in [-0.5, 0.5].
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+    __m128i n = _mm_cvtps_epi32(x);
+    __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(n));
+
+    __m128 p = _mm_set1_ps(s_exp2C5);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(s_exp2C4));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(s_exp2C3));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(s_exp2C2));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(s_exp2C1));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(s_exp2C0));
+
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+    return _mm_mul_ps(p, scale);
+}
+
+inline __m128 fastLog2(__m128 x)
+{
+    // Split into exponent and mantissa, then move the mantissa from [1, 2) to [sqrt(1/2), sqrt(2)).
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F800000)));
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))));
+    e = _mm_add_ps(e, _mm_and_ps(big, _mm_set1_ps(1.0f)));
+
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 s = _mm_mul_ps(t, t);
+    __m128 p = _mm_set1_ps(s_log2C2);
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(s_log2C1));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(s_log2C0));
+    return _mm_add_ps(e, _mm_mul_ps(t, p));
+}
+
+inline __m128 fastExp     (__m128 x)            { return fastExp2(_mm_mul_ps(x, _mm_set1_ps(1.44269504f))); }
+inline __m128 fastLog     (__m128 x)            { return _mm_mul_ps(fastLog2(x), _mm_set1_ps(0.693147181f)); }
+inline __m128 fastPow     (__m128 a, __m128 b)  { return _mm_and_ps(_mm_cmpgt_ps(a, _mm_setzero_ps()), fastExp2(_mm_mul_ps(b, fastLog2(a)))); }
+
+inline __m128 fastRsqrt(__m128 x)
+{
+    // Hardware estimate (12 bits) refined with one Newton-Raphson step.
+    __m128 y = _mm_rsqrt_ps(x);
+    __m128 xyy = _mm_mul_ps(_mm_mul_ps(x, y), y);
+    return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), _mm_sub_ps(_mm_set1_ps(3.0f), xyy));
+}
+
+inline __m128 fastRcp(__m128 x)
+{
+    __m128 y = _mm_rcp_ps(x);
+    return _mm_add_ps(y, _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(x, y))));
+}
+
+inline __m128 fastSqrt(__m128 x)
+{
+    // Clamping keeps sqrt(0) from turning into 0 * inf.
+    return _mm_mul_ps(x, fastRsqrt(_mm_max_ps(x, _mm_set1_ps(FLT_MIN))));
+}
+
+// Converts an RGBA color to ABGR_8888, rounding like Image::setChannels().
+inline U32 fastToABGR(__m128 rgba)
+{
+    __m128 v = _mm_add_ps(_mm_mul_ps(rgba, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f));
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    __m128i i = _mm_cvttps_epi32(v);
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    return (U32)_mm_cvtsi128_si32(i);
+}
+
+//------------------------------------------------------------------------
+// Scalar, evaluated in one SSE lane.
+
+inline F32 fastExp2     (F32 a)         { return _mm_cvtss_f32(fastExp2(_mm_set_ss(a))); }
+inline F32 fastLog2     (F32 a)         { return _mm_cvtss_f32(fastLog2(_mm_set_ss(a))); }
+inline F32 fastExp      (F32 a)         { return _mm_cvtss_f32(fastExp(_mm_set_ss(a))); }
+inline F32 fastLog      (F32 a)         { return _mm_cvtss_f32(fastLog(_mm_set_ss(a))); }
+inline F32 fastPow      (F32 a, F32 b)  { return _mm_cvtss_f32(fastPow(_mm_set_ss(a), _mm_set_ss(b))); }
+inline F32 fastRsqrt    (F32 a)         { return _mm_cvtss_f32(fastRsqrt(_mm_set_ss(a))); }
+inline F32 fastRcp      (F32 a)         { return _mm_cvtss_f32(fastRcp(_mm_set_ss(a))); }
+inline F32 fastSqrt     (F32 a)         { return _mm_cvtss_f32(fastSqrt(_mm_set_ss(a))); }
+
+#else
+//------------------------------------------------------------------------
+// No SSE: fall back to the exact functions.
+
+FW_CUDA_FUNC F32 fastExp2   (F32 a)         { return exp2(a); }
+FW_CUDA_FUNC F32 fastLog2   (F32 a)         { return log2(a); }
+FW_CUDA_FUNC F32 fastExp    (F32 a)         { return exp(a); }
+FW_CUDA_FUNC F32 fastLog    (F32 a)         { return log(a); }
+FW_CUDA_FUNC F32 fastPow    (F32 a, F32 b)  { return (a > 0.0f) ? pow(a, b) : 0.0f; }
+FW_CUDA_FUNC F32 fastRsqrt  (F32 a)         { return 1.0f / sqrt(a); }
+FW_CUDA_FUNC F32 fastRcp    (F32 a)         { return 1.0f / a; }
+FW_CUDA_FUNC F32 fastSqrt   (F32 a)         { return sqrt(a); }
+
+#endif
+
+#if FW_AVX2
+//------------------------------------------------------------------------
+// 8-wide, same algorithms as the 4-wide versions.
+
+inline __m256 fastExp2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(127.0f));
+    __m256i n = _mm256_cvtps_epi32(x);
+    __m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(n));
+
+    __m256 p = _mm256_set1_ps(s_exp2C5);
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(s_exp2C4));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(s_exp2C3));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(s_exp2C2));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(s_exp2C1));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(s_exp2C0));
+
+    __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23));
+    return _mm256_mul_ps(p, scale);
+}
+
+inline __m256 fastLog2(__m256 x)
+{
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F800000)));
+    __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+    m = _mm256_sub_ps(m, _mm256_and_ps(big, _mm256_mul_ps(m, _mm256_set1_ps(0.5f))));
+    e = _mm256_add_ps(e, _mm256_and_ps(big, _mm256_set1_ps(1.0f)));
+
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+    __m256 s = _mm256_mul_ps(t, t);
+    __m256 p = _mm256_set1_ps(s_log2C2);
+    p = _mm256_add_ps(_mm256_mul_ps(p, s), _mm256_set1_ps(s_log2C1));
+    p = _mm256_add_ps(_mm256_mul_ps(p, s), _mm256_set1_ps(s_log2C0));
+    return _mm256_add_ps(e, _mm256_mul_ps(t, p));
+}
+
+inline __m256 fastExp     (__m256 x)            { return fastExp2(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f))); }
+inline __m256 fastLog     (__m256 x)            { return _mm256_mul_ps(fastLog2(x), _mm256_set1_ps(0.693147181f)); }
+inline __m256 fastPow     (__m256 a, __m256 b)  { return _mm256_and_ps(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GT_OQ), fastExp2(_mm256_mul_ps(b, fastLog2(a)))); }
+
+inline __m256 fastRsqrt(__m256 x)
+{
+    __m256 y = _mm256_rsqrt_ps(x);
+    __m256 xyy = _mm256_mul_ps(_mm256_mul_ps(x, y), y);
+    return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y), _mm256_sub_ps(_mm256_set1_ps(3.0f), xyy));
+}
+
+inline __m256 fastRcp(__m256 x)
+{
+    __m256 y = _mm256_rcp_ps(x);
+    return _mm256_add_ps(y, _mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(x, y))));
+}
+
+inline __m256 fastSqrt(__m256 x)
+{
+    return _mm256_mul_ps(x, fastRsqrt(_mm256_max_ps(x, _mm256_set1_ps(FLT_MIN))));
+}
+
+#endif
+
+//------------------------------------------------------------------------
+}
@@ -26,6 +26,7 @@
  */
 
 #include "gui/Image.hpp"
+#include "base/FastMath.hpp"
 #include "gpu/CudaModule.hpp"
 #include "io/File.hpp"
 #include "io/ImageBinaryIO.hpp"
@@ -878,6 +879,22 @@ void Image::blit(
         return;
     }
 
+    // From float RGB(A) to an integer-based format => convert thru ABGR_8888 with SIMD.
+
+#if FW_SSE
+    if ((srcFormat.getID() == ImageFormat::RGB_Vec3f || srcFormat.getID() == ImageFormat::RGBA_Vec4f) &&
+        canBlitDirectly(dstFormat) && canBlitThruABGR(dstFormat))
+    {
+        Array<U32> tmp(NULL, size.x);
+        for (int y = 0; y < size.y; y++)
+        {
+            blitFloatToABGR(tmp.getPtr(), srcFormat, srcPtr + srcStride * y, size.x);
+            blitFromABGR(dstFormat, dstPtr + dstStride * y, tmp.getPtr(), size.x);
+        }
+        return;
+    }
+#endif
+
     // General case.
 
     S64 dstBPP = dstFormat.getBPP();
@@ -981,6 +998,33 @@ void Image::blitFromABGR(const ImageFormat& dstFormat, U8* dstPtr, const U32* sr
 
 //------------------------------------------------------------------------
 
+void Image::blitFloatToABGR(U32* dstPtr, const ImageFormat& srcFormat, const U8* srcPtr, int width)
+{
+    // Rounds like setChannels(), so the result matches the general case of blit().
+
+    FW_ASSERT(width > 0);
+    FW_ASSERT(dstPtr && srcPtr);
+
+    const Vec3f*    sv3 = (const Vec3f*)srcPtr;
+    const Vec4f*    sv4 = (const Vec4f*)srcPtr;
+
+#if FW_SSE
+    switch (srcFormat.getID())
+    {
+    case ImageFormat::RGB_Vec3f:    for (int x = width; x > 0; x--, sv3++) *dstPtr++ = fastToABGR(_mm_set_ps(1.0f, sv3->z, sv3->y, sv3->x)); break;
+    case ImageFormat::RGBA_Vec4f:   for (int x = width; x > 0; x--) *dstPtr++ = fastToABGR(_mm_loadu_ps((const F32*)sv4++)); break;
+    default:                        FW_ASSERT(false); break;
+    }
+#else
+    FW_UNREF(srcFormat);
+    FW_UNREF(sv3);
+    FW_UNREF(sv4);
+    FW_ASSERT(false);
+#endif
+}
+
+//------------------------------------------------------------------------
+
 void Image::getChannels(F32* values, const U8* pixelPtr, const ImageFormat& format, int first, int num)
 {
     FW_ASSERT(num >= 0);
@@ -198,6 +198,7 @@ private:
 
     static void         blitToABGR      (U32* dstPtr,  const ImageFormat& srcFormat, const U8* srcPtr, int width);
     static void         blitFromABGR    (const ImageFormat& dstFormat, U8* dstPtr, const U32* srcPtr, int width);
+    static void         blitFloatToABGR (U32* dstPtr, const ImageFormat& srcFormat, const U8* srcPtr, int width);
 
     static void         getChannels     (F32* values, const U8* pixelPtr, const ImageFormat& format, int first, int num);
     static void         setChannels     (U8* pixelPtr, const F32* values, const ImageFormat& format, int first, int num);
@@ -27,6 +27,7 @@
 
 #include "io/ImagePfmIO.hpp"
 #include "gui/Image.hpp"
+#include "io/File.hpp"
 #include "io/Stream.hpp"
 
 using namespace FW;
@@ -183,3 +184,53 @@ void FW::exportPfmImage(OutputStream& stream, const Image* image)
 }
 
 //------------------------------------------------------------------------
+
+PfmStreamWriter::PfmStreamWriter(File& file, const Vec2i& size)
+:   m_file              (file),
+    m_size              (size),
+    m_headerSize        (0),
+    m_numRowsWritten    (0)
+{
+    FW_ASSERT(size.min() > 0);
+    m_scanline.reset(size.x);
+
+    // Write header and reserve space for the raster.
+
+    bool bigEndian = (*(const U32*)"\x01\x02\x03\x04" == 0x01020304);
+    String header = sprintf("PF\n%d %d\n%g\n", size.x, size.y, (bigEndian) ? 1.0f : -1.0f);
+    m_file.write(header.getPtr(), header.getLength());
+    m_headerSize = header.getLength();
+    m_file.setSize(m_headerSize + (S64)size.x * size.y * sizeof(Vec3f));
+}
+
+//------------------------------------------------------------------------
+
+PfmStreamWriter::~PfmStreamWriter(void)
+{
+    if (!isDone())
+        setError("PfmStreamWriter: Only %d of %d scanlines were written!", m_numRowsWritten, m_size.y);
+}
+
+//------------------------------------------------------------------------
+
+void PfmStreamWriter::writeRows(const Image& rows, int numRows)
+{
+    if (numRows < 0)
+        numRows = rows.getSize().y;
+
+    FW_ASSERT(rows.getSize().x == m_size.x && numRows <= rows.getSize().y);
+    FW_ASSERT(m_numRowsWritten + numRows <= m_size.y);
+
+    // Write raster data in bottom-up order.
+
+    for (int y = 0; y < numRows; y++)
+    {
+        int fileRow = m_size.y - 1 - (m_numRowsWritten + y);
+        rows.read(ImageFormat::RGB_Vec3f, m_scanline.getPtr(), m_scanline.getNumBytes(), Vec2i(0, y), Vec2i(m_size.x, 1));
+        m_file.seek(m_headerSize + (S64)fileRow * m_size.x * sizeof(Vec3f));
+        m_file.write(m_scanline.getPtr(), m_scanline.getNumBytes());
+    }
+    m_numRowsWritten += numRows;
+}
+
+//------------------------------------------------------------------------
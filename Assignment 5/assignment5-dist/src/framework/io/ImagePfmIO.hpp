@@ -26,12 +26,14 @@
  */
 
 #pragma once
-#include "base/Defs.hpp"
+#include "base/Array.hpp"
+#include "base/Math.hpp"
 
 namespace FW
 {
 //------------------------------------------------------------------------
 
+class File;
 class Image;
 class InputStream;
 class OutputStream;
@@ -41,5 +43,32 @@ class OutputStream;
 Image*  importPfmImage  (InputStream& stream);
 void    exportPfmImage  (OutputStream& stream, const Image* image);
 
+//------------------------------------------------------------------------
+// Writes an RGB PFM incrementally in top-down bands of scanlines. PFM
+// stores the raster bottom-up, so the file is sized up front and each
+// band is written to its final position.
+
+class PfmStreamWriter
+{
+public:
+                    PfmStreamWriter     (File& file, const Vec2i& size);
+                    ~PfmStreamWriter    (void);
+
+    void            writeRows           (const Image& rows, int numRows = -1); // Appends the first numRows (default: all) rows of the given image.
+    int             getNumRowsWritten   (void) const    { return m_numRowsWritten; }
+    bool            isDone              (void) const    { return (m_numRowsWritten == m_size.y); }
+
+private:
+                    PfmStreamWriter     (const PfmStreamWriter&); // forbidden
+    PfmStreamWriter& operator=          (const PfmStreamWriter&); // forbidden
+
+private:
+    File&           m_file;
+    Vec2i           m_size;
+    S64             m_headerSize;
+    int             m_numRowsWritten;
+    Array<Vec3f>    m_scanline;
+};
+
 //------------------------------------------------------------------------
 }
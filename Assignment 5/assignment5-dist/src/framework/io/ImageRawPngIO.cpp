@@ -150,3 +150,117 @@ void FW::exportRawPngImage(OutputStream& stream, const Image* image)
 }
 
 //------------------------------------------------------------------------
+
+RawPngStreamWriter::RawPngStreamWriter(OutputStream& stream, const Vec2i& size, bool hasAlpha)
+:   m_out               (new Output(stream)),
+    m_size              (size),
+    m_format            ((hasAlpha) ? ImageFormat::R8_G8_B8_A8 : ImageFormat::R8_G8_B8),
+    m_blockLen          (size.x * ((hasAlpha) ? 4 : 3) + 1),
+    m_numRowsWritten    (0),
+    m_adlerA            (1),
+    m_adlerB            (0)
+{
+    FW_ASSERT(size.min() > 0);
+    if (size.x > (FW_S32_MAX - 1) / ((hasAlpha) ? 4 : 3))
+    {
+        setError("RawPngStreamWriter: Image width %d is too large!", size.x);
+        m_blockLen = 1;
+    }
+    m_scanline.reset(m_blockLen - 1);
+
+    // Write signature and header.
+
+    Output& out = *m_out;
+    out << 0x89 << 'P' << 'N' << 'G' << 0x0D << 0x0A << 0x1A << 0x0A;
+    out << 0x00 << 0x00 << 0x00 << 0x0D << 'I' << 'H' << 'D' << 'R';
+    out.resetCRC(0x575e51f5);
+    out.writeDWord(size.x);
+    out.writeDWord(size.y);
+    out << 8 << ((hasAlpha) ? 6 : 2) << 0 << 0 << 0;
+    out.writeDWord(~out.getCRC());
+}
+
+//------------------------------------------------------------------------
+
+RawPngStreamWriter::~RawPngStreamWriter(void)
+{
+    if (!isDone())
+        setError("RawPngStreamWriter: Only %d of %d scanlines were written!", m_numRowsWritten, m_size.y);
+    delete m_out;
+}
+
+//------------------------------------------------------------------------
+
+void RawPngStreamWriter::writeRows(const Image& rows, int numRows)
+{
+    if (numRows < 0)
+        numRows = rows.getSize().y;
+
+    FW_ASSERT(rows.getSize().x == m_size.x && numRows <= rows.getSize().y);
+    FW_ASSERT(m_numRowsWritten + numRows <= m_size.y);
+    if (numRows == 0 || m_blockLen <= 1) // the constructor rejected the size
+        return;
+
+    // Chunk header. The zlib header goes to the first chunk and the
+    // Adler-32 checksum to the last one.
+
+    bool first = (m_numRowsWritten == 0);
+    bool last = (m_numRowsWritten + numRows == m_size.y);
+
+    // A stored deflate block holds at most 65535 bytes, so a wide scanline
+    // (the filter byte and the pixels) is split over several blocks.
+
+    int blocksPerRow = (m_blockLen + MaxStoredBlockLen - 1) / MaxStoredBlockLen;
+    S64 chunkLen = (S64)numRows * (m_blockLen + 5 * blocksPerRow) + ((first) ? 2 : 0) + ((last) ? 4 : 0);
+    if (chunkLen > FW_S32_MAX)
+    {
+        setError("RawPngStreamWriter: A band of %d scanlines does not fit in one IDAT chunk!", numRows);
+        return;
+    }
+
+    Output& out = *m_out;
+    out.writeDWord((U32)chunkLen);
+    out.resetCRC(0xFFFFFFFFu);
+    out << 'I' << 'D' << 'A' << 'T';
+    if (first)
+        out << 0x78 << 0x01;
+
+    for (int y = 0; y < numRows; y++)
+    {
+        bool isFinalRow = (m_numRowsWritten + y == m_size.y - 1);
+        rows.read(m_format, m_scanline.getPtr(), m_scanline.getSize(), Vec2i(0, y), Vec2i(m_size.x, 1));
+        const U8* scanline = m_scanline.getPtr();
+
+        for (int start = 0; start < m_blockLen; start += MaxStoredBlockLen)
+        {
+            int len = min(m_blockLen - start, (int)MaxStoredBlockLen);
+            bool isFinal = (isFinalRow && start + len == m_blockLen);
+            out << ((isFinal) ? 1 : 0);
+            out << len << (len >> 8) << ~len << (~len >> 8);
+
+            for (int i = start; i < start + len; i++)
+            {
+                int byte = (i == 0) ? 0 : scanline[i - 1]; // filter type: none
+                out << byte;
+                m_adlerA = (m_adlerA + byte) % 65521;
+                m_adlerB = (m_adlerA + m_adlerB) % 65521;
+            }
+        }
+    }
+
+    if (last)
+        out << (m_adlerB >> 8) << m_adlerB << (m_adlerA >> 8) << m_adlerA;
+
+    out.writeDWord(~out.getCRC());
+    m_numRowsWritten += numRows;
+
+    // Write footer.
+
+    if (last)
+    {
+        out << 0x00 << 0x00 << 0x00 << 0x00;
+        out << 'I' << 'E' << 'N' << 'D' << 0xAE << 0x42 << 0x60 << 0x82;
+    }
+}
+
+//------------------------------------------------------------------------
@@ -26,18 +26,52 @@
  */
 
 #pragma once
-#include "base/Defs.hpp"
+#include "gui/Image.hpp"
 
 namespace FW
 {
 //------------------------------------------------------------------------
 
 class Image;
+class Output;
 class OutputStream;
 
 //------------------------------------------------------------------------
 
 void    exportRawPngImage   (OutputStream& stream, const Image* image);
 
+//------------------------------------------------------------------------
+// Writes an uncompressed PNG incrementally, one band of scanlines at a
+// time, so that the full image never needs to be resident. Each call to
+// writeRows() emits a single IDAT chunk; the footer is written after the
+// last scanline.
+
+class RawPngStreamWriter
+{
+public:
+                    RawPngStreamWriter  (OutputStream& stream, const Vec2i& size, bool hasAlpha);
+                    ~RawPngStreamWriter (void);
+
+    void            writeRows           (const Image& rows, int numRows = -1); // Appends the first numRows (default: all) rows of the given image.
+    int             getNumRowsWritten   (void) const    { return m_numRowsWritten; }
+    bool            isDone              (void) const    { return (m_numRowsWritten == m_size.y); }
+
+private:
+                    RawPngStreamWriter  (const RawPngStreamWriter&); // forbidden
+    RawPngStreamWriter& operator=       (const RawPngStreamWriter&); // forbidden
+
+private:
+    enum { MaxStoredBlockLen = 65535 };
+
+    Output*         m_out;
+    Vec2i           m_size;
+    ImageFormat::ID m_format;
+    int             m_blockLen;
+    int             m_numRowsWritten;
+    U32             m_adlerA;
+    U32             m_adlerB;
+    Array<U8>       m_scanline;
+};
+
 //------------------------------------------------------------------------
 }